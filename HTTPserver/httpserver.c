@@ -6,12 +6,29 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/xattr.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include "crc32c.h"
 #include "listener_socket.h"
-#include "iowrapper.h"
 #include "protocol.h"
+#include "proxy.h"
+#include "zcache.h"
+#include "sysio.h"
+#include "usdt.h"
 #define ERR_PORT "Invalid Port\n"
+#define ERR_BACKEND "Invalid Backend\n"
 #define MAX_HEADER_SIZE 2048
+// How long a kept-alive connection may sit idle before we close it, and how
+// many requests it may carry. Requests are served one connection at a time,
+// so an open connection holds up the rest; it is also closed as soon as
+// another client is waiting.
+#define KEEPALIVE_IDLE_MS 500
+#define KEEPALIVE_MAX_REQUESTS 100
+// Where a PUT leaves the body's CRC-32C, with the size and mtime it covers.
+#define DIGEST_XATTR "user.crc32c"
 
 static const char *BODY_200 = "OK\n";
 static const char *BODY_201 = "Created\n";
@@ -20,6 +37,7 @@ static const char *BODY_403 = "Forbidden\n";
 static const char *BODY_404 = "Not Found\n";
 static const char *BODY_500 = "Internal Server Error\n";
 static const char *BODY_501 = "Not Implemented\n";
+static const char *BODY_502 = "Bad Gateway\n";
 static const char *BODY_505 = "Version Not Supported\n";
 
 typedef enum {
@@ -30,6 +48,7 @@ typedef enum {
     S_NOT_FOUND = 404,
     S_INTERNAL_ERR = 500,
     S_NOT_IMPLEMENTED = 501,
+    S_BAD_GATEWAY = 502,
     S_VERSION_NOT_SUPP = 505
 } status_code_t;
 
@@ -39,42 +58,24 @@ typedef struct {
     char version[10];   
     size_t content_length;
     int have_content_length;
+    int keep_alive;
+    char accept_encoding[129]; // empty if not given
+    uint32_t crc;              // X-Checksum-Crc32c, if have_crc
+    int have_crc;
     int valid;
 } http_request_t;
 
-static int writen(int fd, const void *buf, size_t len) {
-    size_t total = 0;
-    const char *ptr = buf;
-    while (total < len) {
-        ssize_t n = write(fd, ptr + total, len - total);
-        if (n < 0) {
-            if (errno == EINTR) {
-                continue; 
-            }
-            return -1;
-        }
-        if (n == 0) {
-            return -1;
-        }
-        total += (size_t)n;
-    }
-    return 0;
-}
-static void drain_socket(int fd) {
-    char tmp[1024];
-    while (1) {
-        ssize_t n = read(fd, tmp, sizeof(tmp));
-        if (n == 0) {
-            break;
-        }
-        if (n < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            break;
-        }
-    }
-}
+// Set while the current connection is kept open after this response; cleared
+// when a handler can no longer tell where the next request starts.
+static int conn_keep_alive;
+
+// Non-NULL in front-end mode.
+static proxy_t *proxy;
+
+// The listening socket, to see whether other clients are waiting; -1 if
+// unknown.
+static int listen_fd = -1;
+
 static const char *status_phrase(int code) {
     switch (code) {
         case 200: return "OK";
@@ -84,6 +85,7 @@ static const char *status_phrase(int code) {
         case 404: return "Not Found";
         case 500: return "Internal Server Error";
         case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
         case 505: return "Version Not Supported";
         default:  return "Unknown";
     }
@@ -98,10 +100,21 @@ static const char *status_body(int code) {
         case 404: return BODY_404;
         case 500: return BODY_500;
         case 501: return BODY_501;
+        case 502: return BODY_502;
         case 505: return BODY_505;
         default:  return "Internal Server Error\n";
     }
 }
+// extra holds any further header lines, each ending in CRLF.
+static int format_header(char *buf, size_t size, int code, size_t body_len, const char *extra) {
+    return snprintf(buf, size,
+                    "HTTP/1.1 %d %s\r\n"
+                    "Content-Length: %zu\r\n"
+                    "%s%s"
+                    "\r\n",
+                    code, status_phrase(code), body_len, extra,
+                    conn_keep_alive ? "Connection: keep-alive\r\n" : "");
+}
 static void send_response(int fd, int code, const char *body, size_t body_len) {
     if (body == NULL) {
         body = status_body(code);
@@ -109,18 +122,10 @@ static void send_response(int fd, int code, const char *body, size_t body_len) {
     }
 
     char header_buf[512];
-    const char *phrase = status_phrase(code);
-    int n = snprintf(header_buf, sizeof(header_buf),
-                     "HTTP/1.1 %d %s\r\n"
-                     "Content-Length: %zu\r\n"
-                     "\r\n",
-                     code, phrase, body_len);
-    if (writen(fd, header_buf, (size_t)n) < 0) {
-        return; 
-    }
-    if (body_len > 0) {
-        writen(fd, body, body_len);
-    }
+    int n = format_header(header_buf, sizeof(header_buf), code, body_len, "");
+    USDT_PROBE2(httpserver, response, fd, code);
+    struct iovec iov[2] = { { header_buf, (size_t)n }, { (void *)body, body_len } };
+    sio_writev_full(fd, iov, 2);
 }
 
 static int validate_http_version(const char *v) {
@@ -185,6 +190,9 @@ static int parse_headers_and_request_line(const char *buf, http_request_t *req)
     req->version[0] = '\0';
     req->content_length   = 0;
     req->have_content_length = 0;
+    req->keep_alive = 0;
+    req->accept_encoding[0] = '\0';
+    req->have_crc = 0;
     req->valid = 0;
     const char *line_end = strstr(buf, "\r\n");
     if (!line_end) {
@@ -284,6 +292,21 @@ static int parse_headers_and_request_line(const char *buf, http_request_t *req)
             }
             req->content_length = (size_t)cl;
             req->have_content_length = 1;
+        } else if (strcasecmp(key, "X-Checksum-Crc32c") == 0) {
+            if (vlen != 8) {
+                return 400;
+            }
+            for (size_t i = 0; i < vlen; i++) {
+                if (!isxdigit((unsigned char)value[i])) {
+                    return 400;
+                }
+            }
+            req->crc = (uint32_t)strtoul(value, NULL, 16);
+            req->have_crc = 1;
+        } else if (strcasecmp(key, "Accept-Encoding") == 0) {
+            memcpy(req->accept_encoding, value, vlen + 1);
+        } else if (strcasecmp(key, "Connection") == 0) {
+            req->keep_alive = strcasecmp(value, "keep-alive") == 0;
         }
         cur = hdr_end + 2;
     }
@@ -298,8 +321,42 @@ static int parse_headers_and_request_line(const char *buf, http_request_t *req)
     return 0;
 }
 
-static int handle_get(int fd, const char *filepath) {
+// Records crc for fd's current contents. Without xattr support the file is
+// simply served without an ETag.
+static void store_digest(int fd, uint32_t crc) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return;
+    }
+    char val[64];
+    int n = snprintf(val, sizeof(val), "%08x %lld %lld.%09ld", crc, (long long)st.st_size,
+                     (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    fsetxattr(fd, DIGEST_XATTR, val, (size_t)n, 0);
+}
+
+// Reads back the digest stored by a PUT, if the file hasn't changed since.
+static int load_digest(int fd, const struct stat *st, uint32_t *crc) {
+    char val[64];
+    ssize_t n = fgetxattr(fd, DIGEST_XATTR, val, sizeof(val) - 1);
+    if (n <= 0) {
+        return -1;
+    }
+    val[n] = '\0';
+    unsigned int c;
+    long long size, sec;
+    long nsec;
+    if (sscanf(val, "%8x %lld %lld.%ld", &c, &size, &sec, &nsec) != 4
+        || size != (long long)st->st_size || sec != (long long)st->st_mtim.tv_sec
+        || nsec != st->st_mtim.tv_nsec) {
+        return -1;
+    }
+    *crc = c;
+    return 0;
+}
+
+static int handle_get(int fd, const char *filepath, int accept) {
     int file_fd = open(filepath, O_RDONLY);
+    USDT_PROBE2(httpserver, file_open, fd, file_fd < 0 ? -errno : file_fd);
     if (file_fd < 0) {
         if (errno == ENOENT) {
             send_response(fd, S_NOT_FOUND, NULL, 0);
@@ -324,223 +381,264 @@ static int handle_get(int fd, const char *filepath) {
         return S_FORBIDDEN;
     }
     size_t fsize = (size_t)st.st_size; 
+    uint32_t crc = 0;
+    int have_crc = load_digest(file_fd, &st, &crc) == 0;
+    // Send a precompressed variant if there is a current one; otherwise the
+    // raw file, while zcache makes one for next time.
+    const char *encoding = NULL;
+    size_t zsize = 0;
+    int zfd = zcache_open(filepath, &st, accept, &encoding, &zsize);
+    if (zfd >= 0) {
+        close(file_fd);
+        file_fd = zfd;
+        fsize = zsize;
+    }
     {
+        char etag[48] = "";
+        if (have_crc) {
+            // A compressed variant is a different representation, so it
+            // gets its own tag.
+            snprintf(etag, sizeof(etag), "ETag: \"%08x%s%s\"\r\n", crc, encoding ? "-" : "",
+                     encoding ? encoding : "");
+        }
+        char extra[192];
+        snprintf(extra, sizeof(extra), "Vary: Accept-Encoding\r\n%s%s%s%s",
+                 encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+                 encoding ? "\r\n" : "", etag);
         char header_buf[512];
-        const char *phrase = status_phrase(S_OK);
-        int n = snprintf(header_buf, sizeof(header_buf),
-                         "HTTP/1.1 %d %s\r\n"
-                         "Content-Length: %zu\r\n"
-                         "\r\n",
-                         S_OK, phrase, fsize);
-        if (writen(fd, header_buf, (size_t)n) < 0) {
+        int n = format_header(header_buf, sizeof(header_buf), S_OK, fsize, extra);
+        USDT_PROBE2(httpserver, response, fd, S_OK);
+        if (sio_write_full(fd, header_buf, (size_t)n) < 0) {
             close(file_fd);
+            conn_keep_alive = 0;
             return S_INTERNAL_ERR; 
         }
     }
-    {
-        char buffer[4096];
-        size_t bytes_left = fsize;
-        while (bytes_left > 0) {
-            size_t chunk = (bytes_left < sizeof(buffer)) ? bytes_left : sizeof(buffer);
-            ssize_t r = read(file_fd, buffer, chunk);
-            if (r < 0) {
-                close(file_fd);
-                return S_INTERNAL_ERR;
-            }
-            if (r == 0) {
-                break;
-            }
-            if (writen(fd, buffer, (size_t)r) < 0) {
-                close(file_fd);
-                return S_INTERNAL_ERR;
-            }
-            bytes_left -= (size_t)r;
-        }
+    size_t moved = 0;
+    USDT_PROBE2(httpserver, body_start, fd, fsize);
+    int rc = sio_transfer(fd, file_fd, fsize, &moved);
+    USDT_PROBE2(httpserver, body_done, fd, moved);
+    if (rc < 0) {
+        close(file_fd);
+        conn_keep_alive = 0;
+        return S_INTERNAL_ERR;
     }
 
     close(file_fd);
     return S_OK;
 }
 
-static void handle_connection(int client_fd) {
-    char header_buf[MAX_HEADER_SIZE + 1];
-    memset(header_buf, 0, sizeof(header_buf));
-
-    size_t total_read = 0;
-    int found_double_crlf = 0;
-    while (total_read < MAX_HEADER_SIZE) {
-        ssize_t n = read(client_fd, header_buf + total_read, MAX_HEADER_SIZE - total_read);
-        if (n < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            send_response(client_fd, S_BAD_REQUEST, NULL, 0);
-            drain_socket(client_fd);
-            return;
+// Moves len body bytes from r to file_fd, computing their CRC-32C on the
+// way. Returns the number of bytes written.
+static size_t put_body(sio_reader_t *r, int file_fd, size_t len, uint32_t *crc) {
+    static char buf[SIO_BUF_SIZE];
+    size_t moved = 0;
+    *crc = 0;
+    while (moved < len) {
+        size_t want = len - moved < sizeof(buf) ? len - moved : sizeof(buf);
+        ssize_t n = sio_read_exact(r, buf, want);
+        if (n <= 0) {
+            break;
         }
-        if (n == 0) {
-            send_response(client_fd, S_BAD_REQUEST, NULL, 0);
-            drain_socket(client_fd);
-            return;
+        *crc = crc32c(*crc, buf, (size_t)n);
+        if (sio_write_full(file_fd, buf, (size_t)n) < 0) {
+            break;
         }
-        total_read += (size_t)n;
-        if (strstr(header_buf, "\r\n\r\n") != NULL) {
-            found_double_crlf = 1;
+        moved += (size_t)n;
+        if ((size_t)n < want) {
             break;
         }
     }
-    if (!found_double_crlf) {
+    return moved;
+}
+
+static int handle_put(int fd, sio_reader_t *r, const http_request_t *req, const char *filepath) {
+    int created = 0;
+    struct stat st;
+    int stat_ret = stat(filepath, &st);
+    if (stat_ret < 0 && errno == ENOENT) {
+        created = 1; // new file
+    }
+
+    zcache_invalidate(filepath);
+    // A body with a client digest is staged next to the file and only
+    // replaces it once the digest matches.
+    char staged[80];
+    const char *target = filepath;
+    int file_fd = -1;
+    if (req->have_crc) {
+        snprintf(staged, sizeof(staged), ".%s.put", filepath);
+        target = staged;
+    }
+    if (!req->have_crc || created || access(filepath, W_OK) == 0) {
+        file_fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    USDT_PROBE2(httpserver, file_open, fd, file_fd < 0 ? -errno : file_fd);
+    if (file_fd < 0) {
+        int code = errno == EACCES ? S_FORBIDDEN : S_INTERNAL_ERR;
+        // Skip the body so a kept-alive connection resumes at the next request.
+        if (sio_reader_discard(r, req->content_length) < 0) {
+            conn_keep_alive = 0;
+        }
+        send_response(fd, code, NULL, 0);
+        return code;
+    }
+    if (req->have_crc && !created) {
+        fchmod(file_fd, st.st_mode & 07777);
+    }
+    uint32_t crc = 0;
+    USDT_PROBE2(httpserver, body_start, fd, req->content_length);
+    size_t moved = put_body(r, file_fd, req->content_length, &crc);
+    USDT_PROBE2(httpserver, body_done, fd, moved);
+    int code = created ? S_CREATED : S_OK;
+    if (moved < req->content_length) {
+        conn_keep_alive = 0;
+        code = S_INTERNAL_ERR;
+    } else if (req->have_crc && crc != req->crc) {
+        code = S_BAD_REQUEST;
+    } else {
+        store_digest(file_fd, crc);
+        if (req->have_crc && rename(staged, filepath) < 0) {
+            code = S_INTERNAL_ERR;
+        }
+    }
+    close(file_fd);
+    if (req->have_crc && code != S_OK && code != S_CREATED) {
+        unlink(staged);
+    }
+    USDT_PROBE2(httpserver, put_digest, fd, crc);
+    send_response(fd, code, NULL, 0);
+    if (code == S_OK || code == S_CREATED) {
+        zcache_request(filepath);
+    }
+    return code;
+}
+
+// The helper library keeps its socket to itself, so find it among ours: it
+// is the only one listening. Returns -1 if there is none.
+static int find_listen_fd(void) {
+    for (int fd = 3; fd < 1024; fd++) {
+        int on = 0;
+        socklen_t len = sizeof(on);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &on, &len) == 0 && on) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+static int clients_waiting(void) {
+    struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+    return listen_fd >= 0 && poll(&pfd, 1, 0) > 0;
+}
 
+// Serves one request read from r, after `served` earlier ones on the same
+// connection. Returns 1 if the connection stays open for another, 0 if it
+// should be drained and closed, -1 if it can be closed as is.
+static int handle_request(int client_fd, sio_reader_t *r, int served) {
+    char header_buf[MAX_HEADER_SIZE + 1];
+    int first = served == 0;
+    conn_keep_alive = 0;
+    if (!first && sio_reader_buffered(r) == 0) {
+        // Give up the idle connection as soon as another client connects.
+        struct pollfd pfd[2] = {
+            { .fd = client_fd, .events = POLLIN },
+            { .fd = listen_fd, .events = POLLIN },
+        };
+        if (poll(pfd, listen_fd >= 0 ? 2 : 1, KEEPALIVE_IDLE_MS) <= 0
+            || !(pfd[0].revents & POLLIN)) {
+            return -1;
+        }
+    }
+    ssize_t header_len = sio_read_until(r, header_buf, sizeof(header_buf), "\r\n\r\n");
+    if (header_len == 0 && !first) {
+        return -1; // the client closed a kept-alive connection
+    }
+    if (header_len <= 0) {
         send_response(client_fd, S_BAD_REQUEST, NULL, 0);
-        drain_socket(client_fd);
-        return;
+        return 0;
     }
     http_request_t req;
     int parse_code = parse_headers_and_request_line(header_buf, &req);
+    USDT_PROBE3(httpserver, parse_done, client_fd, parse_code, req.content_length);
     if (parse_code != 0) {
 
         send_response(client_fd, parse_code, NULL, 0);
-        drain_socket(client_fd);
-        return;
+        return 0;
     }
     if (!req.valid) {
 
         send_response(client_fd, S_BAD_REQUEST, NULL, 0);
-        drain_socket(client_fd);
-        return;
+        return 0;
     }
     if (strcasecmp(req.method, "GET") != 0 && strcasecmp(req.method, "PUT") != 0) {
         send_response(client_fd, S_NOT_IMPLEMENTED, NULL, 0);
-        drain_socket(client_fd);
-        return;
+        return 0;
     }
     if (strcmp(req.version, "HTTP/1.1") != 0) {
         // 505
         send_response(client_fd, S_VERSION_NOT_SUPP, NULL, 0);
-        drain_socket(client_fd);
-        return;
+        return 0;
     }
-    const char *uri_path = req.uri + 1; 
-
-    if (strcasecmp(req.method, "GET") == 0) {
-        handle_get(client_fd, uri_path);
-        drain_socket(client_fd);
-        return;
-    } else {
-        char *body_start = strstr(header_buf, "\r\n\r\n");
-        body_start += 4; // skip that boundary
-        size_t header_part_len = (size_t)((header_buf + total_read) - body_start);
-
-        size_t need_to_read = 0;
-        if (req.content_length > header_part_len) {
-            need_to_read = req.content_length - header_part_len;
-        }
-        int created = 0;
-        struct stat st;
-        int stat_ret = stat(uri_path, &st);
-        if (stat_ret < 0 && errno == ENOENT) {
-            created = 1; // new file
+    // Decided before the response goes out, so the client sees the close.
+    conn_keep_alive = req.keep_alive && served + 1 < KEEPALIVE_MAX_REQUESTS && !clients_waiting();
+    if (strcasecmp(req.method, "GET") == 0 && req.content_length > 0) {
+        // A GET body means nothing here, but it must not be read as the next request.
+        if (sio_reader_discard(r, req.content_length) < 0) {
+            return 0;
         }
+        req.content_length = 0;
+    }
 
-        int file_fd = open(uri_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        if (file_fd < 0) {
-            if (errno == EACCES) {
-                send_response(client_fd, S_FORBIDDEN, NULL, 0);
-            } else {
-                send_response(client_fd, S_INTERNAL_ERR, NULL, 0);
-            }
-
-            size_t drain_amt = need_to_read;
-
-            char drain_buf[1024];
-            while (drain_amt > 0) {
-                size_t chunk = (drain_amt > sizeof(drain_buf)) ? sizeof(drain_buf) : drain_amt;
-                ssize_t r = read(client_fd, drain_buf, chunk);
-                if (r <= 0) {
-                    break;
-                }
-                drain_amt -= (size_t)r;
-            }
-            drain_socket(client_fd);
-            return;
+    if (proxy != NULL) {
+        // Pass on what the backend needs to answer the same way.
+        char headers[256] = "";
+        int len = 0;
+        if (req.accept_encoding[0] != '\0') {
+            len += snprintf(headers, sizeof(headers), "Accept-Encoding: %s\r\n", req.accept_encoding);
         }
-        size_t left_off = 0;
-        while (left_off < header_part_len) {
-            ssize_t w = write(file_fd, body_start + left_off, header_part_len - left_off);
-            if (w < 0) {
-                if (errno == EINTR) continue;
-                close(file_fd);
-                send_response(client_fd, S_INTERNAL_ERR, NULL, 0);
-
-                // Drain the rest
-                size_t drain_amt = need_to_read;
-                char drain_buf[1024];
-                while (drain_amt > 0) {
-                    size_t chunk = (drain_amt > sizeof(drain_buf)) ? sizeof(drain_buf) : drain_amt;
-                    ssize_t r = read(client_fd, drain_buf, chunk);
-                    if (r <= 0) {
-                        break;
-                    }
-                    drain_amt -= (size_t)r;
-                }
-                drain_socket(client_fd);
-                return;
-            }
-            left_off += (size_t)w;
+        if (req.have_crc) {
+            snprintf(headers + len, sizeof(headers) - (size_t)len, "X-Checksum-Crc32c: %08x\r\n",
+                     req.crc);
         }
-        size_t bytes_to_go = need_to_read;
-        #define PUT_CHUNK 4096
-        char buffer[PUT_CHUNK];
-        while (bytes_to_go > 0) {
-            size_t chunk = (bytes_to_go > PUT_CHUNK) ? PUT_CHUNK : bytes_to_go;
-            ssize_t r = read(client_fd, buffer, chunk);
-            if (r < 0) {
-                if (errno == EINTR) {
-                    continue;
-                }
-                close(file_fd);
-                send_response(client_fd, S_INTERNAL_ERR, NULL, 0);
-                drain_socket(client_fd);
-                return;
-            }
-            if (r == 0) {
-                close(file_fd);
-                send_response(client_fd, S_INTERNAL_ERR, NULL, 0);
-                drain_socket(client_fd);
-                return;
-            }
-
-            size_t w_off = 0;
-            while (w_off < (size_t)r) {
-                ssize_t w = write(file_fd, buffer + w_off, (size_t)r - w_off);
-                if (w < 0) {
-                    if (errno == EINTR) continue;
-                    close(file_fd);
-                    send_response(client_fd, S_INTERNAL_ERR, NULL, 0);
-                    drain_socket(client_fd);
-                    return;
-                }
-                w_off += (size_t)w;
-            }
-            bytes_to_go -= (size_t)r;
+        int code = proxy_forward(proxy, client_fd, r, req.method, req.uri,
+                                 req.content_length, headers, conn_keep_alive);
+        if (code < 0) {
+            conn_keep_alive = 0;
+            send_response(client_fd, S_BAD_GATEWAY, NULL, 0);
+        } else if (code == 0) {
+            conn_keep_alive = 0;
         }
+        return conn_keep_alive;
+    }
 
+    const char *uri_path = req.uri + 1; 
+    if (strcasecmp(req.method, "GET") == 0) {
+        handle_get(client_fd, uri_path, zcache_accepts(req.accept_encoding));
+    } else {
+        handle_put(client_fd, r, &req, uri_path);
+    }
+    return conn_keep_alive;
+}
 
-        close(file_fd);
-
-
-        if (created) {
-            send_response(client_fd, S_CREATED, NULL, 0);
-        } else {
-            send_response(client_fd, S_OK, NULL, 0);
-        }
-        drain_socket(client_fd);
-        return;
+static void handle_connection(int client_fd) {
+    // Requests may arrive back to back, so bytes past one request's head or
+    // body stay buffered here for the next.
+    static sio_reader_t r;
+    sio_reader_init(&r, client_fd);
+    int more = 1;
+    for (int served = 0; more > 0; served++) {
+        USDT_PROBE1(httpserver, request_start, client_fd);
+        more = handle_request(client_fd, &r, served);
+        USDT_PROBE1(httpserver, request_end, client_fd);
+    }
+    if (more == 0) {
+        sio_drain(client_fd, SIZE_MAX);
     }
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
+    if (argc < 2) {
         fprintf(stderr, ERR_PORT);
         return 1;
     }
@@ -552,11 +650,26 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, ERR_PORT);
         return 1;
     }
+    if (argc > 2) {
+        // Any further arguments are backends; this instance only forwards.
+        proxy = proxy_new(argv + 2, argc - 2);
+        if (!proxy) {
+            fprintf(stderr, ERR_BACKEND);
+            return 1;
+        }
+        // A backend closing mid-response must fail the write, not kill us.
+        signal(SIGPIPE, SIG_IGN);
+    }
     Listener_Socket_t *ls = ls_new((int)portval);
     if (!ls) {
         fprintf(stderr, ERR_PORT);
         return 1;
     }
+    listen_fd = find_listen_fd();
+    if (!proxy) {
+        // Without the cache every GET is sent uncompressed, which still works.
+        zcache_start();
+    }
     while (1) {
         int client_fd = ls_accept(ls);
         if (client_fd < 0) {
@@ -567,5 +680,6 @@ int main(int argc, char *argv[]) {
         close(client_fd);
     }
     ls_delete(&ls);
+    proxy_delete(&proxy);
     return 0;
 }
@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proxy.h"
+#include "usdt.h"
+
+#define HEAD_MAX 1024
+
+typedef struct {
+    char name[128];      // "host:port", which places the backend on the ring
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int fd;              // the pooled connection, or -1
+    uint64_t idle_since; // when fd last finished a reply, in ms
+    sio_reader_t r;      // buffers replies read from fd
+} backend_t;
+
+typedef struct {
+    uint64_t hash;
+    int backend;
+} vnode_t;
+
+struct proxy {
+    backend_t *backends;
+    int n;
+    vnode_t *ring; // sorted by hash
+    size_t ring_len;
+};
+
+// A backend's reply head.
+typedef struct {
+    char head[HEAD_MAX];
+    size_t status_len; // the status line's length, without its CRLF
+    int status;
+    size_t len;        // Content-Length
+    int keep_alive;    // the backend leaves the connection open
+    char encoding[32]; // Content-Encoding, or empty
+    char etag[48];     // ETag, or empty
+    int vary;          // the reply depends on Accept-Encoding
+} reply_t;
+
+static uint64_t hash_str(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *s != '\0'; s++) {
+        h ^= (unsigned char)*s;
+        h *= 0x100000001b3ULL;
+    }
+    // FNV-1a alone leaves keys that differ in the last byte ("a#1", "a#2")
+    // close together; splitmix64's finalizer spreads them over the ring.
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static int cmp_vnode(const void *a, const void *b) {
+    const vnode_t *x = a;
+    const vnode_t *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->backend - y->backend;
+}
+
+static int resolve(backend_t *b, const char *spec) {
+    char host[64] = "127.0.0.1";
+    const char *port = spec;
+    const char *colon = strrchr(spec, ':');
+    if (colon != NULL) {
+        size_t host_len = (size_t)(colon - spec);
+        if (host_len == 0 || host_len >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, spec, host_len);
+        host[host_len] = '\0';
+        port = colon + 1;
+    }
+    char *end = NULL;
+    long portval = strtol(port, &end, 10);
+    if (*port == '\0' || *end != '\0' || portval < 1 || portval > 65535) {
+        return -1;
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+    b->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    // Name backends the same however they were spelled, so the ring doesn't
+    // move when "8081" is given as "127.0.0.1:8081".
+    snprintf(b->name, sizeof(b->name), "%s:%ld", host, portval);
+    return 0;
+}
+
+proxy_t *proxy_new(char *const *backends, int n) {
+    proxy_t *p = calloc(1, sizeof(proxy_t));
+    if (p == NULL || n < 1) {
+        free(p);
+        return NULL;
+    }
+    p->backends = calloc((size_t)n, sizeof(backend_t));
+    p->ring = calloc((size_t)n * PROXY_VNODES, sizeof(vnode_t));
+    if (p->backends == NULL || p->ring == NULL) {
+        proxy_delete(&p);
+        return NULL;
+    }
+    p->n = n;
+    for (int i = 0; i < n; i++) {
+        p->backends[i].fd = -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (resolve(&p->backends[i], backends[i]) != 0) {
+            proxy_delete(&p);
+            return NULL;
+        }
+        for (int v = 0; v < PROXY_VNODES; v++) {
+            char key[160];
+            snprintf(key, sizeof(key), "%s#%d", p->backends[i].name, v);
+            p->ring[p->ring_len].hash = hash_str(key);
+            p->ring[p->ring_len].backend = i;
+            p->ring_len++;
+        }
+    }
+    qsort(p->ring, p->ring_len, sizeof(vnode_t), cmp_vnode);
+    return p;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void backend_close(backend_t *b) {
+    if (b->fd >= 0) {
+        close(b->fd);
+        b->fd = -1;
+    }
+}
+
+void proxy_delete(proxy_t **p) {
+    if (p == NULL || *p == NULL) {
+        return;
+    }
+    for (int i = 0; i < (*p)->n; i++) {
+        backend_close(&(*p)->backends[i]);
+    }
+    free((*p)->backends);
+    free((*p)->ring);
+    free(*p);
+    *p = NULL;
+}
+
+// Fills out with up to max distinct backends, in ring order from uri's hash.
+static int ring_walk(proxy_t *p, const char *uri, int *out, int max) {
+    uint64_t h = hash_str(uri);
+    size_t lo = 0;
+    size_t hi = p->ring_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (p->ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    int found = 0;
+    for (size_t i = 0; i < p->ring_len && found < max; i++) {
+        int b = p->ring[(lo + i) % p->ring_len].backend;
+        int seen = 0;
+        for (int j = 0; j < found; j++) {
+            seen |= out[j] == b;
+        }
+        if (!seen) {
+            out[found++] = b;
+        }
+    }
+    return found;
+}
+
+// Returns b's pooled connection, or a new one if the backend closed it or
+// is about to.
+static int backend_conn(backend_t *b, int *reused) {
+    *reused = 0;
+    if (b->fd >= 0) {
+        char c;
+        ssize_t n = recv(b->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && sio_reader_buffered(&b->r) == 0
+            && now_ms() - b->idle_since < PROXY_IDLE_MS) {
+            *reused = 1;
+            return b->fd;
+        }
+        backend_close(b); // closed by the backend, or out of step
+    }
+    int fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&b->addr, b->addr_len) != 0) {
+        close(fd);
+        return -1;
+    }
+    // A request is a head and a body in separate writes; don't let Nagle
+    // hold the second back for an ACK.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    b->fd = fd;
+    sio_reader_init(&b->r, fd);
+    return fd;
+}
+
+static int read_reply(backend_t *b, reply_t *rp) {
+    ssize_t n = sio_read_until(&b->r, rp->head, sizeof(rp->head), "\r\n\r\n");
+    if (n <= 0 || sscanf(rp->head, "HTTP/1.1 %3d", &rp->status) != 1) {
+        return -1;
+    }
+    rp->status_len = (size_t)(strstr(rp->head, "\r\n") - rp->head);
+    rp->keep_alive = 0;
+    rp->encoding[0] = '\0';
+    rp->etag[0] = '\0';
+    rp->vary = 0;
+    int have_len = 0;
+    for (char *line = rp->head + rp->status_len + 2; *line != '\r'; line = strstr(line, "\r\n") + 2) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            rp->len = (size_t)strtoull(line + 15, NULL, 10);
+            have_len = 1;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char *v = line + 11;
+            while (*v == ' ' || *v == '\t') {
+                v++;
+            }
+            rp->keep_alive = strncasecmp(v, "keep-alive", 10) == 0;
+        } else if (strncasecmp(line, "Content-Encoding:", 17) == 0) {
+            sscanf(line + 17, " %31[^\r]", rp->encoding);
+        } else if (strncasecmp(line, "ETag:", 5) == 0) {
+            sscanf(line + 5, " %47[^\r]", rp->etag);
+        } else if (strncasecmp(line, "Vary:", 5) == 0) {
+            rp->vary = 1;
+        }
+    }
+    return have_len ? 0 : -1;
+}
+
+// Sends method for uri to b, with any extra header lines in headers, and
+// reads the reply head. A PUT's len-byte body is moved from body. A GET that
+// fails on a pooled connection is retried once on a new one, since the
+// backend may have closed it as we sent.
+static int exchange(backend_t *b, const char *method, const char *uri, sio_reader_t *body,
+                    size_t len, const char *headers, reply_t *rp) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused = 0;
+        if (backend_conn(b, &reused) < 0) {
+            return -1;
+        }
+        char length[48] = "";
+        if (body != NULL) {
+            snprintf(length, sizeof(length), "Content-Length: %zu\r\n", len);
+        }
+        char head[HEAD_MAX];
+        int n = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\n%s%sConnection: keep-alive\r\n\r\n",
+                         method, uri, length, headers != NULL ? headers : "");
+        size_t moved = 0;
+        if (sio_write_full(b->fd, head, (size_t)n) == 0
+            && (body == NULL || (sio_reader_transfer(body, b->fd, len, &moved) == 0 && moved == len))
+            && read_reply(b, rp) == 0) {
+            return 0;
+        }
+        backend_close(b);
+        if (body != NULL || !reused) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Finishes with a reply whose body has been consumed.
+static void reply_done(backend_t *b, const reply_t *rp) {
+    if (!rp->keep_alive) {
+        backend_close(b);
+    }
+    b->idle_since = now_ms();
+}
+
+static int skip_body(backend_t *b, const reply_t *rp) {
+    if (sio_reader_discard(&b->r, rp->len) != 0) {
+        backend_close(b);
+        return -1;
+    }
+    reply_done(b, rp);
+    return 0;
+}
+
+static int send_head(int client_fd, const reply_t *rp, int keep_alive) {
+    char head[HEAD_MAX + 256]; // room for the status line and every header below
+    size_t size = sizeof(head);
+    size_t n = (size_t)snprintf(head, size, "%.*s\r\nContent-Length: %zu\r\n",
+                                (int)rp->status_len, rp->head, rp->len);
+    // The backend's own headers that still hold for the relayed reply.
+    if (rp->vary) {
+        n += (size_t)snprintf(head + n, size - n, "Vary: Accept-Encoding\r\n");
+    }
+    if (rp->encoding[0] != '\0') {
+        n += (size_t)snprintf(head + n, size - n, "Content-Encoding: %s\r\n", rp->encoding);
+    }
+    if (rp->etag[0] != '\0') {
+        n += (size_t)snprintf(head + n, size - n, "ETag: %s\r\n", rp->etag);
+    }
+    n += (size_t)snprintf(head + n, size - n, "%s\r\n",
+                          keep_alive ? "Connection: keep-alive\r\n" : "");
+    return sio_write_full(client_fd, head, n);
+}
+
+// Relays rp and its body, still unread on b, to the client.
+static int relay(backend_t *b, const reply_t *rp, int client_fd, int keep_alive) {
+    size_t moved = 0;
+    if (send_head(client_fd, rp, keep_alive) != 0
+        || sio_reader_transfer(&b->r, client_fd, rp->len, &moved) != 0 || moved < rp->len) {
+        backend_close(b);
+        return 0;
+    }
+    reply_done(b, rp);
+    return rp->status;
+}
+
+// Copies uri, whose body is unread on from, to the backend to.
+static int migrate(backend_t *from, const reply_t *found, backend_t *to, const char *uri) {
+    // The raw copy's ETag is its CRC-32C; passing it on has the new owner
+    // check what arrived.
+    char check[64] = "";
+    unsigned int crc;
+    char end;
+    if (sscanf(found->etag, "\"%8x%c", &crc, &end) == 2 && end == '"') {
+        snprintf(check, sizeof(check), "X-Checksum-Crc32c: %08x\r\n", crc);
+    }
+    reply_t rp;
+    if (exchange(to, "PUT", uri, &from->r, found->len, check, &rp) != 0) {
+        backend_close(from);
+        return -1;
+    }
+    reply_done(from, found);
+    if (skip_body(to, &rp) != 0) {
+        return -1;
+    }
+    return (rp.status == 200 || rp.status == 201) ? 0 : -1;
+}
+
+int proxy_forward(proxy_t *p, int client_fd, sio_reader_t *client, const char *method,
+                  const char *uri, size_t content_length, const char *headers, int keep_alive) {
+    int order[1 + PROXY_FALLBACKS];
+    int n = ring_walk(p, uri, order, 1 + PROXY_FALLBACKS);
+    backend_t *owner = &p->backends[order[0]];
+    USDT_PROBE2(httpserver, proxy_backend, client_fd, order[0]);
+    int is_put = strcasecmp(method, "PUT") == 0;
+    reply_t rp;
+    if (exchange(owner, is_put ? "PUT" : "GET", uri, is_put ? client : NULL, content_length,
+                 headers, &rp)
+        != 0) {
+        return -1;
+    }
+    if (is_put || rp.status != 404 || n == 1) {
+        return relay(owner, &rp, client_fd, keep_alive);
+    }
+
+    // Keep the owner's 404 in case no earlier owner has the file either.
+    char miss[128];
+    if (rp.len > sizeof(miss) || sio_read_exact(&owner->r, miss, rp.len) != (ssize_t)rp.len) {
+        backend_close(owner);
+        return -1;
+    }
+    reply_done(owner, &rp);
+    for (int i = 1; i < n; i++) {
+        backend_t *b = &p->backends[order[i]];
+        reply_t found;
+        // Fetch the raw bytes: they are what the owner is to store.
+        if (exchange(b, "GET", uri, NULL, 0, NULL, &found) != 0) {
+            continue;
+        }
+        if (found.status != 200) {
+            skip_body(b, &found);
+            continue;
+        }
+        USDT_PROBE3(httpserver, proxy_migrate, client_fd, order[i], order[0]);
+        if (migrate(b, &found, owner, uri) != 0
+            || exchange(owner, "GET", uri, NULL, 0, headers, &rp) != 0) {
+            return -1;
+        }
+        return relay(owner, &rp, client_fd, keep_alive);
+    }
+    if (send_head(client_fd, &rp, keep_alive) != 0 || sio_write_full(client_fd, miss, rp.len) != 0) {
+        return 0;
+    }
+    return rp.status;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+/**
+ *  Front-end mode: requests are forwarded to backend httpserver instances
+ *  instead of being served from the working directory.
+ *
+ *  Each URI belongs to one backend, picked by consistent hashing: every
+ *  backend is placed on a 64-bit hash ring at PROXY_VNODES points, and a
+ *  URI goes to the first point at or after its own hash. Adding a backend
+ *  therefore moves only the URIs that land on its points, all of which
+ *  used to belong to the backends following them on the ring. A GET that
+ *  misses on the owner asks up to PROXY_FALLBACKS of those next backends,
+ *  and on a hit copies the file to the owner before answering, so data
+ *  rebalances lazily as it is read.
+ *
+ *  Each backend has one pooled keep-alive connection, reused while requests
+ *  keep coming. Bodies move between sockets with splice where possible.
+ */
+
+#include <stddef.h>
+
+#include "sysio.h"
+
+#define PROXY_VNODES    160
+#define PROXY_FALLBACKS 2
+// A pooled connection idle this long is replaced rather than reused: a
+// backend closes kept-alive connections after KEEPALIVE_IDLE_MS (500 ms) so
+// that it can serve others, and a request sent as it does so would be lost.
+#define PROXY_IDLE_MS   250
+
+typedef struct proxy proxy_t;
+
+/** @brief Sets up a ring over backends given as "port" or "host:port"
+ *         (host defaults to 127.0.0.1). Nothing is connected yet.
+ *
+ *  @return A pointer to the proxy, or NULL if a backend can't be resolved
+ *          or memory runs out.
+ */
+proxy_t *proxy_new(char *const *backends, int n);
+
+/** @brief Closes the pooled connections and frees the proxy. Sets *p to
+ *         NULL.
+ */
+void proxy_delete(proxy_t **p);
+
+/** @brief Forwards one parsed GET or PUT for uri to its backend and relays
+ *         the answer to client_fd. A PUT's body is taken from client.
+ *
+ *  @param headers Header lines, each ending in CRLF, to pass on to the
+ *                 backend (Accept-Encoding, X-Checksum-Crc32c), or NULL. The
+ *                 backend's Content-Encoding, Vary and ETag are relayed back.
+ *  @param keep_alive Whether to tell the client the connection stays open.
+ *
+ *  @return The status relayed to the client; 0 if the relayed response was
+ *          cut short; -1 if nothing was sent, in which case the client's
+ *          body may be partly consumed.
+ */
+int proxy_forward(proxy_t *p, int client_fd, sio_reader_t *client, const char *method,
+                  const char *uri, size_t content_length, const char *headers, int keep_alive);
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "sysio.h"
+#include "zcache.h"
+
+#define NAME_LEN 65
+#define PATH_LEN (sizeof(ZCACHE_DIR) + NAME_LEN + 8)
+// Compression happens once per PUT, off the request path, so spend the CPU.
+#define LEVEL 9
+// Failed compressions remembered; the oldest is forgotten first.
+#define FAILED_MAX 64
+
+typedef struct {
+    const char *suffix;
+    const char *encoding;
+    int bit;
+    int window_bits; // zlib's way of choosing the gzip or zlib wrapper
+} coding_t;
+
+// In order of preference.
+static const coding_t codings[] = {
+    {".gz", "gzip", ZCACHE_GZIP, 15 + 16},
+    {".zz", "deflate", ZCACHE_DEFLATE, 15},
+};
+#define NCODINGS ((int)(sizeof(codings) / sizeof(codings[0])))
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nonempty = PTHREAD_COND_INITIALIZER;
+static char queue[ZCACHE_QUEUE][NAME_LEN];
+static int queue_head;
+static int queue_count;
+static char current[NAME_LEN]; // being compressed
+static int current_stale;      // current was rewritten meanwhile
+static int started;
+
+// Files not to compress again until their mtime changes.
+static struct {
+    char name[NAME_LEN];
+    struct timespec mtime;
+} failed[FAILED_MAX];
+static int failed_next;
+
+static void variant_path(char *buf, const char *name, const coding_t *c, const char *tail) {
+    snprintf(buf, PATH_LEN, ZCACHE_DIR "/%s%s%s", name, c->suffix, tail);
+}
+
+static int same_mtime_ts(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static int same_mtime(const struct stat *a, const struct stat *b) {
+    return same_mtime_ts(&a->st_mtim, &b->st_mtim);
+}
+
+// Called with the lock held.
+static int failed_slot(const char *name) {
+    for (int i = 0; i < FAILED_MAX; i++) {
+        if (strcmp(failed[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Called with the lock held.
+static void remember_failure(const char *name, const struct stat *st) {
+    int i = failed_slot(name);
+    if (i < 0) {
+        i = failed_next;
+        failed_next = (failed_next + 1) % FAILED_MAX;
+        strcpy(failed[i].name, name);
+    }
+    failed[i].mtime = st->st_mtim;
+}
+
+// Writes every coding of name to a temporary file in one pass over it, and
+// moves them into place unless the original changed meanwhile. Returns 1 if
+// new variants were installed.
+static int compress_file(const char *name) {
+    static unsigned char ibuf[SIO_BUF_SIZE];
+    static unsigned char obuf[SIO_BUF_SIZE];
+    int in = open(name, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < ZCACHE_MIN_SIZE) {
+        close(in);
+        return 0;
+    }
+    z_stream zs[NCODINGS];
+    int out[NCODINGS];
+    char tmp[NCODINGS][PATH_LEN];
+    int ready = 0;
+    int ok = 1;
+    for (; ready < NCODINGS; ready++) {
+        variant_path(tmp[ready], name, &codings[ready], ".tmp");
+        out[ready] = open(tmp[ready], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out[ready] < 0) {
+            ok = 0;
+            break;
+        }
+        memset(&zs[ready], 0, sizeof(z_stream));
+        if (deflateInit2(&zs[ready], LEVEL, Z_DEFLATED, codings[ready].window_bits, 8,
+                         Z_DEFAULT_STRATEGY)
+            != Z_OK) {
+            close(out[ready]);
+            unlink(tmp[ready]);
+            ok = 0;
+            break;
+        }
+    }
+
+    int flush = Z_NO_FLUSH;
+    while (ok && flush != Z_FINISH) {
+        ssize_t n = sio_read_full(in, ibuf, sizeof(ibuf));
+        if (n < 0) {
+            ok = 0;
+            break;
+        }
+        flush = (size_t)n < sizeof(ibuf) ? Z_FINISH : Z_NO_FLUSH;
+        for (int i = 0; i < NCODINGS && ok; i++) {
+            zs[i].next_in = ibuf;
+            zs[i].avail_in = (uInt)n;
+            do {
+                zs[i].next_out = obuf;
+                zs[i].avail_out = sizeof(obuf);
+                if (deflate(&zs[i], flush) == Z_STREAM_ERROR
+                    || sio_write_full(out[i], obuf, sizeof(obuf) - zs[i].avail_out) != 0) {
+                    ok = 0;
+                }
+            } while (ok && zs[i].avail_out == 0);
+        }
+    }
+
+    // Variants that could never fit would evict everything else and then
+    // themselves, so they count as a failure.
+    off_t total = 0;
+    for (int i = 0; i < ready; i++) {
+        total += (off_t)zs[i].total_out;
+    }
+    int failure = !ok || total > ZCACHE_BUDGET;
+    ok = !failure;
+    struct stat now;
+    if (ok && (fstat(in, &now) != 0 || now.st_size != st.st_size || !same_mtime(&now, &st))) {
+        ok = 0;
+    }
+    // The variants take the original's mtime, which zcache_open checks.
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    pthread_mutex_lock(&lock);
+    ok = ok && !current_stale;
+    if (failure && !current_stale) {
+        remember_failure(name, &st);
+    }
+    for (int i = 0; i < ready; i++) {
+        char path[PATH_LEN];
+        variant_path(path, name, &codings[i], "");
+        deflateEnd(&zs[i]);
+        if (!ok || futimens(out[i], times) != 0 || rename(tmp[i], path) != 0) {
+            unlink(tmp[i]);
+        }
+        close(out[i]);
+    }
+    pthread_mutex_unlock(&lock);
+    close(in);
+    return ok;
+}
+
+typedef struct {
+    char name[NAME_LEN + 8];
+    off_t size;
+    struct timespec written;
+} variant_t;
+
+static int written_before(const void *a, const void *b) {
+    const struct timespec *x = &((const variant_t *)a)->written;
+    const struct timespec *y = &((const variant_t *)b)->written;
+    if (x->tv_sec != y->tv_sec) {
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    }
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// Deletes the variants written longest ago until the rest fit in
+// ZCACHE_BUDGET. A variant's mtime is its original's, but installing it
+// set its ctime.
+static void enforce_budget(void) {
+    DIR *dir = opendir(ZCACHE_DIR);
+    if (dir == NULL) {
+        return;
+    }
+    variant_t *v = NULL;
+    size_t n = 0;
+    size_t cap = 0;
+    off_t total = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name);
+        struct stat st;
+        if (len >= sizeof(v->name) || (len > 4 && strcmp(de->d_name + len - 4, ".tmp") == 0)
+            || fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0
+            || !S_ISREG(st.st_mode)) {
+            continue; // not a variant, or one still being written
+        }
+        if (n == cap) {
+            size_t grown = cap ? 2 * cap : 64;
+            variant_t *more = realloc(v, grown * sizeof(variant_t));
+            if (more == NULL) {
+                break;
+            }
+            v = more;
+            cap = grown;
+        }
+        memcpy(v[n].name, de->d_name, len + 1);
+        v[n].size = st.st_size;
+        v[n].written = st.st_ctim;
+        total += st.st_size;
+        n++;
+    }
+    if (total > ZCACHE_BUDGET) {
+        qsort(v, n, sizeof(variant_t), written_before);
+        for (size_t i = 0; i < n && total > ZCACHE_BUDGET; i++) {
+            if (unlinkat(dirfd(dir), v[i].name, 0) == 0) {
+                total -= v[i].size;
+            }
+        }
+    }
+    free(v);
+    closedir(dir);
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+    char name[NAME_LEN];
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (queue_count == 0) {
+            pthread_cond_wait(&nonempty, &lock);
+        }
+        memcpy(name, queue[queue_head], NAME_LEN);
+        queue_head = (queue_head + 1) % ZCACHE_QUEUE;
+        queue_count--;
+        memcpy(current, name, NAME_LEN);
+        current_stale = 0;
+        pthread_mutex_unlock(&lock);
+
+        if (compress_file(name)) {
+            enforce_budget();
+        }
+
+        pthread_mutex_lock(&lock);
+        current[0] = '\0';
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+int zcache_start(void) {
+    if (mkdir(ZCACHE_DIR, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    pthread_t tid;
+    int rc = pthread_create(&tid, NULL, worker_main, NULL);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    pthread_detach(tid);
+    started = 1;
+    return 0;
+}
+
+int zcache_accepts(const char *value) {
+    int bits = 0;
+    const char *p = value;
+    while (*p != '\0') {
+        p += strspn(p, " \t,");
+        size_t name_len = strcspn(p, " \t,;");
+        size_t seg_len = strcspn(p, ",");
+        const char *q = strstr(p + name_len, "q=");
+        if (q == NULL || q >= p + seg_len || strtod(q + 2, NULL) > 0) {
+            if (name_len == 1 && *p == '*') {
+                bits |= ZCACHE_GZIP | ZCACHE_DEFLATE;
+            }
+            for (int i = 0; i < NCODINGS; i++) {
+                if (name_len == strlen(codings[i].encoding)
+                    && strncasecmp(p, codings[i].encoding, name_len) == 0) {
+                    bits |= codings[i].bit;
+                }
+            }
+        }
+        p += seg_len;
+    }
+    return bits;
+}
+
+int zcache_open(const char *name, const struct stat *orig, int accept, const char **encoding,
+                size_t *len) {
+    if (!started || accept == 0 || orig->st_size < ZCACHE_MIN_SIZE) {
+        return -1;
+    }
+    for (int i = 0; i < NCODINGS; i++) {
+        if (!(accept & codings[i].bit)) {
+            continue;
+        }
+        // Every coding is written at once, so the first accepted one tells
+        // whether the rest exist and are worth sending too.
+        char path[PATH_LEN];
+        variant_path(path, name, &codings[i], "");
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || !same_mtime(&st, orig)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            pthread_mutex_lock(&lock);
+            int slot = failed_slot(name);
+            int gave_up = slot >= 0 && same_mtime_ts(&failed[slot].mtime, &orig->st_mtim);
+            pthread_mutex_unlock(&lock);
+            if (!gave_up) {
+                zcache_request(name);
+            }
+            return -1;
+        }
+        if (st.st_size >= orig->st_size) {
+            close(fd); // incompressible
+            return -1;
+        }
+        *encoding = codings[i].encoding;
+        *len = (size_t)st.st_size;
+        return fd;
+    }
+    return -1;
+}
+
+void zcache_request(const char *name) {
+    if (!started || strlen(name) >= NAME_LEN) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    int queued = 0;
+    for (int i = 0; i < queue_count; i++) {
+        queued |= strcmp(queue[(queue_head + i) % ZCACHE_QUEUE], name) == 0;
+    }
+    if (!queued && queue_count < ZCACHE_QUEUE) {
+        strcpy(queue[(queue_head + queue_count) % ZCACHE_QUEUE], name);
+        queue_count++;
+        pthread_cond_signal(&nonempty);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void zcache_invalidate(const char *name) {
+    if (!started || strlen(name) >= NAME_LEN) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    if (strcmp(current, name) == 0) {
+        current_stale = 1;
+    }
+    int slot = failed_slot(name);
+    if (slot >= 0) {
+        failed[slot].name[0] = '\0';
+    }
+    for (int i = 0; i < NCODINGS; i++) {
+        char path[PATH_LEN];
+        variant_path(path, name, &codings[i], "");
+        unlink(path);
+    }
+    pthread_mutex_unlock(&lock);
+}
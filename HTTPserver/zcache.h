@@ -0,0 +1,63 @@
+#pragma once
+
+/**
+ *  Precompressed variants of served files.
+ *
+ *  A background thread writes gzip (".gz") and zlib-wrapped deflate (".zz")
+ *  copies of a file into ZCACHE_DIR after it is PUT, or after a GET finds
+ *  no current copy. GETs that accept an encoding then send the variant with
+ *  sendfile like any other file. Nothing is ever compressed on the request
+ *  path: until the variant exists the raw bytes are sent.
+ *
+ *  A variant carries its original's mtime and is only used while the two
+ *  match and the variant is smaller. zcache_invalidate, called before a
+ *  PUT touches the original, removes old variants and stops one that is
+ *  being written for it from being installed.
+ *
+ *  The variants together are kept under ZCACHE_BUDGET bytes by deleting
+ *  the ones written longest ago. A file whose compression fails, or whose
+ *  variants alone would exceed the budget, is not retried until its mtime
+ *  changes.
+ */
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define ZCACHE_DIR      ".zcache"
+#define ZCACHE_MIN_SIZE 256 // smaller files are always sent as they are
+#define ZCACHE_QUEUE    64  // pending files; further requests are dropped
+#define ZCACHE_BUDGET   ((off_t)64 << 20) // bytes of variants kept on disk
+
+// Accept-Encoding bits.
+#define ZCACHE_GZIP    0x1
+#define ZCACHE_DEFLATE 0x2
+
+/** @brief Creates ZCACHE_DIR and starts the compression thread.
+ *
+ *  @return 0, or -1 with errno set.
+ */
+int zcache_start(void);
+
+/** @brief Parses an Accept-Encoding value into ZCACHE_* bits. Codings with
+ *         q=0 are left out; "*" accepts both.
+ */
+int zcache_accepts(const char *value);
+
+/** @brief Opens the best current variant of name among codings.
+ *
+ *  @param orig The original's stat.
+ *  @param encoding Set to the Content-Encoding of the variant.
+ *  @param len Set to the variant's length.
+ *
+ *  @return A read-only fd, or -1 if the original should be sent. A missing
+ *          or outdated variant is queued for compression, unless it failed
+ *          for this version of the original.
+ */
+int zcache_open(const char *name, const struct stat *orig, int codings, const char **encoding,
+                size_t *len);
+
+/** @brief Queues name for compression. */
+void zcache_request(const char *name);
+
+/** @brief Drops name's variants before the original is rewritten. */
+void zcache_invalidate(const char *name);
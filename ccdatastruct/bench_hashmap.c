@@ -0,0 +1,241 @@
+// Compares hashmap_t with a chained hash table guarded by one rwlock_t
+// (READERS priority).
+//
+// Every thread runs a URI-keyed mix of 90% lookups, 9% overwrites and 1%
+// remove/re-insert pairs over a preloaded key set. Prints operations per
+// second for each map and thread count, and fails if a lookup ever returns
+// a value that was never stored under its key.
+//
+// Usage: ./bench_hashmap [max_threads] [seconds_per_run]
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashmap.h"
+#include "rwlock.h"
+
+#define KEYS 65536
+#define KEY_LEN 32
+
+typedef enum { USE_HASHMAP, USE_LOCKED } map_kind_t;
+
+// The baseline: a fixed-size chained table behind a single rwlock.
+typedef struct entry {
+    struct entry *next;
+    char *key;
+    void *value;
+} entry_t;
+
+typedef struct {
+    rwlock_t *lock;
+    size_t nbuckets;
+    entry_t **buckets;
+} locked_map_t;
+
+static char keys[KEYS][KEY_LEN];
+
+static map_kind_t kind;
+static hashmap_t *hmap;
+static locked_map_t lmap;
+
+static atomic_bool stop;
+static atomic_ullong bad;
+
+static size_t locked_bucket(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *key != '\0'; key++) {
+        h ^= (unsigned char) *key;
+        h *= 0x100000001b3ULL;
+    }
+    return (size_t) (h % lmap.nbuckets);
+}
+
+static bool locked_get(const char *key, void **value) {
+    bool found = false;
+    reader_lock(lmap.lock);
+    for (entry_t *e = lmap.buckets[locked_bucket(key)]; e != NULL; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            *value = e->value;
+            found = true;
+            break;
+        }
+    }
+    reader_unlock(lmap.lock);
+    return found;
+}
+
+static void locked_put(const char *key, void *value) {
+    size_t b = locked_bucket(key);
+    writer_lock(lmap.lock);
+    entry_t *e = lmap.buckets[b];
+    while (e != NULL && strcmp(e->key, key) != 0) {
+        e = e->next;
+    }
+    if (e != NULL) {
+        e->value = value;
+    } else if ((e = malloc(sizeof(entry_t))) != NULL) {
+        e->key = strdup(key);
+        e->value = value;
+        e->next = lmap.buckets[b];
+        lmap.buckets[b] = e;
+    }
+    writer_unlock(lmap.lock);
+}
+
+static void locked_remove(const char *key) {
+    size_t b = locked_bucket(key);
+    writer_lock(lmap.lock);
+    for (entry_t **pp = &lmap.buckets[b]; *pp != NULL; pp = &(*pp)->next) {
+        if (strcmp((*pp)->key, key) == 0) {
+            entry_t *e = *pp;
+            *pp = e->next;
+            free(e->key);
+            free(e);
+            break;
+        }
+    }
+    writer_unlock(lmap.lock);
+}
+
+static void setup(map_kind_t k) {
+    kind = k;
+    if (k == USE_HASHMAP) {
+        hmap = hashmap_new(KEYS);
+    } else {
+        lmap.lock = rwlock_new(READERS, 0);
+        lmap.nbuckets = KEYS * 2;
+        lmap.buckets = calloc(lmap.nbuckets, sizeof(entry_t *));
+    }
+    if ((k == USE_HASHMAP && hmap == NULL)
+        || (k == USE_LOCKED && (lmap.lock == NULL || lmap.buckets == NULL))) {
+        fprintf(stderr, "allocation failed\n");
+        exit(1);
+    }
+    for (uintptr_t i = 0; i < KEYS; i++) {
+        if (k == USE_HASHMAP) {
+            hashmap_put(hmap, keys[i], (void *) (i + 1), NULL);
+        } else {
+            locked_put(keys[i], (void *) (i + 1));
+        }
+    }
+}
+
+static void teardown(void) {
+    if (kind == USE_HASHMAP) {
+        hashmap_delete(&hmap);
+        return;
+    }
+    for (size_t b = 0; b < lmap.nbuckets; b++) {
+        entry_t *e = lmap.buckets[b];
+        while (e != NULL) {
+            entry_t *next = e->next;
+            free(e->key);
+            free(e);
+            e = next;
+        }
+    }
+    free(lmap.buckets);
+    rwlock_delete(&lmap.lock);
+}
+
+static void *worker(void *arg) {
+    uint64_t *ops = arg;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL ^ (uint64_t) (uintptr_t) arg;
+    uint64_t n = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        // xorshift64
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        uintptr_t i = (uintptr_t) ((rng >> 8) % KEYS);
+        unsigned op = (unsigned) (rng % 100);
+        void *want = (void *) (i + 1);
+        void *v = NULL;
+
+        if (op < 90) {
+            bool found = kind == USE_HASHMAP ? hashmap_get(hmap, keys[i], &v)
+                                             : locked_get(keys[i], &v);
+            if (found && v != want) {
+                atomic_fetch_add(&bad, 1);
+            }
+        } else if (op < 99) {
+            if (kind == USE_HASHMAP) {
+                hashmap_put(hmap, keys[i], want, NULL);
+            } else {
+                locked_put(keys[i], want);
+            }
+        } else {
+            if (kind == USE_HASHMAP) {
+                hashmap_remove(hmap, keys[i], NULL);
+                hashmap_put(hmap, keys[i], want, NULL);
+            } else {
+                locked_remove(keys[i]);
+                locked_put(keys[i], want);
+            }
+        }
+        n++;
+    }
+    *ops = n;
+    return NULL;
+}
+
+static double run(map_kind_t k, int nthreads, double seconds) {
+    setup(k);
+    atomic_store(&stop, false);
+
+    pthread_t *t = malloc(sizeof(pthread_t) * nthreads);
+    uint64_t *ops = calloc(nthreads, sizeof(uint64_t));
+    if (t == NULL || ops == NULL) {
+        fprintf(stderr, "allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&t[i], NULL, worker, &ops[i]);
+    }
+
+    struct timespec ts = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+    nanosleep(&ts, NULL);
+    atomic_store(&stop, true);
+
+    uint64_t total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(t[i], NULL);
+        total += ops[i];
+    }
+    free(t);
+    free(ops);
+    teardown();
+    return (double) total / seconds;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    if (max_threads < 1 || seconds <= 0) {
+        fprintf(stderr, "usage: %s [max_threads] [seconds_per_run]\n", argv[0]);
+        return 1;
+    }
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(keys[i], KEY_LEN, "/static/asset-%d.html", i);
+    }
+
+    printf("%8s %16s %16s %8s\n", "threads", "hashmap ops/s", "rwlock ops/s", "ratio");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double h = run(USE_HASHMAP, n, seconds);
+        double l = run(USE_LOCKED, n, seconds);
+        printf("%8d %16.0f %16.0f %8.2f\n", n, h, l, h / l);
+    }
+
+    unsigned long long b = atomic_load(&bad);
+    if (b != 0) {
+        fprintf(stderr, "FAIL: %llu lookups returned a wrong value\n", b);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,163 @@
+// Compares pool_get/pool_put with malloc/free for fixed-size objects.
+//
+// In the "local" pattern every thread allocates BATCH objects, touches
+// them and frees them again. In the "handoff" pattern threads come in
+// pairs: one allocates and passes each object through a queue to the
+// other, which frees it, so every object is freed by a thread that did not
+// allocate it. Prints allocations per second for each allocator, pattern
+// and thread count.
+//
+// Usage: ./bench_pool [max_threads] [seconds_per_run]
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "queue.h"
+
+#define OBJ_SIZE 64
+#define BATCH 32
+#define QUEUE_CAP 256
+
+typedef enum { USE_POOL, USE_MALLOC } alloc_kind_t;
+typedef enum { LOCAL, HANDOFF } pattern_t;
+
+static alloc_kind_t kind;
+static pool_t *pool;
+static atomic_bool stop;
+
+static void *obj_get(void) {
+    return kind == USE_POOL ? pool_get(pool) : malloc(OBJ_SIZE);
+}
+
+static void obj_put(void *o) {
+    if (kind == USE_POOL) {
+        pool_put(pool, o);
+    } else {
+        free(o);
+    }
+}
+
+typedef struct {
+    queue_t *q; // HANDOFF only
+    uint64_t allocs;
+} worker_t;
+
+static void *local_worker(void *arg) {
+    worker_t *w = arg;
+    void *objs[BATCH];
+    uint64_t n = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        for (int i = 0; i < BATCH; i++) {
+            objs[i] = obj_get();
+            memset(objs[i], i, 8);
+        }
+        for (int i = 0; i < BATCH; i++) {
+            obj_put(objs[i]);
+        }
+        n += BATCH;
+    }
+    w->allocs = n;
+    return NULL;
+}
+
+static void *handoff_producer(void *arg) {
+    worker_t *w = arg;
+    uint64_t n = 0;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        void *o = obj_get();
+        memset(o, 1, 8);
+        if (!queue_push(w->q, o)) {
+            obj_put(o);
+            break;
+        }
+        n++;
+    }
+    queue_close(w->q);
+    w->allocs = n;
+    return NULL;
+}
+
+static void *handoff_consumer(void *arg) {
+    worker_t *w = arg;
+    void *o;
+    while (queue_pop(w->q, &o)) {
+        obj_put(o);
+    }
+    return NULL;
+}
+
+static double run(alloc_kind_t k, pattern_t pattern, int nthreads, double seconds) {
+    kind = k;
+    pool = pool_new(OBJ_SIZE);
+    atomic_store(&stop, false);
+    pthread_t *t = malloc(sizeof(pthread_t) * nthreads);
+    worker_t *w = calloc(nthreads, sizeof(worker_t));
+    if (pool == NULL || t == NULL || w == NULL) {
+        fprintf(stderr, "allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        if (pattern == LOCAL) {
+            pthread_create(&t[i], NULL, local_worker, &w[i]);
+        } else if (i % 2 == 0) {
+            // Consumers share their producer's queue.
+            if ((w[i].q = queue_new(QUEUE_CAP)) == NULL) {
+                fprintf(stderr, "allocation failed\n");
+                exit(1);
+            }
+            w[i + 1].q = w[i].q;
+            pthread_create(&t[i], NULL, handoff_producer, &w[i]);
+        } else {
+            pthread_create(&t[i], NULL, handoff_consumer, &w[i]);
+        }
+    }
+
+    struct timespec ts = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+    nanosleep(&ts, NULL);
+    atomic_store(&stop, true);
+
+    uint64_t total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(t[i], NULL);
+        total += w[i].allocs;
+    }
+    for (int i = 0; pattern == HANDOFF && i < nthreads; i += 2) {
+        queue_delete(&w[i].q);
+    }
+    free(t);
+    free(w);
+    pool_delete(&pool);
+    return (double) total / seconds;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    if (max_threads < 1 || seconds <= 0) {
+        fprintf(stderr, "usage: %s [max_threads] [seconds_per_run]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%8s %8s %16s %16s %8s\n", "pattern", "threads", "pool allocs/s", "malloc allocs/s",
+           "ratio");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double p = run(USE_POOL, LOCAL, n, seconds);
+        double m = run(USE_MALLOC, LOCAL, n, seconds);
+        printf("%8s %8d %16.0f %16.0f %8.2f\n", "local", n, p, m, p / m);
+    }
+    // Handoff needs whole producer/consumer pairs.
+    for (int n = 2; n <= (max_threads < 2 ? 2 : max_threads); n *= 2) {
+        double p = run(USE_POOL, HANDOFF, n, seconds);
+        double m = run(USE_MALLOC, HANDOFF, n, seconds);
+        printf("%8s %8d %16.0f %16.0f %8.2f\n", "handoff", n, p, m, p / m);
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Compares seqlock_t with rwlock_t (READERS priority) for read-mostly state.
+//
+// Reader threads repeatedly copy a 64-byte struct while one writer replaces
+// it every WRITE_PERIOD_US. Prints reads per second for each lock and thread
+// count, and fails if any reader ever sees a torn struct.
+//
+// Usage: ./bench_seqlock [max_threads] [seconds_per_run]
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rwlock.h"
+#include "seqlock.h"
+
+#define FIELDS 8
+#define WRITE_PERIOD_US 1000
+
+typedef struct {
+    uint64_t field[FIELDS];
+} config_t;
+
+SEQLOCK_DEFINE(config_seq, config_t)
+
+typedef enum { USE_SEQLOCK, USE_RWLOCK } lock_kind_t;
+
+static config_seq_t seq_conf;
+static rwlock_t *rw;
+static config_t rw_conf;
+
+static atomic_bool stop;
+static atomic_ullong torn;
+
+static lock_kind_t kind;
+
+static void read_config(config_t *out) {
+    if (kind == USE_SEQLOCK) {
+        config_seq_load(&seq_conf, out);
+    } else {
+        reader_lock(rw);
+        *out = rw_conf;
+        reader_unlock(rw);
+    }
+}
+
+static void write_config(const config_t *in) {
+    if (kind == USE_SEQLOCK) {
+        config_seq_store(&seq_conf, in);
+    } else {
+        writer_lock(rw);
+        rw_conf = *in;
+        writer_unlock(rw);
+    }
+}
+
+static void *reader(void *arg) {
+    uint64_t *reads = arg;
+    uint64_t n = 0;
+    config_t c;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        read_config(&c);
+        for (int i = 1; i < FIELDS; i++) {
+            if (c.field[i] != c.field[0]) {
+                atomic_fetch_add(&torn, 1);
+                break;
+            }
+        }
+        n++;
+    }
+    *reads = n;
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    (void) arg;
+    config_t c;
+    for (uint64_t gen = 1; !atomic_load(&stop); gen++) {
+        for (int i = 0; i < FIELDS; i++) {
+            c.field[i] = gen;
+        }
+        write_config(&c);
+        usleep(WRITE_PERIOD_US);
+    }
+    return NULL;
+}
+
+static double run(lock_kind_t m, int nreaders, double seconds) {
+    config_t zero = { { 0 } };
+    kind = m;
+    config_seq_init(&seq_conf, &zero);
+    rw = rwlock_new(READERS, 0);
+    rw_conf = zero;
+    atomic_store(&stop, false);
+
+    pthread_t w;
+    pthread_t *r = malloc(sizeof(pthread_t) * nreaders);
+    uint64_t *reads = calloc(nreaders, sizeof(uint64_t));
+    if (rw == NULL || r == NULL || reads == NULL) {
+        fprintf(stderr, "allocation failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < nreaders; i++) {
+        pthread_create(&r[i], NULL, reader, &reads[i]);
+    }
+    pthread_create(&w, NULL, writer, NULL);
+
+    struct timespec ts = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+    nanosleep(&ts, NULL);
+    atomic_store(&stop, true);
+
+    pthread_join(w, NULL);
+    uint64_t total = 0;
+    for (int i = 0; i < nreaders; i++) {
+        pthread_join(r[i], NULL);
+        total += reads[i];
+    }
+    free(r);
+    free(reads);
+    rwlock_delete(&rw);
+    return (double) total / seconds;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    if (max_threads < 1 || seconds <= 0) {
+        fprintf(stderr, "usage: %s [max_threads] [seconds_per_run]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%8s %16s %16s %8s\n", "readers", "seqlock reads/s", "rwlock reads/s", "ratio");
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double s = run(USE_SEQLOCK, n, seconds);
+        double r = run(USE_RWLOCK, n, seconds);
+        printf("%8d %16.0f %16.0f %8.2f\n", n, s, r, s / r);
+    }
+
+    unsigned long long bad = atomic_load(&torn);
+    if (bad != 0) {
+        fprintf(stderr, "FAIL: %llu torn reads\n", bad);
+        return 1;
+    }
+    return 0;
+}
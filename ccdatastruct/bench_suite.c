@@ -0,0 +1,462 @@
+// Throughput, fairness and latency benchmarks for rwlock_t and queue_t.
+//
+// For every rwlock PRIORITY mode (plain and distributed) it sweeps thread
+// counts, read percentages and critical-section lengths; for the queue it
+// sweeps thread counts and capacities with single and batched operations.
+// Each configuration reports:
+//
+//   ops/s       completed operations per second, all threads together
+//   jain        Jain's fairness index of per-thread operation counts
+//               (1 = perfectly even, 1/threads = one thread did everything)
+//   min/max     the smallest and largest per-thread share of operations
+//   p50..p999   rwlock: time to acquire the lock; queue: time from push to
+//               pop. Upper bounds from a log2 histogram of sampled ops.
+//
+// Usage: ./bench_suite [-b rwlock|queue|all] [-t LIST] [-r LIST] [-c LIST]
+//                      [-q LIST] [-d SECONDS] [-p] [-C]
+//
+//   -t  thread counts               (default 1,2,4,8)
+//   -r  read percentages, rwlock    (default 50,95)
+//   -c  critical sections in ns     (default 0,1000)
+//   -q  queue capacities            (default 16,1024)
+//   -d  seconds per configuration   (default 0.2)
+//   -p  pin thread i to CPU i mod the number of online CPUs
+//   -C  print CSV instead of a table
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "futex.h"
+#include "lockstat.h"
+#include "queue.h"
+#include "rwlock.h"
+
+#define MAX_LIST 32
+
+// Only every LAT_SAMPLE-th operation is timed, to keep clock reads from
+// dominating short critical sections.
+#define LAT_SAMPLE 8
+
+// Elements moved per call by the batched queue variant.
+#define QUEUE_BATCH 16
+
+typedef struct {
+    int n;
+    long v[MAX_LIST];
+} list_t;
+
+typedef struct {
+    list_t threads;
+    list_t read_pct;
+    list_t cs_ns;
+    list_t capacity;
+    double seconds;
+    bool pin;
+    bool csv;
+    bool run_rwlock;
+    bool run_queue;
+} options_t;
+
+typedef struct {
+    const char *bench;
+    const char *variant;
+    int threads;
+    int read_pct;
+    long cs_ns;
+    long capacity;
+} config_t;
+
+// Per-thread state, padded so counters don't share cache lines.
+typedef struct {
+    alignas(CACHE_LINE) pthread_t thread;
+    int index;
+    uint64_t rng;
+    uint64_t ops;
+    uint64_t hist[LOCKSTAT_BUCKETS];
+} worker_t;
+
+static options_t opt;
+static atomic_bool stop;
+
+// Shared by the workers of the configuration being run.
+static rwlock_t *lock;
+static queue_t *queue;
+static config_t cur;
+static volatile uint64_t shared_data;
+
+static uint64_t next_random(worker_t *w) {
+    // xorshift64
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+static void pin(int index) {
+    if (!opt.pin) {
+        return;
+    }
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((int) (index % (ncpu > 0 ? ncpu : 1)), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void busy_for(long ns) {
+    if (ns <= 0) {
+        return;
+    }
+    uint64_t until = lockstat_now() + (uint64_t) ns;
+    while (lockstat_now() < until) {
+    }
+}
+
+static void *rwlock_worker(void *arg) {
+    worker_t *w = arg;
+    pin(w->index);
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        uint64_t r = next_random(w);
+        bool read = (int) (r % 100) < cur.read_pct;
+        bool timed = w->ops % LAT_SAMPLE == 0;
+        uint64_t t0 = timed ? lockstat_now() : 0;
+        if (read) {
+            reader_lock(lock);
+        } else {
+            writer_lock(lock);
+        }
+        if (timed) {
+            w->hist[lockstat_bucket(lockstat_now() - t0)]++;
+        }
+        busy_for(cur.cs_ns);
+        if (read) {
+            (void) shared_data;
+            reader_unlock(lock);
+        } else {
+            shared_data++;
+            writer_unlock(lock);
+        }
+        w->ops++;
+    }
+    return NULL;
+}
+
+// Producers push their send time as the element, so consumers can measure
+// queueing latency without touching shared memory.
+static void *queue_producer(void *arg) {
+    worker_t *w = arg;
+    pin(w->index);
+    bool batch = strcmp(cur.variant, "batch") == 0;
+    void *elems[QUEUE_BATCH];
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (batch) {
+            void *now = (void *) (uintptr_t) lockstat_now();
+            for (int i = 0; i < QUEUE_BATCH; i++) {
+                elems[i] = now;
+            }
+            int n = queue_push_many(queue, elems, QUEUE_BATCH);
+            if (n == 0) {
+                break;
+            }
+            w->ops += (uint64_t) n;
+        } else {
+            if (!queue_push(queue, (void *) (uintptr_t) lockstat_now())) {
+                break;
+            }
+            w->ops++;
+        }
+    }
+    return NULL;
+}
+
+static void *queue_consumer(void *arg) {
+    worker_t *w = arg;
+    pin(w->index);
+    bool batch = strcmp(cur.variant, "batch") == 0;
+    void *elems[QUEUE_BATCH];
+    while (1) {
+        int n;
+        if (batch) {
+            n = queue_pop_many(queue, elems, QUEUE_BATCH);
+        } else {
+            n = queue_pop(queue, &elems[0]) ? 1 : 0;
+        }
+        if (n == 0) {
+            break; // closed and drained
+        }
+        if (atomic_load_explicit(&stop, memory_order_relaxed)) {
+            continue; // the run is over; these pops no longer count
+        }
+        if (w->ops % LAT_SAMPLE == 0) {
+            uint64_t now = lockstat_now();
+            w->hist[lockstat_bucket(now - (uint64_t) (uintptr_t) elems[0])]++;
+        }
+        w->ops += (uint64_t) n;
+    }
+    return NULL;
+}
+
+static void sleep_seconds(double s) {
+    struct timespec ts = { (time_t) s, (long) ((s - (double) (time_t) s) * 1e9) };
+    nanosleep(&ts, NULL);
+}
+
+static void print_header(void) {
+    if (opt.csv) {
+        printf("bench,variant,threads,read_pct,cs_ns,capacity,ops_per_sec,jain,min_share,"
+               "max_share,p50_ns,p99_ns,p999_ns\n");
+    } else {
+        printf("%-7s %-17s %7s %5s %6s %6s %12s %6s %6s %6s %9s %9s %9s\n", "bench", "variant",
+               "threads", "read%", "cs_ns", "cap", "ops/s", "jain", "min", "max", "p50", "p99",
+               "p99.9");
+    }
+}
+
+// Summarizes the n workers whose operations count: all of them for the
+// rwlock, the consumers for the queue.
+static void report(worker_t *w, int n) {
+    uint64_t total = 0;
+    double sum_sq = 0;
+    uint64_t lo = UINT64_MAX;
+    uint64_t hi = 0;
+    for (int i = 0; i < n; i++) {
+        total += w[i].ops;
+        sum_sq += (double) w[i].ops * (double) w[i].ops;
+        lo = w[i].ops < lo ? w[i].ops : lo;
+        hi = w[i].ops > hi ? w[i].ops : hi;
+    }
+    double jain = sum_sq > 0 ? (double) total * (double) total / (n * sum_sq) : 0;
+    double min_share = total > 0 ? (double) lo / (double) total : 0;
+    double max_share = total > 0 ? (double) hi / (double) total : 0;
+
+    lockstat_hist_t h;
+    memset(&h, 0, sizeof(h));
+    for (int i = 0; i < n; i++) {
+        for (int b = 0; b < LOCKSTAT_BUCKETS; b++) {
+            h.count[b] += w[i].hist[b];
+        }
+    }
+    unsigned long long p50 = lockstat_percentile(&h, 50);
+    unsigned long long p99 = lockstat_percentile(&h, 99);
+    unsigned long long p999 = lockstat_percentile(&h, 99.9);
+    double rate = (double) total / opt.seconds;
+
+    if (opt.csv) {
+        printf("%s,%s,%d,%d,%ld,%ld,%.0f,%.4f,%.4f,%.4f,%llu,%llu,%llu\n", cur.bench, cur.variant,
+               cur.threads, cur.read_pct, cur.cs_ns, cur.capacity, rate, jain, min_share,
+               max_share, p50, p99, p999);
+    } else {
+        printf("%-7s %-17s %7d %5d %6ld %6ld %12.0f %6.3f %6.3f %6.3f %9llu %9llu %9llu\n",
+               cur.bench, cur.variant, cur.threads, cur.read_pct, cur.cs_ns, cur.capacity, rate,
+               jain, min_share, max_share, p50, p99, p999);
+    }
+    fflush(stdout);
+}
+
+static worker_t *workers_new(int n) {
+    worker_t *w = aligned_alloc(CACHE_LINE, sizeof(worker_t) * (size_t) n);
+    if (w == NULL) {
+        perror("aligned_alloc");
+        exit(1);
+    }
+    memset(w, 0, sizeof(worker_t) * (size_t) n);
+    for (int i = 0; i < n; i++) {
+        w[i].index = i;
+        w[i].rng = 0x9e3779b97f4a7c15ULL * (uint64_t) (i + 1);
+    }
+    return w;
+}
+
+static void bench_rwlock(void) {
+    static const struct {
+        const char *name;
+        PRIORITY p;
+    } modes[] = { { "READERS", READERS }, { "WRITERS", WRITERS }, { "N_WAY", N_WAY },
+                  { "PHASE_FAIR", PHASE_FAIR } };
+    char variant[32];
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        for (int dist = 0; dist <= 1; dist++) {
+            snprintf(variant, sizeof(variant), "%s%s", modes[m].name, dist ? "/dist" : "");
+            for (int t = 0; t < opt.threads.n; t++) {
+                for (int r = 0; r < opt.read_pct.n; r++) {
+                    for (int c = 0; c < opt.cs_ns.n; c++) {
+                        cur = (config_t) { "rwlock",
+                                           variant,
+                                           (int) opt.threads.v[t],
+                                           (int) opt.read_pct.v[r],
+                                           opt.cs_ns.v[c],
+                                           0 };
+                        lock = dist ? rwlock_new_distributed(modes[m].p, 3)
+                                    : rwlock_new(modes[m].p, 3);
+                        if (lock == NULL) {
+                            fprintf(stderr, "rwlock_new failed\n");
+                            exit(1);
+                        }
+                        worker_t *w = workers_new(cur.threads);
+                        atomic_store(&stop, false);
+                        for (int i = 0; i < cur.threads; i++) {
+                            pthread_create(&w[i].thread, NULL, rwlock_worker, &w[i]);
+                        }
+                        sleep_seconds(opt.seconds);
+                        atomic_store(&stop, true);
+                        for (int i = 0; i < cur.threads; i++) {
+                            pthread_join(w[i].thread, NULL);
+                        }
+                        report(w, cur.threads);
+                        free(w);
+                        rwlock_delete(&lock);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void bench_queue(void) {
+    static const char *variants[] = { "single", "batch" };
+
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        for (int t = 0; t < opt.threads.n; t++) {
+            for (int q = 0; q < opt.capacity.n; q++) {
+                // Half producers, half consumers; at least one of each.
+                int threads = opt.threads.v[t] < 2 ? 2 : (int) opt.threads.v[t];
+                int consumers = threads - threads / 2;
+                cur = (config_t) { "queue", variants[v], threads, 0, 0, opt.capacity.v[q] };
+                queue = queue_new((int) cur.capacity);
+                if (queue == NULL) {
+                    fprintf(stderr, "queue_new failed\n");
+                    exit(1);
+                }
+                worker_t *w = workers_new(threads);
+                atomic_store(&stop, false);
+                for (int i = 0; i < threads; i++) {
+                    pthread_create(&w[i].thread, NULL, i < consumers ? queue_consumer : queue_producer,
+                                   &w[i]);
+                }
+                sleep_seconds(opt.seconds);
+                atomic_store(&stop, true);
+                queue_close(queue);
+                for (int i = 0; i < threads; i++) {
+                    pthread_join(w[i].thread, NULL);
+                }
+                report(w, consumers);
+                free(w);
+                queue_delete(&queue);
+            }
+        }
+    }
+}
+
+static bool parse_list(const char *s, list_t *out) {
+    out->n = 0;
+    char *copy = strdup(s);
+    if (copy == NULL) {
+        return false;
+    }
+    char *save = NULL;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char *end;
+        long v = strtol(tok, &end, 10);
+        if (*end != '\0' || v < 0 || out->n == MAX_LIST) {
+            free(copy);
+            return false;
+        }
+        out->v[out->n++] = v;
+    }
+    free(copy);
+    return out->n > 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-b rwlock|queue|all] [-t LIST] [-r LIST] [-c LIST] [-q LIST] "
+            "[-d SECONDS] [-p] [-C]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    parse_list("1,2,4,8", &opt.threads);
+    parse_list("50,95", &opt.read_pct);
+    parse_list("0,1000", &opt.cs_ns);
+    parse_list("16,1024", &opt.capacity);
+    opt.seconds = 0.2;
+    opt.run_rwlock = true;
+    opt.run_queue = true;
+
+    int c;
+    while ((c = getopt(argc, argv, "b:t:r:c:q:d:pC")) != -1) {
+        switch (c) {
+        case 'b':
+            opt.run_rwlock = strcmp(optarg, "rwlock") == 0 || strcmp(optarg, "all") == 0;
+            opt.run_queue = strcmp(optarg, "queue") == 0 || strcmp(optarg, "all") == 0;
+            if (!opt.run_rwlock && !opt.run_queue) {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+        case 'r':
+        case 'c':
+        case 'q': {
+            list_t *l = c == 't' ? &opt.threads
+                        : c == 'r' ? &opt.read_pct
+                        : c == 'c' ? &opt.cs_ns
+                                   : &opt.capacity;
+            if (!parse_list(optarg, l)) {
+                usage(argv[0]);
+            }
+            break;
+        }
+        case 'd':
+            opt.seconds = atof(optarg);
+            if (opt.seconds <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'p':
+            opt.pin = true;
+            break;
+        case 'C':
+            opt.csv = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    for (int i = 0; i < opt.threads.n; i++) {
+        if (opt.threads.v[i] < 1) {
+            usage(argv[0]);
+        }
+    }
+    for (int i = 0; i < opt.read_pct.n; i++) {
+        if (opt.read_pct.v[i] > 100) {
+            usage(argv[0]);
+        }
+    }
+    for (int i = 0; i < opt.capacity.n; i++) {
+        if (opt.capacity.v[i] < 1) {
+            usage(argv[0]);
+        }
+    }
+
+    print_header();
+    if (opt.run_rwlock) {
+        bench_rwlock();
+    }
+    if (opt.run_queue) {
+        bench_queue();
+    }
+    return 0;
+}
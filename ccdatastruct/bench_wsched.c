@@ -0,0 +1,81 @@
+// Measures the per-task overhead of wsched as the worker count grows.
+//
+// "spawn" builds a binary tree of empty tasks with wsched_spawn, so almost
+// every task is pushed and taken on its worker's own deque and the rest are
+// stolen. "submit" has the main thread wsched_submit the same number of
+// empty tasks through the shared queue. Each run ends with wsched_wait.
+// Prints nanoseconds per task and tasks per second.
+//
+// Usage: ./bench_wsched [max_threads] [tree_depth]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wsched.h"
+
+static wsched_t *sched;
+
+static void tree_node(void *arg) {
+    uintptr_t depth = (uintptr_t) arg;
+    if (depth > 0) {
+        wsched_spawn(sched, tree_node, (void *) (depth - 1));
+        wsched_spawn(sched, tree_node, (void *) (depth - 1));
+    }
+}
+
+static void empty(void *arg) {
+    (void) arg;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Runs one tree's worth of tasks in the given pattern on a fresh pool and
+// returns the seconds taken; the task count is stored in *tasks.
+static double run(int nthreads, int depth, int submit, uint64_t *tasks) {
+    sched = wsched_new(nthreads);
+    if (sched == NULL) {
+        fprintf(stderr, "wsched_new failed\n");
+        exit(1);
+    }
+    uint64_t n = ((uint64_t) 1 << (depth + 1)) - 1;
+    double t0 = now();
+    if (submit) {
+        for (uint64_t i = 0; i < n; i++) {
+            wsched_submit(sched, empty, NULL);
+        }
+    } else {
+        wsched_submit(sched, tree_node, (void *) (uintptr_t) depth);
+    }
+    wsched_wait(sched);
+    double t = now() - t0;
+    wsched_delete(&sched);
+    *tasks = n;
+    return t;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int depth = argc > 2 ? atoi(argv[2]) : 20;
+    if (max_threads < 1 || depth < 1 || depth > 30) {
+        fprintf(stderr, "usage: %s [max_threads] [tree_depth]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%8s %8s %12s %10s %14s\n", "pattern", "threads", "tasks", "ns/task", "tasks/s");
+    for (int submit = 0; submit <= 1; submit++) {
+        for (int n = 1; n <= max_threads; n *= 2) {
+            uint64_t tasks;
+            double t = run(n, depth, submit, &tasks);
+            printf("%8s %8d %12llu %10.1f %14.0f\n", submit ? "submit" : "spawn", n,
+                   (unsigned long long) tasks, t * 1e9 / (double) tasks, (double) tasks / t);
+        }
+    }
+    return 0;
+}
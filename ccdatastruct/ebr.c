@@ -0,0 +1,436 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ebr.h"
+#include "futex.h"
+
+// Retired nodes per batch. A batch is published to the domain when full.
+#define EBR_BATCH 64
+
+// Published batches that trigger a reclaim pass.
+#define EBR_COLLECT_BATCHES 4
+
+typedef struct batch {
+    struct batch *next;
+    uint64_t epoch; // global epoch when the batch was published
+    int n;
+    struct {
+        void *ptr;
+        ebr_free_fn fn;
+    } item[EBR_BATCH];
+} batch_t;
+
+struct ebr_thread {
+    // (epoch << 1) | 1 while inside a critical section, 0 outside. Written
+    // only by the owner, scanned by reclaimers.
+    alignas(CACHE_LINE) _Atomic uint64_t local;
+    void *_Atomic hazard[EBR_HAZARDS];
+
+    // Owner-only state.
+    unsigned depth;
+    batch_t *batch;
+
+    ebr_t *domain;
+    _Atomic bool in_use;
+    struct ebr_thread *next; // registry link, fixed once published
+};
+
+struct ebr {
+    alignas(CACHE_LINE) _Atomic uint64_t epoch;
+
+    // Published batches not yet freed, and how many there are.
+    alignas(CACHE_LINE) _Atomic(batch_t *) pending;
+    _Atomic int npending;
+    atomic_flag reclaiming;
+
+    // Every handle ever registered; handles are reused, never unlinked.
+    _Atomic(ebr_thread_t *) threads;
+    pthread_key_t key;
+
+    int reclaim_ms;
+    pthread_t reclaimer;
+    _Atomic bool stop;
+    eventcount_t kick;
+};
+
+static void run_free(void *ptr, ebr_free_fn fn) {
+    if (fn != NULL) {
+        fn(ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+static void free_batches(batch_t *b) {
+    while (b != NULL) {
+        batch_t *next = b->next;
+        for (int i = 0; i < b->n; i++) {
+            run_free(b->item[i].ptr, b->item[i].fn);
+        }
+        free(b);
+        b = next;
+    }
+}
+
+// Pushes the chain first..last onto the pending list.
+static void push_pending(ebr_t *e, batch_t *first, batch_t *last) {
+    batch_t *head = atomic_load_explicit(&e->pending, memory_order_relaxed);
+    do {
+        last->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&e->pending, &head, first,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+// Advances the global epoch if every thread inside a critical section has
+// already observed the current one.
+static bool try_advance(ebr_t *e) {
+    uint64_t g = atomic_load_explicit(&e->epoch, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (ebr_thread_t *t = atomic_load_explicit(&e->threads, memory_order_acquire); t != NULL;
+         t = t->next) {
+        uint64_t l = atomic_load_explicit(&t->local, memory_order_acquire);
+        if ((l & 1) && (l >> 1) != g) {
+            return false;
+        }
+    }
+    return atomic_compare_exchange_strong(&e->epoch, &g, g + 1);
+}
+
+static int cmp_ptr(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) *(void *const *) a;
+    uintptr_t y = (uintptr_t) *(void *const *) b;
+    return (x > y) - (x < y);
+}
+
+// Returns a sorted array of every published hazard pointer, or NULL with
+// *n = 0 if there are none. Sets *n = -1 if the array can't be allocated.
+static void **gather_hazards(ebr_t *e, int *n) {
+    atomic_thread_fence(memory_order_seq_cst);
+    // Threads registered after this load can't have seen a node that was
+    // already retired, so a snapshot of the registry is enough.
+    ebr_thread_t *first = atomic_load_explicit(&e->threads, memory_order_acquire);
+    int cap = 0;
+    for (ebr_thread_t *t = first; t != NULL; t = t->next) {
+        cap += EBR_HAZARDS;
+    }
+    void **hp = cap > 0 ? malloc(sizeof(void *) * (size_t) cap) : NULL;
+    if (cap > 0 && hp == NULL) {
+        *n = -1;
+        return NULL;
+    }
+    int count = 0;
+    for (ebr_thread_t *t = first; t != NULL; t = t->next) {
+        for (int i = 0; i < EBR_HAZARDS; i++) {
+            void *p = atomic_load(&t->hazard[i]);
+            if (p != NULL) {
+                hp[count++] = p;
+            }
+        }
+    }
+    if (count == 0) {
+        free(hp);
+        *n = 0;
+        return NULL;
+    }
+    qsort(hp, (size_t) count, sizeof(void *), cmp_ptr);
+    *n = count;
+    return hp;
+}
+
+// One reclaim pass: advance the epoch as far as it will go, then free every
+// node in batches published at least two epochs ago that no hazard pointer
+// holds. Only one thread reclaims at a time.
+static int reclaim(ebr_t *e) {
+    if (atomic_flag_test_and_set_explicit(&e->reclaiming, memory_order_acquire)) {
+        return 0;
+    }
+    if (try_advance(e)) {
+        try_advance(e);
+    }
+    uint64_t now = atomic_load(&e->epoch);
+
+    batch_t *list = atomic_exchange_explicit(&e->pending, NULL, memory_order_acquire);
+    int nhp = 0;
+    void **hp = NULL;
+    if (list != NULL) {
+        hp = gather_hazards(e, &nhp);
+    }
+
+    batch_t *keep = NULL;
+    batch_t *keep_last = NULL;
+    int freed = 0;
+    int released = 0;
+    while (list != NULL) {
+        batch_t *b = list;
+        list = b->next;
+        if (now - b->epoch >= 2 && nhp >= 0) {
+            int kept = 0;
+            for (int i = 0; i < b->n; i++) {
+                if (nhp > 0
+                    && bsearch(&b->item[i].ptr, hp, (size_t) nhp, sizeof(void *), cmp_ptr)
+                           != NULL) {
+                    b->item[kept++] = b->item[i];
+                } else {
+                    run_free(b->item[i].ptr, b->item[i].fn);
+                    freed++;
+                }
+            }
+            b->n = kept;
+            if (kept == 0) {
+                free(b);
+                released++;
+                continue;
+            }
+        }
+        b->next = keep;
+        keep = b;
+        if (keep_last == NULL) {
+            keep_last = b;
+        }
+    }
+    free(hp);
+
+    if (keep != NULL) {
+        push_pending(e, keep, keep_last);
+    }
+    atomic_fetch_sub(&e->npending, released);
+    atomic_flag_clear_explicit(&e->reclaiming, memory_order_release);
+    return freed;
+}
+
+// Publishes the thread's current batch and kicks off reclamation if enough
+// batches have piled up.
+static void publish(ebr_thread_t *t) {
+    batch_t *b = t->batch;
+    if (b == NULL || b->n == 0) {
+        return;
+    }
+    ebr_t *e = t->domain;
+    t->batch = NULL;
+    // Every node in the batch was unlinked before this load.
+    atomic_thread_fence(memory_order_seq_cst);
+    b->epoch = atomic_load_explicit(&e->epoch, memory_order_relaxed);
+    push_pending(e, b, b);
+
+    int n = atomic_fetch_add(&e->npending, 1) + 1;
+    if (n % EBR_COLLECT_BATCHES == 0) {
+        if (e->reclaim_ms > 0) {
+            ec_notify(&e->kick, 1);
+        } else {
+            reclaim(e);
+        }
+    }
+}
+
+static void *reclaimer_main(void *arg) {
+    ebr_t *e = arg;
+    while (!atomic_load(&e->stop)) {
+        reclaim(e);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += e->reclaim_ms / 1000;
+        deadline.tv_nsec += (long) (e->reclaim_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        uint32_t key = ec_prepare(&e->kick);
+        if (atomic_load(&e->stop)) {
+            ec_cancel(&e->kick);
+            break;
+        }
+        ec_wait(&e->kick, key, &deadline);
+    }
+    return NULL;
+}
+
+static void self_destructor(void *arg) {
+    ebr_unregister(arg);
+}
+
+ebr_t *ebr_new(int reclaim_ms) {
+    size_t bytes = (sizeof(ebr_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    ebr_t *e = aligned_alloc(CACHE_LINE, bytes);
+    if (e == NULL) {
+        return NULL;
+    }
+    memset(e, 0, sizeof(*e));
+    atomic_init(&e->epoch, 0);
+    atomic_init(&e->pending, NULL);
+    atomic_init(&e->npending, 0);
+    atomic_flag_clear(&e->reclaiming);
+    atomic_init(&e->threads, NULL);
+    atomic_init(&e->stop, false);
+    atomic_init(&e->kick.seq, 0);
+    atomic_init(&e->kick.waiters, 0);
+    e->reclaim_ms = reclaim_ms > 0 ? reclaim_ms : 0;
+
+    if (pthread_key_create(&e->key, self_destructor) != 0) {
+        free(e);
+        return NULL;
+    }
+    if (e->reclaim_ms > 0 && pthread_create(&e->reclaimer, NULL, reclaimer_main, e) != 0) {
+        pthread_key_delete(e->key);
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+void ebr_delete(ebr_t **e) {
+    if (e == NULL || *e == NULL) {
+        return;
+    }
+    ebr_t *d = *e;
+    if (d->reclaim_ms > 0) {
+        atomic_store(&d->stop, true);
+        ec_notify(&d->kick, INT_MAX);
+        pthread_join(d->reclaimer, NULL);
+    }
+    pthread_key_delete(d->key);
+
+    free_batches(atomic_load(&d->pending));
+    ebr_thread_t *t = atomic_load(&d->threads);
+    while (t != NULL) {
+        ebr_thread_t *next = t->next;
+        free_batches(t->batch);
+        free(t);
+        t = next;
+    }
+    free(d);
+    *e = NULL;
+}
+
+ebr_thread_t *ebr_register(ebr_t *e) {
+    if (e == NULL) {
+        return NULL;
+    }
+    for (ebr_thread_t *t = atomic_load_explicit(&e->threads, memory_order_acquire); t != NULL;
+         t = t->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&t->in_use, memory_order_relaxed)
+            && atomic_compare_exchange_strong(&t->in_use, &expected, true)) {
+            return t;
+        }
+    }
+
+    size_t bytes = (sizeof(ebr_thread_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    ebr_thread_t *t = aligned_alloc(CACHE_LINE, bytes);
+    if (t == NULL) {
+        return NULL;
+    }
+    memset(t, 0, sizeof(*t));
+    atomic_init(&t->local, 0);
+    for (int i = 0; i < EBR_HAZARDS; i++) {
+        atomic_init(&t->hazard[i], NULL);
+    }
+    t->domain = e;
+    atomic_init(&t->in_use, true);
+
+    ebr_thread_t *head = atomic_load_explicit(&e->threads, memory_order_relaxed);
+    do {
+        t->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&e->threads, &head, t, memory_order_release,
+                                                    memory_order_relaxed));
+    return t;
+}
+
+void ebr_unregister(ebr_thread_t *t) {
+    if (t == NULL) {
+        return;
+    }
+    publish(t);
+    for (int i = 0; i < EBR_HAZARDS; i++) {
+        atomic_store(&t->hazard[i], NULL);
+    }
+    t->depth = 0;
+    atomic_store_explicit(&t->local, 0, memory_order_release);
+    atomic_store_explicit(&t->in_use, false, memory_order_release);
+}
+
+ebr_thread_t *ebr_self(ebr_t *e) {
+    if (e == NULL) {
+        return NULL;
+    }
+    ebr_thread_t *t = pthread_getspecific(e->key);
+    if (t == NULL) {
+        t = ebr_register(e);
+        if (t != NULL && pthread_setspecific(e->key, t) != 0) {
+            ebr_unregister(t);
+            t = NULL;
+        }
+    }
+    return t;
+}
+
+void ebr_enter(ebr_thread_t *t) {
+    if (t->depth++ > 0) {
+        return;
+    }
+    // A stale epoch only delays reclamation. The exchange is a full barrier,
+    // so the announcement is visible before any shared pointer is read, and
+    // it releases this thread's earlier reads to the reclaimer's scan.
+    uint64_t g = atomic_load_explicit(&t->domain->epoch, memory_order_relaxed);
+    atomic_exchange(&t->local, (g << 1) | 1);
+}
+
+void ebr_exit(ebr_thread_t *t) {
+    if (--t->depth > 0) {
+        return;
+    }
+    atomic_store_explicit(&t->local, 0, memory_order_release);
+}
+
+bool ebr_retire(ebr_thread_t *t, void *ptr, ebr_free_fn fn) {
+    if (t == NULL || ptr == NULL) {
+        return false;
+    }
+    if (t->batch == NULL) {
+        t->batch = malloc(sizeof(batch_t));
+        if (t->batch == NULL) {
+            return false;
+        }
+        t->batch->n = 0;
+    }
+    batch_t *b = t->batch;
+    b->item[b->n].ptr = ptr;
+    b->item[b->n].fn = fn;
+    if (++b->n == EBR_BATCH) {
+        publish(t);
+    }
+    return true;
+}
+
+int ebr_collect(ebr_thread_t *t) {
+    if (t == NULL) {
+        return 0;
+    }
+    publish(t);
+    return reclaim(t->domain);
+}
+
+void *ebr_protect(ebr_thread_t *t, int slot, void *_Atomic *src) {
+    void *p = atomic_load(src);
+    while (1) {
+        atomic_store(&t->hazard[slot], p);
+        // Reclaimers scan hazards after the node is unlinked, so if src
+        // still holds p the scan is guaranteed to see it.
+        void *again = atomic_load(src);
+        if (again == p) {
+            return p;
+        }
+        p = again;
+    }
+}
+
+void ebr_clear(ebr_thread_t *t, int slot) {
+    atomic_store_explicit(&t->hazard[slot], NULL, memory_order_release);
+}
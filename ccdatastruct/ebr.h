@@ -0,0 +1,120 @@
+#pragma once
+
+/**
+ *  Epoch-based memory reclamation for lock-free structures.
+ *
+ *  A lock-free structure cannot free a node as soon as it unlinks it, since
+ *  other threads may still be reading it. Instead, readers bracket every
+ *  access with ebr_enter/ebr_exit, and writers hand unlinked nodes to
+ *  ebr_retire. A retired node is freed once every thread that was inside a
+ *  critical section at the time has left it, which the domain detects by
+ *  advancing a global epoch.
+ *
+ *  Retired nodes collect in per-thread batches. Full batches move to a
+ *  shared list that is reclaimed either inline by retiring threads or, if
+ *  the domain was created with a reclaim interval, by a background thread.
+ *
+ *  A thread that holds a reference for a long time (across blocking I/O, for
+ *  example) would stall the epoch for everyone. It can instead publish the
+ *  reference in a hazard pointer slot with ebr_protect and leave its
+ *  critical section; the node is then kept alive until ebr_clear.
+ *
+ *  Typical reader:
+ *
+ *      ebr_thread_t *self = ebr_self(domain);
+ *      ebr_enter(self);
+ *      node_t *n = atomic_load(&head);
+ *      ... read n ...
+ *      ebr_exit(self);
+ *
+ *  Typical writer, after unlinking n:
+ *
+ *      ebr_retire(self, n, free_node);
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#define EBR_HAZARDS 4 // hazard pointer slots per thread
+
+typedef struct ebr ebr_t;
+typedef struct ebr_thread ebr_thread_t;
+
+typedef void (*ebr_free_fn)(void *ptr);
+
+/** @brief Creates a reclamation domain.
+ *
+ *  @param reclaim_ms If positive, a background thread reclaims retired
+ *         memory at least this often and whenever enough has piled up, so
+ *         retiring threads never run free callbacks themselves. If 0,
+ *         retiring threads reclaim inline every few batches.
+ *
+ *  @return A pointer to the domain, or NULL on failure.
+ */
+ebr_t *ebr_new(int reclaim_ms);
+
+/** @brief Stops the background thread, frees everything still retired and
+ *         frees the domain. Sets *e to NULL.
+ *
+ *  No thread may be inside a critical section or use its ebr_thread_t
+ *  afterwards.
+ */
+void ebr_delete(ebr_t **e);
+
+/** @brief Registers the calling thread with e.
+ *
+ *  @return A handle owned by the calling thread, or NULL on failure.
+ */
+ebr_thread_t *ebr_register(ebr_t *e);
+
+/** @brief Hands the thread's pending retirements to the domain and releases
+ *         the handle for reuse. The thread must not be in a critical section.
+ */
+void ebr_unregister(ebr_thread_t *t);
+
+/** @brief Returns the calling thread's handle for e, registering it on first
+ *         use. The handle is unregistered automatically when the thread
+ *         exits.
+ *
+ *  @return The handle, or NULL if registration fails.
+ */
+ebr_thread_t *ebr_self(ebr_t *e);
+
+/** @brief Enters a critical section. Nodes reachable now stay allocated until
+ *         the matching ebr_exit. Sections may nest.
+ */
+void ebr_enter(ebr_thread_t *t);
+
+/** @brief Leaves a critical section.
+ */
+void ebr_exit(ebr_thread_t *t);
+
+/** @brief Schedules fn(ptr) to run once no thread can still hold a reference
+ *         to ptr. ptr must already be unreachable for new readers.
+ *
+ *  @param fn The destructor, or NULL for free.
+ *
+ *  @return true on success, false if memory for the retire list could not be
+ *          allocated, in which case ptr was not retired.
+ */
+bool ebr_retire(ebr_thread_t *t, void *ptr, ebr_free_fn fn);
+
+/** @brief Publishes the calling thread's pending retirements and reclaims
+ *         whatever is safe to free. Useful before a thread goes idle.
+ *
+ *  @return The number of nodes freed, or 0 if another thread is already
+ *          reclaiming.
+ */
+int ebr_collect(ebr_thread_t *t);
+
+/** @brief Loads *src into hazard slot `slot` and returns it. The returned
+ *         node stays allocated until ebr_clear(t, slot), even outside a
+ *         critical section.
+ *
+ *  @param slot A slot index in [0, EBR_HAZARDS).
+ */
+void *ebr_protect(ebr_thread_t *t, int slot, void *_Atomic *src);
+
+/** @brief Releases the node held in hazard slot `slot`.
+ */
+void ebr_clear(ebr_thread_t *t, int slot);
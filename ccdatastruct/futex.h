@@ -0,0 +1,117 @@
+#pragma once
+
+/**
+ *  Thin wrappers around the Linux futex syscall plus a few helpers shared by
+ *  the lock-free structures in this directory.
+ */
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+
+/** @brief Hint to the CPU that we are in a spin-wait loop.
+ */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/** @brief Sleeps while *addr still holds expected.
+ *
+ *  @param addr The futex word.
+ *
+ *  @param expected The value *addr must hold for the caller to sleep.
+ *
+ *  @param deadline An absolute CLOCK_MONOTONIC deadline, or NULL to wait
+ *         forever.
+ *
+ *  @return 0 when woken (possibly spuriously), or -1 with errno set to
+ *          EAGAIN (value changed), EINTR or ETIMEDOUT.
+ */
+static inline int futex_wait(_Atomic uint32_t *addr, uint32_t expected,
+                             const struct timespec *deadline) {
+    return (int) syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+                         expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+/** @brief Like futex_wait, but only futex_wake_bits calls whose bits
+ *         overlap these wake the caller.
+ */
+static inline int futex_wait_bits(_Atomic uint32_t *addr, uint32_t expected,
+                                  const struct timespec *deadline, uint32_t bits) {
+    return (int) syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+                         expected, deadline, NULL, bits);
+}
+
+/** @brief Wakes up to n threads sleeping on addr.
+ *
+ *  @return The number of threads woken.
+ */
+static inline int futex_wake(_Atomic uint32_t *addr, int n) {
+    return (int) syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, n, NULL,
+                         NULL, 0);
+}
+
+/** @brief Wakes up to n threads sleeping on addr whose wait bits overlap
+ *         bits; futex_wait sleepers match any.
+ *
+ *  @return The number of threads woken.
+ */
+static inline int futex_wake_bits(_Atomic uint32_t *addr, int n, uint32_t bits) {
+    return (int) syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAKE_BITSET | FUTEX_PRIVATE_FLAG, n,
+                         NULL, NULL, bits);
+}
+
+/**
+ *  An eventcount lets a thread sleep until some lock-free condition may have
+ *  changed without the notifier paying a syscall when nobody is waiting.
+ *
+ *  Waiter:   key = ec_prepare(ec); if (condition) ec_cancel(ec); else ec_wait(ec, key, dl);
+ *  Notifier: make condition true; ec_notify(ec, n);
+ */
+typedef struct {
+    _Atomic uint32_t seq;
+    _Atomic uint32_t waiters;
+} eventcount_t;
+
+static inline uint32_t ec_prepare(eventcount_t *ec) {
+    atomic_fetch_add(&ec->waiters, 1);
+    uint32_t key = atomic_load(&ec->seq);
+    atomic_thread_fence(memory_order_seq_cst);
+    return key;
+}
+
+static inline void ec_cancel(eventcount_t *ec) {
+    atomic_fetch_sub_explicit(&ec->waiters, 1, memory_order_relaxed);
+}
+
+/** @brief Sleeps until the eventcount moves past key or the deadline expires.
+ *
+ *  @return 0 on wakeup (possibly spurious), or -1 with errno ETIMEDOUT.
+ */
+static inline int ec_wait(eventcount_t *ec, uint32_t key, const struct timespec *deadline) {
+    int rc = 0;
+    if (atomic_load_explicit(&ec->seq, memory_order_relaxed) == key
+        && futex_wait(&ec->seq, key, deadline) < 0 && errno == ETIMEDOUT) {
+        rc = -1;
+    }
+    atomic_fetch_sub_explicit(&ec->waiters, 1, memory_order_relaxed);
+    return rc;
+}
+
+static inline void ec_notify(eventcount_t *ec, int n) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ec->waiters, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&ec->seq, 1);
+        futex_wake(&ec->seq, n);
+    }
+}
@@ -0,0 +1,439 @@
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ebr.h"
+#include "futex.h"
+#include "hashmap.h"
+#include "seqlock.h"
+
+// Number of independently locked and resized segments; a power of two.
+#define HASHMAP_SEGMENT_BITS 6
+#define HASHMAP_SEGMENTS (1 << HASHMAP_SEGMENT_BITS)
+
+// Entries per bucket: three (tag, key, value) triples fill a 64-byte line.
+#define BUCKET_SLOTS 3
+
+// Smallest per-segment table, in buckets; a power of two.
+#define MIN_BUCKETS 4
+
+// Slot tags. Live slots hold the top bits of the hash with bit 1 set, so
+// they never collide with these.
+#define TAG_EMPTY 0u
+#define TAG_TOMBSTONE 1u
+
+// Keys are immutable once published and freed through EBR, so a reader may
+// still compare against one after it has been removed.
+typedef struct {
+    uint64_t hash;
+    size_t len;
+    char str[];
+} hkey_t;
+
+typedef struct {
+    alignas(CACHE_LINE) _Atomic uint32_t tag[BUCKET_SLOTS];
+    _Atomic(hkey_t *) key[BUCKET_SLOTS];
+    void *_Atomic value[BUCKET_SLOTS];
+} bucket_t;
+
+typedef struct {
+    size_t nbuckets;
+    bucket_t *buckets;
+} table_t;
+
+typedef struct {
+    // Bumped (to odd and back) around every change a reader could observe
+    // half-done: removing an entry or replacing the table.
+    alignas(CACHE_LINE) seqlock_t version;
+    pthread_mutex_t lock;
+    _Atomic(table_t *) table;
+    _Atomic size_t live;
+    size_t used; // live entries plus tombstones, under lock
+} segment_t;
+
+struct hashmap {
+    segment_t seg[HASHMAP_SEGMENTS];
+    ebr_t *ebr;
+};
+
+// FNV-1a, with a final mix so the low bits (segment) and the bits above them
+// (bucket) both depend on the whole key.
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) key[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint32_t tag_of(uint64_t hash) {
+    return (uint32_t) (hash >> 32) | 2u;
+}
+
+static size_t home_bucket(const table_t *t, uint64_t hash) {
+    return (size_t) (hash >> HASHMAP_SEGMENT_BITS) & (t->nbuckets - 1);
+}
+
+static bool key_equals(const hkey_t *k, uint64_t hash, const char *key, size_t len) {
+    return k->hash == hash && k->len == len && memcmp(k->str, key, len) == 0;
+}
+
+static table_t *table_new(size_t nbuckets) {
+    table_t *t = malloc(sizeof(table_t));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->nbuckets = nbuckets;
+    t->buckets = aligned_alloc(CACHE_LINE, sizeof(bucket_t) * nbuckets);
+    if (t->buckets == NULL) {
+        free(t);
+        return NULL;
+    }
+    memset(t->buckets, 0, sizeof(bucket_t) * nbuckets);
+    return t;
+}
+
+static void table_free(void *p) {
+    table_t *t = p;
+    free(t->buckets);
+    free(t);
+}
+
+// Finds key in t. Lock-free; the caller validates the result against the
+// segment version.
+static bool table_lookup(const table_t *t, uint64_t hash, const char *key, size_t len,
+                         void **value) {
+    uint32_t want = tag_of(hash);
+    size_t mask = t->nbuckets - 1;
+    size_t i = home_bucket(t, hash);
+    for (size_t n = 0; n < t->nbuckets; n++, i = (i + 1) & mask) {
+        bucket_t *b = &t->buckets[i];
+        for (int s = 0; s < BUCKET_SLOTS; s++) {
+            uint32_t tag = atomic_load_explicit(&b->tag[s], memory_order_acquire);
+            if (tag == TAG_EMPTY) {
+                return false;
+            }
+            if (tag != want) {
+                continue;
+            }
+            hkey_t *k = atomic_load_explicit(&b->key[s], memory_order_relaxed);
+            if (k != NULL && key_equals(k, hash, key, len)) {
+                *value = atomic_load_explicit(&b->value[s], memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    bucket_t *bucket; // where key lives, or NULL
+    int slot;
+    bucket_t *free_bucket; // first empty or tombstone slot on the probe path
+    int free_slot;
+} probe_t;
+
+// Probes for key with the segment lock held.
+static probe_t table_probe(table_t *t, uint64_t hash, const char *key, size_t len) {
+    probe_t p = { NULL, 0, NULL, 0 };
+    uint32_t want = tag_of(hash);
+    size_t mask = t->nbuckets - 1;
+    size_t i = home_bucket(t, hash);
+    for (size_t n = 0; n < t->nbuckets; n++, i = (i + 1) & mask) {
+        bucket_t *b = &t->buckets[i];
+        for (int s = 0; s < BUCKET_SLOTS; s++) {
+            uint32_t tag = atomic_load_explicit(&b->tag[s], memory_order_relaxed);
+            if (tag == TAG_EMPTY || tag == TAG_TOMBSTONE) {
+                if (p.free_bucket == NULL) {
+                    p.free_bucket = b;
+                    p.free_slot = s;
+                }
+                if (tag == TAG_EMPTY) {
+                    return p;
+                }
+                continue;
+            }
+            hkey_t *k = atomic_load_explicit(&b->key[s], memory_order_relaxed);
+            if (tag == want && key_equals(k, hash, key, len)) {
+                p.bucket = b;
+                p.slot = s;
+                return p;
+            }
+        }
+    }
+    return p;
+}
+
+// Publishes an entry in a free slot. Readers see the tag last, so they never
+// match a half-written slot.
+static void slot_fill(bucket_t *b, int s, hkey_t *k, void *value) {
+    atomic_store_explicit(&b->key[s], k, memory_order_relaxed);
+    atomic_store_explicit(&b->value[s], value, memory_order_relaxed);
+    atomic_store_explicit(&b->tag[s], tag_of(k->hash), memory_order_release);
+}
+
+// Rebuilds the segment's table without tombstones, doubling it if it is
+// more than half full of live entries. Called with the segment lock held.
+static bool segment_resize(hashmap_t *m, segment_t *sg) {
+    table_t *old = atomic_load_explicit(&sg->table, memory_order_relaxed);
+    size_t live = atomic_load_explicit(&sg->live, memory_order_relaxed);
+    size_t nbuckets = old->nbuckets;
+    if (live * 2 >= nbuckets * BUCKET_SLOTS) {
+        nbuckets *= 2;
+    }
+    table_t *t = table_new(nbuckets);
+    if (t == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < old->nbuckets; i++) {
+        bucket_t *b = &old->buckets[i];
+        for (int s = 0; s < BUCKET_SLOTS; s++) {
+            uint32_t tag = atomic_load_explicit(&b->tag[s], memory_order_relaxed);
+            if (tag == TAG_EMPTY || tag == TAG_TOMBSTONE) {
+                continue;
+            }
+            hkey_t *k = atomic_load_explicit(&b->key[s], memory_order_relaxed);
+            void *v = atomic_load_explicit(&b->value[s], memory_order_relaxed);
+            probe_t p = table_probe(t, k->hash, k->str, k->len);
+            slot_fill(p.free_bucket, p.free_slot, k, v);
+        }
+    }
+
+    // Readers still on the old table either finish before the swap or fail
+    // validation and retry on the new one.
+    seqlock_write_lock(&sg->version);
+    atomic_store_explicit(&sg->table, t, memory_order_release);
+    seqlock_write_unlock(&sg->version);
+    sg->used = live;
+
+    // If the free can't be deferred, the old table is leaked rather than
+    // freed under a reader.
+    ebr_thread_t *self = ebr_self(m->ebr);
+    if (self != NULL) {
+        ebr_retire(self, old, table_free);
+    }
+    return true;
+}
+
+hashmap_t *hashmap_new(size_t capacity) {
+    size_t per_seg = capacity / HASHMAP_SEGMENTS + 1;
+    size_t nbuckets = MIN_BUCKETS;
+    // Keep each segment under three quarters full at the requested size.
+    while (nbuckets * BUCKET_SLOTS * 3 / 4 < per_seg) {
+        nbuckets *= 2;
+    }
+
+    size_t bytes = (sizeof(hashmap_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    hashmap_t *m = aligned_alloc(CACHE_LINE, bytes);
+    if (m == NULL) {
+        return NULL;
+    }
+    memset(m, 0, sizeof(*m));
+    m->ebr = ebr_new(0);
+    if (m->ebr == NULL) {
+        free(m);
+        return NULL;
+    }
+    for (int i = 0; i < HASHMAP_SEGMENTS; i++) {
+        segment_t *sg = &m->seg[i];
+        seqlock_init(&sg->version);
+        pthread_mutex_init(&sg->lock, NULL);
+        atomic_init(&sg->live, 0);
+        sg->used = 0;
+        table_t *t = table_new(nbuckets);
+        atomic_init(&sg->table, t);
+        if (t == NULL) {
+            for (int j = 0; j <= i; j++) {
+                pthread_mutex_destroy(&m->seg[j].lock);
+                if (j < i) {
+                    table_free(atomic_load(&m->seg[j].table));
+                }
+            }
+            ebr_delete(&m->ebr);
+            free(m);
+            return NULL;
+        }
+    }
+    return m;
+}
+
+void hashmap_delete(hashmap_t **m) {
+    if (m == NULL || *m == NULL) {
+        return;
+    }
+    hashmap_t *map = *m;
+    for (int i = 0; i < HASHMAP_SEGMENTS; i++) {
+        segment_t *sg = &map->seg[i];
+        table_t *t = atomic_load(&sg->table);
+        for (size_t b = 0; b < t->nbuckets; b++) {
+            for (int s = 0; s < BUCKET_SLOTS; s++) {
+                uint32_t tag = atomic_load(&t->buckets[b].tag[s]);
+                if (tag != TAG_EMPTY && tag != TAG_TOMBSTONE) {
+                    free(atomic_load(&t->buckets[b].key[s]));
+                }
+            }
+        }
+        table_free(t);
+        pthread_mutex_destroy(&sg->lock);
+    }
+    ebr_delete(&map->ebr);
+    free(map);
+    *m = NULL;
+}
+
+bool hashmap_get(hashmap_t *m, const char *key, void **value) {
+    if (m == NULL || key == NULL) {
+        return false;
+    }
+    ebr_thread_t *self = ebr_self(m->ebr);
+    if (self == NULL) {
+        return false;
+    }
+    size_t len = strlen(key);
+    uint64_t hash = hash_key(key, len);
+    segment_t *sg = &m->seg[hash & (HASHMAP_SEGMENTS - 1)];
+
+    void *v = NULL;
+    bool found;
+    ebr_enter(self);
+    uint32_t token;
+    do {
+        token = seqlock_read_begin(&sg->version);
+        table_t *t = atomic_load_explicit(&sg->table, memory_order_acquire);
+        found = table_lookup(t, hash, key, len, &v);
+    } while (seqlock_read_retry(&sg->version, token));
+    ebr_exit(self);
+
+    if (found && value != NULL) {
+        *value = v;
+    }
+    return found;
+}
+
+// Shared body of hashmap_put and hashmap_insert.
+static bool upsert(hashmap_t *m, const char *key, void *value, bool replace, void **prev) {
+    if (prev != NULL) {
+        *prev = NULL;
+    }
+    if (m == NULL || key == NULL) {
+        return false;
+    }
+    size_t len = strlen(key);
+    uint64_t hash = hash_key(key, len);
+    segment_t *sg = &m->seg[hash & (HASHMAP_SEGMENTS - 1)];
+
+    pthread_mutex_lock(&sg->lock);
+    table_t *t = atomic_load_explicit(&sg->table, memory_order_relaxed);
+    probe_t p = table_probe(t, hash, key, len);
+    if (p.bucket != NULL) {
+        void *old = atomic_load_explicit(&p.bucket->value[p.slot], memory_order_relaxed);
+        if (replace) {
+            // A single pointer store; readers see the old or the new value.
+            atomic_store_explicit(&p.bucket->value[p.slot], value, memory_order_release);
+        }
+        pthread_mutex_unlock(&sg->lock);
+        if (prev != NULL) {
+            *prev = old;
+        }
+        return replace;
+    }
+
+    hkey_t *k = malloc(sizeof(hkey_t) + len + 1);
+    if (k == NULL) {
+        pthread_mutex_unlock(&sg->lock);
+        return false;
+    }
+    k->hash = hash;
+    k->len = len;
+    memcpy(k->str, key, len + 1);
+
+    bool fresh = atomic_load_explicit(&p.free_bucket->tag[p.free_slot], memory_order_relaxed)
+                 == TAG_EMPTY;
+    if (fresh && (sg->used + 1) * 4 > t->nbuckets * BUCKET_SLOTS * 3) {
+        if (!segment_resize(m, sg)) {
+            pthread_mutex_unlock(&sg->lock);
+            free(k);
+            return false;
+        }
+        t = atomic_load_explicit(&sg->table, memory_order_relaxed);
+        p = table_probe(t, hash, key, len);
+        fresh = true;
+    }
+    slot_fill(p.free_bucket, p.free_slot, k, value);
+    if (fresh) {
+        sg->used++;
+    }
+    atomic_fetch_add_explicit(&sg->live, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&sg->lock);
+    return true;
+}
+
+bool hashmap_put(hashmap_t *m, const char *key, void *value, void **old) {
+    return upsert(m, key, value, true, old);
+}
+
+bool hashmap_insert(hashmap_t *m, const char *key, void *value, void **existing) {
+    return upsert(m, key, value, false, existing);
+}
+
+bool hashmap_remove(hashmap_t *m, const char *key, void **value) {
+    if (m == NULL || key == NULL) {
+        return false;
+    }
+    size_t len = strlen(key);
+    uint64_t hash = hash_key(key, len);
+    segment_t *sg = &m->seg[hash & (HASHMAP_SEGMENTS - 1)];
+
+    pthread_mutex_lock(&sg->lock);
+    table_t *t = atomic_load_explicit(&sg->table, memory_order_relaxed);
+    probe_t p = table_probe(t, hash, key, len);
+    if (p.bucket == NULL) {
+        pthread_mutex_unlock(&sg->lock);
+        return false;
+    }
+    hkey_t *k = atomic_load_explicit(&p.bucket->key[p.slot], memory_order_relaxed);
+    void *v = atomic_load_explicit(&p.bucket->value[p.slot], memory_order_relaxed);
+
+    // The slot may be reused for another key, so a reader that matched the
+    // old tag must not trust what it reads next.
+    seqlock_write_lock(&sg->version);
+    atomic_store_explicit(&p.bucket->tag[p.slot], TAG_TOMBSTONE, memory_order_relaxed);
+    atomic_store_explicit(&p.bucket->key[p.slot], NULL, memory_order_relaxed);
+    atomic_store_explicit(&p.bucket->value[p.slot], NULL, memory_order_relaxed);
+    seqlock_write_unlock(&sg->version);
+    atomic_fetch_sub_explicit(&sg->live, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&sg->lock);
+
+    // As in segment_resize, a key that can't be retired is leaked.
+    ebr_thread_t *self = ebr_self(m->ebr);
+    if (self != NULL) {
+        ebr_retire(self, k, free);
+    }
+    if (value != NULL) {
+        *value = v;
+    }
+    return true;
+}
+
+size_t hashmap_size(hashmap_t *m) {
+    if (m == NULL) {
+        return 0;
+    }
+    size_t n = 0;
+    for (int i = 0; i < HASHMAP_SEGMENTS; i++) {
+        n += atomic_load_explicit(&m->seg[i].live, memory_order_relaxed);
+    }
+    return n;
+}
+
+ebr_t *hashmap_ebr(hashmap_t *m) {
+    return m == NULL ? NULL : m->ebr;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+/**
+ *  A concurrent hash map from strings to void pointers.
+ *
+ *  Keys hash to one of a fixed number of segments, each an open-addressing
+ *  table of cache-line-sized buckets with its own write lock. Lookups take
+ *  no lock: they read the table directly and validate against the segment's
+ *  version, which writers bump only when they remove an entry or swap the
+ *  table. A segment that fills up is resized on its own, so growth never
+ *  blocks readers or writers of other segments.
+ *
+ *  Removed keys and replaced tables are freed through an epoch-based
+ *  reclamation domain (ebr.h). Values are owned by the caller; if a removed
+ *  value may still be in use by a concurrent hashmap_get, retire it through
+ *  hashmap_ebr instead of freeing it directly.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ebr.h"
+
+typedef struct hashmap hashmap_t;
+
+/** @brief Creates an empty map.
+ *
+ *  @param capacity The number of entries to size the map for up front; the
+ *         map grows as needed beyond it.
+ *
+ *  @return A pointer to the map, or NULL on failure.
+ */
+hashmap_t *hashmap_new(size_t capacity);
+
+/** @brief Frees the map and its keys, but not the values. Sets *m to NULL.
+ *         No other thread may be using the map.
+ */
+void hashmap_delete(hashmap_t **m);
+
+/** @brief Looks up key without taking any lock.
+ *
+ *  @param value Receives the value if key is present; may be NULL.
+ *
+ *  @return true if key is present.
+ */
+bool hashmap_get(hashmap_t *m, const char *key, void **value);
+
+/** @brief Sets key to value, inserting it if needed.
+ *
+ *  @param old Receives the previous value, or NULL if key was absent; may be
+ *         NULL.
+ *
+ *  @return true on success, false if m or key is NULL or allocation fails.
+ */
+bool hashmap_put(hashmap_t *m, const char *key, void *value, void **old);
+
+/** @brief Inserts key with value only if key is absent.
+ *
+ *  @param existing Receives the value already present when key exists; may
+ *         be NULL.
+ *
+ *  @return true if the entry was inserted, false if key already existed (or
+ *          on allocation failure, with *existing set to NULL).
+ */
+bool hashmap_insert(hashmap_t *m, const char *key, void *value, void **existing);
+
+/** @brief Removes key.
+ *
+ *  @param value Receives the removed value; may be NULL.
+ *
+ *  @return true if key was present.
+ */
+bool hashmap_remove(hashmap_t *m, const char *key, void **value);
+
+/** @brief Returns the number of entries. Concurrent updates may or may not
+ *         be counted.
+ */
+size_t hashmap_size(hashmap_t *m);
+
+/** @brief Returns the reclamation domain the map frees its memory through,
+ *         for deferring the free of removed values.
+ */
+ebr_t *hashmap_ebr(hashmap_t *m);
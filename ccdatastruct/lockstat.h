@@ -0,0 +1,73 @@
+#pragma once
+
+/**
+ *  Latency histograms shared by the rwlock_t and queue_t statistics APIs.
+ *
+ *  Bucket i counts samples in [2^i, 2^(i+1)) nanoseconds; bucket 0 also
+ *  holds samples under 1 ns and the last bucket everything above.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LOCKSTAT_BUCKETS 40
+
+typedef struct {
+    uint64_t count[LOCKSTAT_BUCKETS];
+} lockstat_hist_t;
+
+/** @brief Returns an upper bound, in nanoseconds, on the p-th percentile
+ *         (0 < p <= 100) of the samples in h, or 0 if h is empty.
+ */
+static inline uint64_t lockstat_percentile(const lockstat_hist_t *h, double p) {
+    uint64_t total = 0;
+    for (int i = 0; i < LOCKSTAT_BUCKETS; i++) {
+        total += h->count[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) ((double) total * p / 100.0 + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LOCKSTAT_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= rank) {
+            return (uint64_t) 2 << i;
+        }
+    }
+    return (uint64_t) 2 << (LOCKSTAT_BUCKETS - 1);
+}
+
+/** @brief Returns the histogram bucket a sample of ns nanoseconds falls in.
+ */
+static inline int lockstat_bucket(uint64_t ns) {
+    int i = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    return i < LOCKSTAT_BUCKETS ? i : LOCKSTAT_BUCKETS - 1;
+}
+
+// Helpers for the implementations. Counters are only touched while stats are
+// enabled, and always with relaxed atomics.
+
+static inline uint64_t lockstat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static inline void lockstat_record(_Atomic uint64_t *buckets, uint64_t ns) {
+    atomic_fetch_add_explicit(&buckets[lockstat_bucket(ns)], 1, memory_order_relaxed);
+}
+
+static inline void lockstat_bump(_Atomic uint64_t *counter) {
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static inline void lockstat_copy(lockstat_hist_t *out, _Atomic uint64_t *buckets) {
+    for (int i = 0; i < LOCKSTAT_BUCKETS; i++) {
+        out->count[i] = atomic_load_explicit(&buckets[i], memory_order_relaxed);
+    }
+}
@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "futex.h"
+#include "pool.h"
+
+// Objects per magazine, and per slab carved from malloc.
+#define MAG_SIZE 64
+
+// Upper bound on the NUMA nodes given their own depot; larger machines share.
+#define POOL_MAX_NODES 64
+
+// Depot stacks hold a pointer in the low 48 bits and an ABA tag above it.
+#define PTR_BITS 48
+#define PTR_MASK ((UINT64_C(1) << PTR_BITS) - 1)
+
+typedef struct mag {
+    _Atomic(struct mag *) next; // depot link; read racily by losing poppers
+    int n;
+    void *obj[MAG_SIZE];
+} mag_t;
+
+typedef struct slab {
+    struct slab *next;
+    alignas(max_align_t) unsigned char mem[];
+} slab_t;
+
+// Full and empty magazines for one NUMA node.
+typedef struct {
+    alignas(CACHE_LINE) _Atomic uint64_t full;
+    _Atomic uint64_t empty;
+} depot_t;
+
+typedef struct cache {
+    mag_t *loaded; // allocate from / free into this one first
+    mag_t *prev;
+    pool_t *pool;
+    _Atomic bool in_use;
+    struct cache *next; // registry link, fixed once published
+} cache_t;
+
+struct pool {
+    size_t size;
+    int ndepots;
+    depot_t *depots;
+    pthread_key_t key;
+    _Atomic(slab_t *) slabs;
+    _Atomic(cache_t *) caches; // every cache ever created; reused, never unlinked
+};
+
+static mag_t *mag_ptr(uint64_t word) {
+    return (mag_t *) (uintptr_t) (word & PTR_MASK);
+}
+
+static void stack_push(_Atomic uint64_t *top, mag_t *m) {
+    uint64_t old = atomic_load_explicit(top, memory_order_relaxed);
+    uint64_t tagged;
+    do {
+        atomic_store_explicit(&m->next, mag_ptr(old), memory_order_relaxed);
+        tagged = ((old >> PTR_BITS) + 1) << PTR_BITS | (uint64_t) (uintptr_t) m;
+    } while (!atomic_compare_exchange_weak_explicit(top, &old, tagged, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+// Magazines are only freed by pool_delete, so reading next from one that
+// another thread just popped is safe; the tag makes the CAS fail if it was
+// pushed back in the meantime.
+static mag_t *stack_pop(_Atomic uint64_t *top) {
+    uint64_t old = atomic_load_explicit(top, memory_order_acquire);
+    while (1) {
+        mag_t *m = mag_ptr(old);
+        if (m == NULL) {
+            return NULL;
+        }
+        mag_t *next = atomic_load_explicit(&m->next, memory_order_relaxed);
+        uint64_t tagged = (old & ~PTR_MASK) | (uint64_t) (uintptr_t) next;
+        if (atomic_compare_exchange_weak_explicit(top, &old, tagged, memory_order_acquire,
+                                                  memory_order_acquire)) {
+            return m;
+        }
+    }
+}
+
+static void stack_free(_Atomic uint64_t *top) {
+    mag_t *m = mag_ptr(atomic_load(top));
+    while (m != NULL) {
+        mag_t *next = atomic_load(&m->next);
+        free(m);
+        m = next;
+    }
+}
+
+static mag_t *mag_new(void) {
+    mag_t *m = malloc(sizeof(mag_t));
+    if (m == NULL) {
+        return NULL;
+    }
+    if ((uint64_t) (uintptr_t) m & ~PTR_MASK) {
+        // Can't be tagged; only possible with 57-bit address spaces.
+        free(m);
+        errno = ENOMEM;
+        return NULL;
+    }
+    atomic_init(&m->next, NULL);
+    m->n = 0;
+    return m;
+}
+
+// The depot for the NUMA node the calling thread is running on.
+static depot_t *local_depot(pool_t *p) {
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (p->ndepots == 1 || getcpu(&cpu, &node) != 0) {
+        return &p->depots[0];
+    }
+    return &p->depots[node % (unsigned) p->ndepots];
+}
+
+// Takes a full magazine, preferring the local node's depot.
+static mag_t *depot_take_full(pool_t *p) {
+    depot_t *local = local_depot(p);
+    mag_t *m = stack_pop(&local->full);
+    for (int i = 0; m == NULL && i < p->ndepots; i++) {
+        if (&p->depots[i] != local) {
+            m = stack_pop(&p->depots[i].full);
+        }
+    }
+    return m;
+}
+
+// Fills the empty magazine m from a freshly allocated slab. The slab is first
+// touched by the calling thread, so the kernel backs it with memory local to
+// the node this thread runs on.
+static bool slab_fill(pool_t *p, mag_t *m) {
+    slab_t *s = malloc(sizeof(slab_t) + p->size * MAG_SIZE);
+    if (s == NULL) {
+        return false;
+    }
+    memset(s->mem, 0, p->size * MAG_SIZE);
+    slab_t *head = atomic_load_explicit(&p->slabs, memory_order_relaxed);
+    do {
+        s->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&p->slabs, &head, s, memory_order_release,
+                                                    memory_order_relaxed));
+    // Hand objects out in address order.
+    for (int i = 0; i < MAG_SIZE; i++) {
+        m->obj[i] = s->mem + p->size * (size_t) (MAG_SIZE - 1 - i);
+    }
+    m->n = MAG_SIZE;
+    return true;
+}
+
+// Returns the cache's magazines to the local depot when its thread exits.
+static void cache_release(void *arg) {
+    cache_t *c = arg;
+    depot_t *d = local_depot(c->pool);
+    mag_t *mags[2] = { c->loaded, c->prev };
+    for (int i = 0; i < 2; i++) {
+        if (mags[i] != NULL) {
+            stack_push(mags[i]->n > 0 ? &d->full : &d->empty, mags[i]);
+        }
+    }
+    c->loaded = NULL;
+    c->prev = NULL;
+    atomic_store_explicit(&c->in_use, false, memory_order_release);
+}
+
+static cache_t *cache_new(pool_t *p) {
+    cache_t *c = NULL;
+    for (cache_t *it = atomic_load_explicit(&p->caches, memory_order_acquire); it != NULL;
+         it = it->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&it->in_use, memory_order_relaxed)
+            && atomic_compare_exchange_strong(&it->in_use, &expected, true)) {
+            c = it;
+            break;
+        }
+    }
+    bool fresh = c == NULL;
+    if (fresh) {
+        c = malloc(sizeof(cache_t));
+        if (c == NULL) {
+            return NULL;
+        }
+        c->pool = p;
+        atomic_init(&c->in_use, true);
+    }
+    c->loaded = mag_new();
+    c->prev = mag_new();
+    if (c->loaded == NULL || c->prev == NULL || pthread_setspecific(p->key, c) != 0) {
+        free(c->loaded);
+        free(c->prev);
+        c->loaded = NULL;
+        c->prev = NULL;
+        if (fresh) {
+            free(c);
+        } else {
+            atomic_store(&c->in_use, false);
+        }
+        return NULL;
+    }
+    if (fresh) {
+        cache_t *head = atomic_load_explicit(&p->caches, memory_order_relaxed);
+        do {
+            c->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&p->caches, &head, c, memory_order_release,
+                                                        memory_order_relaxed));
+    }
+    return c;
+}
+
+static cache_t *cache_of(pool_t *p) {
+    cache_t *c = pthread_getspecific(p->key);
+    return c != NULL ? c : cache_new(p);
+}
+
+// Counts the NUMA nodes the kernel could bring online, or 1 if unknown.
+static int numa_nodes(void) {
+    FILE *f = fopen("/sys/devices/system/node/possible", "r");
+    if (f == NULL) {
+        return 1;
+    }
+    int lo = 0;
+    int hi = 0;
+    int n = fscanf(f, "%d-%d", &lo, &hi);
+    fclose(f);
+    int nodes = n == 2 ? hi + 1 : 1;
+    return nodes < 1 ? 1 : nodes > POOL_MAX_NODES ? POOL_MAX_NODES : nodes;
+}
+
+pool_t *pool_new(size_t size) {
+    if (size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    pool_t *p = malloc(sizeof(pool_t));
+    if (p == NULL) {
+        return NULL;
+    }
+    // Round up so every object in a slab stays aligned.
+    size_t align = alignof(max_align_t);
+    p->size = (size + align - 1) / align * align;
+    p->ndepots = numa_nodes();
+    p->depots = aligned_alloc(CACHE_LINE, sizeof(depot_t) * (size_t) p->ndepots);
+    if (p->depots == NULL || pthread_key_create(&p->key, cache_release) != 0) {
+        free(p->depots);
+        free(p);
+        return NULL;
+    }
+    for (int i = 0; i < p->ndepots; i++) {
+        atomic_init(&p->depots[i].full, 0);
+        atomic_init(&p->depots[i].empty, 0);
+    }
+    atomic_init(&p->slabs, NULL);
+    atomic_init(&p->caches, NULL);
+    return p;
+}
+
+void pool_delete(pool_t **p) {
+    if (p == NULL || *p == NULL) {
+        return;
+    }
+    pool_t *pool = *p;
+    pthread_key_delete(pool->key);
+
+    cache_t *c = atomic_load(&pool->caches);
+    while (c != NULL) {
+        cache_t *next = c->next;
+        free(c->loaded);
+        free(c->prev);
+        free(c);
+        c = next;
+    }
+    for (int i = 0; i < pool->ndepots; i++) {
+        stack_free(&pool->depots[i].full);
+        stack_free(&pool->depots[i].empty);
+    }
+    slab_t *s = atomic_load(&pool->slabs);
+    while (s != NULL) {
+        slab_t *next = s->next;
+        free(s);
+        s = next;
+    }
+    free(pool->depots);
+    free(pool);
+    *p = NULL;
+}
+
+void *pool_get(pool_t *p) {
+    if (p == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    cache_t *c = cache_of(p);
+    if (c == NULL) {
+        return NULL;
+    }
+    mag_t *m = c->loaded;
+    if (m->n == 0) {
+        if (c->prev->n > 0) {
+            c->loaded = c->prev;
+            c->prev = m;
+        } else {
+            // Both empty: trade one for a full magazine, or carve a slab.
+            mag_t *full = depot_take_full(p);
+            if (full != NULL) {
+                stack_push(&local_depot(p)->empty, c->prev);
+                c->prev = m;
+                c->loaded = full;
+            } else if (!slab_fill(p, m)) {
+                return NULL;
+            }
+        }
+        m = c->loaded;
+    }
+    return m->obj[--m->n];
+}
+
+void pool_put(pool_t *p, void *obj) {
+    if (p == NULL || obj == NULL) {
+        return;
+    }
+    cache_t *c = cache_of(p);
+    if (c == NULL) {
+        // The object stays with its slab and is freed by pool_delete.
+        return;
+    }
+    mag_t *m = c->loaded;
+    if (m->n == MAG_SIZE) {
+        if (c->prev->n < MAG_SIZE) {
+            c->loaded = c->prev;
+            c->prev = m;
+        } else {
+            // Both full: hand one to the depot in exchange for an empty one.
+            depot_t *d = local_depot(p);
+            mag_t *empty = stack_pop(&d->empty);
+            if (empty == NULL && (empty = mag_new()) == NULL) {
+                return;
+            }
+            stack_push(&d->full, c->prev);
+            c->prev = m;
+            c->loaded = empty;
+        }
+        m = c->loaded;
+    }
+    m->obj[m->n++] = obj;
+}
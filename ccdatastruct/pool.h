@@ -0,0 +1,41 @@
+#pragma once
+
+/**
+ *  A slab allocator for fixed-size objects.
+ *
+ *  Each thread keeps two magazines (small stacks of free objects) per pool,
+ *  so pool_get and pool_put normally just pop or push a pointer without any
+ *  atomic operation. When both magazines run dry or fill up, the thread
+ *  trades a whole magazine with a lock-free depot belonging to its NUMA
+ *  node, and only carves a new slab from malloc when every depot is empty.
+ *
+ *  Objects are never returned to malloc until pool_delete. An object may be
+ *  freed by a different thread than the one that allocated it.
+ */
+
+#include <stddef.h>
+
+typedef struct pool pool_t;
+
+/** @brief Creates a pool of objects of `size` bytes, aligned for any type.
+ *
+ *  @return A pointer to the pool, or NULL if size is 0 or allocation fails.
+ */
+pool_t *pool_new(size_t size);
+
+/** @brief Frees the pool and every object allocated from it, whether or not
+ *         it was returned. Sets *p to NULL. No other thread may be using
+ *         the pool.
+ */
+void pool_delete(pool_t **p);
+
+/** @brief Allocates an object. Its contents are unspecified.
+ *
+ *  @return The object, or NULL with errno set if memory is exhausted.
+ */
+void *pool_get(pool_t *p);
+
+/** @brief Returns obj, which must have come from pool_get on the same pool,
+ *         to the pool. Does nothing if obj is NULL.
+ */
+void pool_put(pool_t *p, void *obj);
@@ -1,19 +1,70 @@
-
-#include <pthread.h>
-#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "futex.h"
+#include "lockstat.h"
+#include "queue.h"
+#include "usdt.h"
+
+// Number of times a blocked push/pop retries before it parks on the futex.
+#define QUEUE_SPIN 64
+
+// queue_close sets this bit in the tail index, so no producer can claim a
+// position once the queue is closed and the final tail is frozen.
+#define TAIL_CLOSED ((size_t) 1 << (sizeof(size_t) * CHAR_BIT - 1))
+
+// ring_push's result when the queue has been closed.
+#define RING_CLOSED SIZE_MAX
 
-typedef struct queue queue_t;
+// Bounded MPMC ring with a sequence number per slot (Vyukov). A slot at ring
+// index i is free for the producer claiming position pos when seq == pos,
+// and holds an element for the consumer claiming pos when seq == pos + 1.
+typedef struct {
+    _Atomic size_t seq;
+    void *elem;
+} slot_t;
+
+typedef struct {
+    _Atomic uint64_t pushes;
+    _Atomic uint64_t pops;
+    _Atomic uint64_t full_stalls;
+    _Atomic uint64_t empty_stalls;
+    _Atomic uint64_t max_occupancy;
+    _Atomic uint64_t full_wait_ns[LOCKSTAT_BUCKETS];
+    _Atomic uint64_t empty_wait_ns[LOCKSTAT_BUCKETS];
+} q_stats_t;
 
 struct queue {
-    void **buffer;
-    int size;
-    int head;
-    int tail;
-    int count;
-    pthread_mutex_t mutex;
-    pthread_cond_t not_full;
-    pthread_cond_t not_empty;
+    slot_t *slots;
+    size_t size; // slots
+    size_t cap;  // elements; below size only for a capacity of 1
+
+    // Statistics; allocated on first queue_stats_enable and only updated
+    // while stats_on is set.
+    _Atomic(q_stats_t *) stats;
+    _Atomic bool stats_on;
+
+    // Optional eventfd for event loops, created by queue_eventfd. Producers
+    // only write to it while armed, i.e. after a drain found the queue empty.
+    _Atomic int efd;
+    _Atomic bool efd_armed;
+
+    // Producers and consumers each own a cache line so they never false-share.
+    alignas(CACHE_LINE) _Atomic size_t tail;
+    alignas(CACHE_LINE) _Atomic size_t head;
+
+    alignas(CACHE_LINE) eventcount_t not_full;
+    eventcount_t not_empty;
 };
 
 queue_t *queue_new(int size) {
@@ -21,24 +72,37 @@ queue_t *queue_new(int size) {
         return NULL;
     }
 
-    queue_t *q = malloc(sizeof(queue_t));
+    size_t bytes = (sizeof(queue_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    queue_t *q = aligned_alloc(CACHE_LINE, bytes);
     if (q == NULL) {
         return NULL;
     }
 
-    q->buffer = malloc(sizeof(void *) * size);
-    if (q->buffer == NULL) {
+    // With a single slot, "free for position pos + 1" and "full at pos" are
+    // both seq == pos + 1, so a capacity of 1 gets two slots and ring_push
+    // bounds the occupancy itself.
+    q->cap = (size_t) size;
+    q->size = size < 2 ? 2 : (size_t) size;
+    q->slots = malloc(sizeof(slot_t) * q->size);
+    if (q->slots == NULL) {
         free(q);
         return NULL;
     }
 
-    q->size = size;
-    q->head = 0;
-    q->tail = 0;
-    q->count = 0;
-    pthread_mutex_init(&q->mutex, NULL);
-    pthread_cond_init(&q->not_full, NULL);
-    pthread_cond_init(&q->not_empty, NULL);
+    for (size_t i = 0; i < q->size; i++) {
+        atomic_init(&q->slots[i].seq, i);
+        q->slots[i].elem = NULL;
+    }
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->not_full.seq, 0);
+    atomic_init(&q->not_full.waiters, 0);
+    atomic_init(&q->not_empty.seq, 0);
+    atomic_init(&q->not_empty.waiters, 0);
+    atomic_init(&q->stats, NULL);
+    atomic_init(&q->stats_on, false);
+    atomic_init(&q->efd, -1);
+    atomic_init(&q->efd_armed, false);
     return q;
 }
 
@@ -46,49 +110,474 @@ void queue_delete(queue_t **q) {
     if (q == NULL || *q == NULL) {
         return;
     }
-    pthread_mutex_destroy(&(*q)->mutex);
-    pthread_cond_destroy(&(*q)->not_full);
-    pthread_cond_destroy(&(*q)->not_empty);
-    free((*q)->buffer);
+    int fd = atomic_load(&(*q)->efd);
+    if (fd >= 0) {
+        close(fd);
+    }
+    free((*q)->slots);
+    free(atomic_load(&(*q)->stats));
     free(*q);
     *q = NULL;
 }
 
+// Claims up to n consecutive tail positions with a single CAS and publishes
+// elems into them. Returns the number claimed, 0 when the ring is full, or
+// RING_CLOSED once the queue is closed.
+static size_t ring_push(queue_t *q, void *const *elems, size_t n) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while (1) {
+        if (pos & TAIL_CLOSED) {
+            return RING_CLOSED;
+        }
+        size_t room = n;
+        if (q->cap < q->size) {
+            size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+            if (head > pos) {
+                pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+                continue; // pos is stale
+            }
+            if (pos - head >= q->cap) {
+                return 0;
+            }
+            if (room > q->cap - (pos - head)) {
+                room = q->cap - (pos - head);
+            }
+        }
+        size_t k = 0;
+        intptr_t diff = 0;
+        while (k < room) {
+            size_t seq = atomic_load_explicit(&q->slots[(pos + k) % q->size].seq,
+                                              memory_order_acquire);
+            diff = (intptr_t) seq - (intptr_t) (pos + k);
+            if (diff != 0) {
+                break;
+            }
+            k++;
+        }
+        if (k > 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->tail, &pos, pos + k, memory_order_relaxed, memory_order_relaxed)) {
+                for (size_t i = 0; i < k; i++) {
+                    slot_t *s = &q->slots[(pos + i) % q->size];
+                    s->elem = elems[i];
+                    atomic_store_explicit(&s->seq, pos + i + 1, memory_order_release);
+                }
+                return k;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+}
+
+// Claims up to n consecutive head positions with a single CAS and takes their
+// elements. Returns the number claimed, 0 when the ring is empty.
+static size_t ring_pop(queue_t *q, void **elems, size_t n) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    while (1) {
+        size_t k = 0;
+        intptr_t diff = 0;
+        while (k < n) {
+            size_t seq = atomic_load_explicit(&q->slots[(pos + k) % q->size].seq,
+                                              memory_order_acquire);
+            diff = (intptr_t) seq - (intptr_t) (pos + k + 1);
+            if (diff != 0) {
+                break;
+            }
+            k++;
+        }
+        if (k > 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->head, &pos, pos + k, memory_order_relaxed, memory_order_relaxed)) {
+                for (size_t i = 0; i < k; i++) {
+                    slot_t *s = &q->slots[(pos + i) % q->size];
+                    elems[i] = s->elem;
+                    atomic_store_explicit(&s->seq, pos + i + q->size, memory_order_release);
+                }
+                return k;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+static q_stats_t *stats_of(queue_t *q) {
+    if (!atomic_load_explicit(&q->stats_on, memory_order_acquire)) {
+        return NULL;
+    }
+    return atomic_load_explicit(&q->stats, memory_order_relaxed);
+}
+
+static size_t occupancy(queue_t *q) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed) & ~TAIL_CLOSED;
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+// Records the outcome of one push or pop. stall_start is when the caller
+// first found the ring full or empty, or 0 if it never did.
+static void stats_update(queue_t *q, q_stats_t *st, bool push, size_t moved,
+                         uint64_t stall_start) {
+    if (push) {
+        atomic_fetch_add_explicit(&st->pushes, moved, memory_order_relaxed);
+        uint64_t occ = occupancy(q);
+        uint64_t max = atomic_load_explicit(&st->max_occupancy, memory_order_relaxed);
+        while (occ > max
+               && !atomic_compare_exchange_weak_explicit(&st->max_occupancy, &max, occ,
+                                                         memory_order_relaxed,
+                                                         memory_order_relaxed)) {
+        }
+    } else {
+        atomic_fetch_add_explicit(&st->pops, moved, memory_order_relaxed);
+    }
+    if (stall_start != 0) {
+        lockstat_bump(push ? &st->full_stalls : &st->empty_stalls);
+        lockstat_record(push ? st->full_wait_ns : st->empty_wait_ns,
+                        lockstat_now() - stall_start);
+    }
+}
+
+// Wakes an event loop waiting on the queue's eventfd, if it asked to be woken.
+static void efd_signal(queue_t *q) {
+    int fd = atomic_load_explicit(&q->efd, memory_order_acquire);
+    if (fd < 0) {
+        return;
+    }
+    // Pairs with the fence in queue_eventfd_drain: either the drain sees this
+    // push after arming, or this sees the flag.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->efd_armed, memory_order_relaxed)
+        && atomic_exchange(&q->efd_armed, false)) {
+        eventfd_write(fd, 1);
+    }
+}
+
+// True once the queue is closed and every claimed position has been popped.
+static bool ring_finished(queue_t *q) {
+    size_t tail = atomic_load(&q->tail);
+    return (tail & TAIL_CLOSED) && (tail & ~TAIL_CLOSED) == atomic_load(&q->head);
+}
+
+// Pushes between 1 and n elements and wakes one consumer per element pushed.
+// While the ring is full it fails at once (!block), or spins and then sleeps
+// until deadline (NULL waits forever). Returns 0 with errno set on failure.
+static size_t push_wait(queue_t *q, void *const *elems, size_t n, bool block,
+                        const struct timespec *deadline) {
+    q_stats_t *st = stats_of(q);
+    uint64_t stall_start = 0;
+    size_t k;
+    for (int spin = 0; (k = ring_push(q, elems, n)) == 0; spin++) {
+        if (spin == 0) {
+            USDT_PROBE1(queue, push_stall, q);
+        }
+        if (st != NULL && stall_start == 0) {
+            stall_start = lockstat_now();
+        }
+        if (!block) {
+            errno = EAGAIN;
+            break;
+        }
+        if (spin < QUEUE_SPIN) {
+            cpu_relax();
+            continue;
+        }
+        uint32_t key = ec_prepare(&q->not_full);
+        if ((k = ring_push(q, elems, n)) > 0) {
+            ec_cancel(&q->not_full);
+            break;
+        }
+        if (ec_wait(&q->not_full, key, deadline) < 0) {
+            errno = ETIMEDOUT;
+            break;
+        }
+    }
+    if (k == RING_CLOSED) {
+        errno = EPIPE;
+        return 0;
+    }
+    if (k > 0) {
+        USDT_PROBE2(queue, push, q, k);
+        if (st != NULL) {
+            stats_update(q, st, true, k, stall_start);
+        }
+        ec_notify(&q->not_empty, (int) k);
+        efd_signal(q);
+    }
+    return k;
+}
+
+// Pops between 1 and n elements and wakes one producer per slot freed. Waits
+// like push_wait while the ring is empty, and fails with EPIPE once the queue
+// is closed and drained.
+static size_t pop_wait(queue_t *q, void **elems, size_t n, bool block,
+                       const struct timespec *deadline) {
+    q_stats_t *st = stats_of(q);
+    uint64_t stall_start = 0;
+    size_t k;
+    for (int spin = 0; (k = ring_pop(q, elems, n)) == 0; spin++) {
+        if (ring_finished(q)) {
+            errno = EPIPE;
+            return 0;
+        }
+        if (spin == 0) {
+            USDT_PROBE1(queue, pop_stall, q);
+        }
+        if (st != NULL && stall_start == 0) {
+            stall_start = lockstat_now();
+        }
+        if (!block) {
+            errno = EAGAIN;
+            break;
+        }
+        if (spin < QUEUE_SPIN) {
+            cpu_relax();
+            continue;
+        }
+        uint32_t key = ec_prepare(&q->not_empty);
+        if ((k = ring_pop(q, elems, n)) > 0) {
+            ec_cancel(&q->not_empty);
+            break;
+        }
+        if (ring_finished(q)) {
+            ec_cancel(&q->not_empty);
+            errno = EPIPE;
+            return 0;
+        }
+        if (ec_wait(&q->not_empty, key, deadline) < 0) {
+            errno = ETIMEDOUT;
+            break;
+        }
+    }
+    if (k > 0) {
+        USDT_PROBE2(queue, pop, q, k);
+        if (st != NULL) {
+            stats_update(q, st, false, k, stall_start);
+        }
+        ec_notify(&q->not_full, (int) k);
+    }
+    return k;
+}
+
 bool queue_push(queue_t *q, void *elem) {
     if (q == NULL) {
         return false;
     }
+    return push_wait(q, &elem, 1, true, NULL) > 0;
+}
 
-    pthread_mutex_lock(&q->mutex);
+bool queue_pop(queue_t *q, void **elem) {
+    if (q == NULL) {
+        return false;
+    }
+    return pop_wait(q, elem, 1, true, NULL) > 0;
+}
 
-    while (q->count == q->size) {
-        pthread_cond_wait(&q->not_full, &q->mutex);
+bool queue_try_push(queue_t *q, void *elem) {
+    if (q == NULL) {
+        return false;
     }
+    return push_wait(q, &elem, 1, false, NULL) > 0;
+}
 
-    q->buffer[q->tail] = elem;
-    q->tail = (q->tail + 1) % q->size;
-    q->count++;
+bool queue_try_pop(queue_t *q, void **elem) {
+    if (q == NULL) {
+        return false;
+    }
+    return pop_wait(q, elem, 1, false, NULL) > 0;
+}
 
-    pthread_cond_signal(&q->not_empty);
-    pthread_mutex_unlock(&q->mutex);
-    return true;
+bool queue_timed_push(queue_t *q, void *elem, const struct timespec *deadline) {
+    if (q == NULL) {
+        return false;
+    }
+    return push_wait(q, &elem, 1, true, deadline) > 0;
 }
 
-bool queue_pop(queue_t *q, void **elem) {
+bool queue_timed_pop(queue_t *q, void **elem, const struct timespec *deadline) {
     if (q == NULL) {
         return false;
     }
+    return pop_wait(q, elem, 1, true, deadline) > 0;
+}
+
+int queue_push_many(queue_t *q, void *const *elems, int n) {
+    if (q == NULL || elems == NULL || n <= 0) {
+        return 0;
+    }
+    return (int) push_wait(q, elems, (size_t) n, true, NULL);
+}
+
+int queue_pop_many(queue_t *q, void **elems, int max) {
+    if (q == NULL || elems == NULL || max <= 0) {
+        return 0;
+    }
+    return (int) pop_wait(q, elems, (size_t) max, true, NULL);
+}
 
-    pthread_mutex_lock(&q->mutex);
-    while (q->count == 0) {
-        pthread_cond_wait(&q->not_empty, &q->mutex);
+void queue_close(queue_t *q) {
+    if (q == NULL) {
+        return;
     }
+    atomic_fetch_or(&q->tail, TAIL_CLOSED);
+    ec_notify(&q->not_full, INT_MAX);
+    ec_notify(&q->not_empty, INT_MAX);
+    // Always wake the event loop so it sees end-of-stream.
+    int fd = atomic_load(&q->efd);
+    if (fd >= 0) {
+        eventfd_write(fd, 1);
+    }
+}
+
+bool queue_closed(queue_t *q) {
+    return q != NULL && (atomic_load(&q->tail) & TAIL_CLOSED);
+}
 
-    *elem = q->buffer[q->head];
-    q->head = (q->head + 1) % q->size;
-    q->count--;
+int queue_drain(queue_t *q, void (*fn)(void *elem, void *arg), void *arg) {
+    if (q == NULL) {
+        return 0;
+    }
+    void *batch[64];
+    int total = 0;
+    size_t k;
+    while ((k = ring_pop(q, batch, sizeof(batch) / sizeof(batch[0]))) > 0) {
+        USDT_PROBE2(queue, pop, q, k);
+        q_stats_t *st = stats_of(q);
+        if (st != NULL) {
+            stats_update(q, st, false, k, 0);
+        }
+        ec_notify(&q->not_full, (int) k);
+        if (fn != NULL) {
+            for (size_t i = 0; i < k; i++) {
+                fn(batch[i], arg);
+            }
+        }
+        total += (int) k;
+    }
+    return total;
+}
 
-    pthread_cond_signal(&q->not_full);
-    pthread_mutex_unlock(&q->mutex);
+int queue_eventfd(queue_t *q) {
+    if (q == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = atomic_load(&q->efd);
+    if (fd >= 0) {
+        return fd;
+    }
+    int fresh = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fresh < 0) {
+        return -1;
+    }
+    if (!atomic_compare_exchange_strong(&q->efd, &fd, fresh)) {
+        close(fresh);
+        return fd;
+    }
+    // Start readable, so the first drain picks up anything already queued
+    // and arms the fd.
+    eventfd_write(fresh, 1);
+    return fresh;
+}
+
+int queue_eventfd_drain(queue_t *q, void (*fn)(void *elem, void *arg), void *arg) {
+    if (q == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = atomic_load(&q->efd);
+    if (fd >= 0) {
+        eventfd_t ignored;
+        eventfd_read(fd, &ignored);
+    }
+
+    // Take at most one queue's worth, so producers that keep up can't
+    // starve the rest of the event loop.
+    void *batch[64];
+    size_t total = 0;
+    bool armed = false;
+    while (total < q->cap) {
+        size_t want = q->cap - total;
+        if (want > sizeof(batch) / sizeof(batch[0])) {
+            want = sizeof(batch) / sizeof(batch[0]);
+        }
+        size_t k = ring_pop(q, batch, want);
+        if (k == 0) {
+            if (fd < 0 || armed) {
+                break;
+            }
+            // Empty: ask the next producer to signal, then look once more in
+            // case an element arrived before the flag was visible.
+            atomic_store_explicit(&q->efd_armed, true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            armed = true;
+            continue;
+        }
+        USDT_PROBE2(queue, pop, q, k);
+        q_stats_t *st = stats_of(q);
+        if (st != NULL) {
+            stats_update(q, st, false, k, 0);
+        }
+        ec_notify(&q->not_full, (int) k);
+        if (fn != NULL) {
+            for (size_t i = 0; i < k; i++) {
+                fn(batch[i], arg);
+            }
+        }
+        total += k;
+    }
+    if (total == q->cap && fd >= 0) {
+        // Stopped early; come back on the next loop iteration.
+        eventfd_write(fd, 1);
+    }
+    if (total == 0 && ring_finished(q)) {
+        errno = EPIPE;
+        return -1;
+    }
+    return (int) total;
+}
+
+bool queue_stats_enable(queue_t *q, bool on) {
+    if (q == NULL) {
+        return false;
+    }
+    if (on && atomic_load(&q->stats) == NULL) {
+        q_stats_t *fresh = calloc(1, sizeof(q_stats_t));
+        if (fresh == NULL) {
+            return false;
+        }
+        q_stats_t *expected = NULL;
+        if (!atomic_compare_exchange_strong(&q->stats, &expected, fresh)) {
+            free(fresh);
+        }
+    }
+    atomic_store_explicit(&q->stats_on, on, memory_order_release);
     return true;
 }
+
+void queue_stats_snapshot(queue_t *q, queue_stats_t *out) {
+    if (out == NULL) {
+        return;
+    }
+    memset(out, 0, sizeof(*out));
+    if (q == NULL) {
+        return;
+    }
+    out->capacity = q->cap;
+    out->occupancy = occupancy(q);
+    q_stats_t *st = atomic_load(&q->stats);
+    if (st == NULL) {
+        return;
+    }
+    out->pushes = atomic_load_explicit(&st->pushes, memory_order_relaxed);
+    out->pops = atomic_load_explicit(&st->pops, memory_order_relaxed);
+    out->full_stalls = atomic_load_explicit(&st->full_stalls, memory_order_relaxed);
+    out->empty_stalls = atomic_load_explicit(&st->empty_stalls, memory_order_relaxed);
+    out->max_occupancy = atomic_load_explicit(&st->max_occupancy, memory_order_relaxed);
+    lockstat_copy(&out->full_wait_ns, st->full_wait_ns);
+    lockstat_copy(&out->empty_wait_ns, st->empty_wait_ns);
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+/**
+ *  A bounded, thread-safe FIFO of void pointers.
+ *
+ *  Any number of producers and consumers may use the queue concurrently.
+ *  Elements move through a lock-free ring; threads only sleep when the queue
+ *  is full (producers) or empty (consumers).
+ *
+ *  Once queue_close is called, pushes fail and consumers drain whatever is
+ *  left before their pops start failing (end-of-stream). Calls that fail set
+ *  errno to EAGAIN (try variants), ETIMEDOUT (timed variants) or EPIPE
+ *  (closed).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "lockstat.h"
+
+typedef struct queue queue_t;
+
+/** @brief Dynamically allocates and initializes a new queue.
+ *
+ *  @param size The maximum number of elements the queue can hold.
+ *
+ *  @return A pointer to the new queue, or NULL if size is not positive or
+ *          allocation fails.
+ */
+queue_t *queue_new(int size);
+
+/** @brief Frees all memory held by the queue and sets *q to NULL.
+ *
+ *  @param q A pointer to the pointer to delete. Elements still in the queue
+ *           are not freed.
+ */
+void queue_delete(queue_t **q);
+
+/** @brief Adds elem to the tail of the queue, blocking while it is full.
+ *
+ *  @return true on success, false if q is NULL or the queue is closed.
+ */
+bool queue_push(queue_t *q, void *elem);
+
+/** @brief Removes the element at the head of the queue into *elem, blocking
+ *         while it is empty.
+ *
+ *  @return true on success, false if q is NULL or the queue is closed and
+ *          empty.
+ */
+bool queue_pop(queue_t *q, void **elem);
+
+/** @brief Like queue_push, but fails with EAGAIN instead of blocking when the
+ *         queue is full.
+ */
+bool queue_try_push(queue_t *q, void *elem);
+
+/** @brief Like queue_pop, but fails with EAGAIN instead of blocking when the
+ *         queue is empty.
+ */
+bool queue_try_pop(queue_t *q, void **elem);
+
+/** @brief Like queue_push, but gives up with ETIMEDOUT at deadline.
+ *
+ *  @param deadline An absolute CLOCK_MONOTONIC time, or NULL to wait forever.
+ */
+bool queue_timed_push(queue_t *q, void *elem, const struct timespec *deadline);
+
+/** @brief Like queue_pop, but gives up with ETIMEDOUT at deadline.
+ *
+ *  @param deadline An absolute CLOCK_MONOTONIC time, or NULL to wait forever.
+ */
+bool queue_timed_pop(queue_t *q, void **elem, const struct timespec *deadline);
+
+/** @brief Pushes up to n elements from elems with a single slot reservation,
+ *         blocking only while the queue is completely full.
+ *
+ *  @param elems The elements to push, in order.
+ *
+ *  @param n The number of elements in elems.
+ *
+ *  @return The number of elements pushed (between 1 and n), which is less
+ *          than n when the queue filled up. Returns 0 if q or elems is NULL,
+ *          n is not positive, or the queue is closed.
+ */
+int queue_push_many(queue_t *q, void *const *elems, int n);
+
+/** @brief Pops up to max elements into elems with a single slot reservation,
+ *         blocking only while the queue is empty.
+ *
+ *  @return The number of elements popped (between 1 and max). Returns 0 if
+ *          q or elems is NULL, max is not positive, or the queue is closed
+ *          and empty.
+ */
+int queue_pop_many(queue_t *q, void **elems, int max);
+
+/** @brief Removes every element currently in the queue without blocking and
+ *         passes each one, in FIFO order, to fn (which may be NULL).
+ *
+ *  Intended for shutdown, e.g. queue_drain(q, free_conn, NULL).
+ *
+ *  @return The number of elements removed.
+ */
+int queue_drain(queue_t *q, void (*fn)(void *elem, void *arg), void *arg);
+
+/** @brief Closes the queue and wakes every blocked producer and consumer.
+ *
+ *  Pushes fail from now on; items already in the queue can still be popped.
+ *  Closing is permanent.
+ */
+void queue_close(queue_t *q);
+
+/** @brief Returns true if queue_close has been called on q.
+ */
+bool queue_closed(queue_t *q);
+
+/** @brief Returns an eventfd that becomes readable when q goes from empty to
+ *         non-empty, or when q is closed, so an epoll/io_uring loop can wait
+ *         on the queue together with sockets. Created on first call and
+ *         closed by queue_delete; the caller must not close it.
+ *
+ *  After the fd polls readable, call queue_eventfd_drain, which re-arms it.
+ *  Other threads may keep using queue_pop; the loop then just sees an
+ *  occasional empty drain.
+ *
+ *  @return The fd, or -1 with errno set if it could not be created.
+ */
+int queue_eventfd(queue_t *q);
+
+/** @brief Removes up to one queue's capacity of elements without blocking,
+ *         passing each to fn (which may be NULL) in FIFO order, then clears
+ *         and re-arms the eventfd.
+ *
+ *  @return The number of elements removed, or -1 with errno set to EPIPE
+ *          once the queue is closed and empty.
+ */
+int queue_eventfd_drain(queue_t *q, void (*fn)(void *elem, void *arg), void *arg);
+
+typedef struct {
+    uint64_t pushes;
+    uint64_t pops;
+    uint64_t full_stalls;          // successful pushes that found the queue full
+    uint64_t empty_stalls;         // successful pops that found the queue empty
+    lockstat_hist_t full_wait_ns;  // how long those pushes waited
+    lockstat_hist_t empty_wait_ns; // how long those pops waited
+    uint64_t occupancy;            // elements queued at snapshot time
+    uint64_t max_occupancy;        // high-water mark while stats were on
+    uint64_t capacity;
+} queue_stats_t;
+
+/** @brief Turns statistics for q on or off. While off, pushes and pops only
+ *         test one flag. Counters persist across off/on.
+ *
+ *  @return false if q is NULL or the counters could not be allocated.
+ */
+bool queue_stats_enable(queue_t *q, bool on);
+
+/** @brief Copies the current counters of q into *out. Safe to call while
+ *         the queue is in use.
+ */
+void queue_stats_snapshot(queue_t *q, queue_stats_t *out);
@@ -1,81 +1,359 @@
-#include <pthread.h>
+#define _GNU_SOURCE
+#include <limits.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
-typedef enum { READERS, WRITERS, N_WAY } PRIORITY;
+#include "futex.h"
+#include "lockstat.h"
+#include "rwlock.h"
+#include "usdt.h"
+
+// Spin iterations before a blocked reader or writer parks on its futex.
+#define RW_SPIN 100
+
+// Distributed-reader mode: number of per-CPU reader slots per lock.
+#define RW_SLOTS 64
+
+// Read holds a thread can track at once. Beyond this, distributed locks fall
+// back to the lock word and hold times go unmeasured.
+#define RW_HELD_MAX 16
+
+// After a writer revokes the reader fast path, it stays off for this many
+// times the revocation took (BRAVO's inhibit multiplier).
+#define RW_INHIBIT_MULT 9
+
+// Layout of the lock word. Every field a policy decision needs lives here, so
+// acquire and release are a single CAS on one cache line.
+#define ST_READER    ((uint64_t) 1)          // bits 0-15: active readers
+#define ST_READERS   ((uint64_t) 0xffff)
+#define ST_WRITER    ((uint64_t) 1 << 16)    // bit 16: writer holds the lock
+#define ST_WWAIT     ((uint64_t) 1 << 17)    // bits 17-31: waiting writers
+#define ST_WWAITS    ((uint64_t) 0x7fff << 17)
+#define ST_RWAIT     ((uint64_t) 1 << 32)    // bits 32-47: parked readers
+#define ST_RWAITS    ((uint64_t) 0xffff << 32)
+#define ST_BATCH     ((uint64_t) 1 << 48)    // bits 48-62: N_WAY batch slots left
+#define ST_BATCHES   ((uint64_t) 0x7fff << 48)
+#define ST_BATCH_ON  ((uint64_t) 1 << 63)    // bit 63: N_WAY batch in progress
+
+#define ST_FIELD(s, mask, one) (((s) & (mask)) / (one))
+
+// PHASE_FAIR ticket lock (Brandenburg and Anderson's PF-T). rin/rout count
+// reader arrivals and departures in units of PF_RINC; the low bits of rin
+// say whether a writer is present and which phase it belongs to.
+#define PF_RINC  0x100u
+#define PF_WBITS 0x3u
+#define PF_PRES  0x2u
+#define PF_PHID  0x1u
+// Futex wait bits of a writer ticket, so writer_unlock wakes only the
+// writers whose turn may have come.
+#define PF_TICKET_BIT(t) (1u << ((t) % 32))
+
+typedef struct {
+    alignas(CACHE_LINE) _Atomic long readers;
+} reader_slot_t;
+
+typedef struct {
+    _Atomic uint64_t acquisitions;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t wait_ns[LOCKSTAT_BUCKETS];
+    _Atomic uint64_t hold_ns[LOCKSTAT_BUCKETS];
+} side_stats_t;
+
+typedef struct {
+    alignas(CACHE_LINE) side_stats_t reader;
+    alignas(CACHE_LINE) side_stats_t writer;
+    // When the current writer acquired the lock; only touched by the holder.
+    uint64_t writer_since;
+} rw_stats_t;
 
-typedef struct rwlock rwlock_t;
 struct rwlock {
-    pthread_mutex_t mutex;
-    pthread_cond_t readers_cv;
-    pthread_cond_t writers_cv;
-    int active_readers;
-    int active_writers;
-    int waiting_readers;
-    int waiting_writers;
+    _Atomic uint64_t state;
     PRIORITY priority;
     int n_way;
 
-    // For N_WAY batch management.
-    bool batch_active;
-    int current_batch_readers;
-    int batch_limit;
+    // Parked readers and writers sleep on separate eventcounts so an unlock
+    // can wake exactly the class that may proceed.
+    eventcount_t readers_ec;
+    eventcount_t writers_ec;
+
+    // PHASE_FAIR state, used instead of the state word. Each *_parked counts
+    // threads sleeping on the matching futex word.
+    struct {
+        alignas(CACHE_LINE) _Atomic uint32_t rin;
+        _Atomic uint32_t win;
+        _Atomic uint32_t rin_parked;
+        alignas(CACHE_LINE) _Atomic uint32_t rout;
+        _Atomic uint32_t wout;
+        _Atomic uint32_t rout_parked;
+        _Atomic uint32_t wout_parked;
+    } pf;
+
+    // Distributed-reader mode; slots is NULL when disabled. While rbias is
+    // set, readers only bump their CPU's slot.
+    reader_slot_t *slots;
+    _Atomic bool rbias;
+    _Atomic uint64_t inhibit_until;
+
+    // Contention statistics; allocated on first rwlock_stats_enable and only
+    // updated while stats_on is set.
+    _Atomic(rw_stats_t *) stats;
+    _Atomic bool stats_on;
 };
 
+// Read holds this thread is tracking: fast-path holds of distributed locks
+// (slot >= 0), so reader_unlock knows which slot to release, and, while stats
+// are on, slow-path holds (slot < 0), so their hold time can be measured.
+static __thread struct {
+    rwlock_t *lock;
+    int slot;
+    uint64_t since;
+} held[RW_HELD_MAX];
+static __thread int n_held;
+
+static void track_hold(rwlock_t *rw, int slot, uint64_t since) {
+    held[n_held].lock = rw;
+    held[n_held].slot = slot;
+    held[n_held].since = since;
+    n_held++;
+}
+
+static bool untrack_hold(rwlock_t *rw, int *slot, uint64_t *since) {
+    for (int i = n_held - 1; i >= 0; i--) {
+        if (held[i].lock == rw) {
+            *slot = held[i].slot;
+            *since = held[i].since;
+            held[i] = held[--n_held];
+            return true;
+        }
+    }
+    return false;
+}
+
+static rw_stats_t *stats_of(rwlock_t *rw) {
+    if (!atomic_load_explicit(&rw->stats_on, memory_order_acquire))
+        return NULL;
+    return atomic_load_explicit(&rw->stats, memory_order_relaxed);
+}
+
+static void stats_acquired(side_stats_t *side, uint64_t wait_ns, bool contended) {
+    lockstat_bump(&side->acquisitions);
+    if (contended)
+        lockstat_bump(&side->contended);
+    lockstat_record(side->wait_ns, wait_ns);
+}
+
+static int current_slot(void) {
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        cpu = (int) ((uintptr_t) &n_held >> 6);
+    }
+    return cpu % RW_SLOTS;
+}
+
+// Tries to take a read hold without touching the lock word.
+static bool fast_reader_lock(rwlock_t *rw, uint64_t since) {
+    if (!rw->slots || n_held == RW_HELD_MAX
+        || !atomic_load_explicit(&rw->rbias, memory_order_relaxed)) {
+        return false;
+    }
+    int slot = current_slot();
+    atomic_fetch_add(&rw->slots[slot].readers, 1);
+    if (!atomic_load(&rw->rbias)) {
+        // A writer revoked the fast path between the check and the increment.
+        atomic_fetch_sub_explicit(&rw->slots[slot].readers, 1, memory_order_release);
+        return false;
+    }
+    track_hold(rw, slot, since);
+    return true;
+}
+
+// Turns the reader fast path off and waits for fast-path readers to leave.
+// Called by a writer that already excludes slow-path readers, so nobody can
+// turn the fast path back on until writer_unlock. If the bias was already
+// off, no reader can be on the fast path and the inhibit window set by the
+// last revocation stands.
+static void revoke_reader_bias(rwlock_t *rw) {
+    if (!atomic_exchange(&rw->rbias, false))
+        return;
+    uint64_t start = lockstat_now();
+    for (int i = 0; i < RW_SLOTS; i++) {
+        for (int spin = 0; atomic_load_explicit(&rw->slots[i].readers, memory_order_acquire) != 0;
+             spin++) {
+            if (spin < 128) {
+                cpu_relax();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+    uint64_t now = lockstat_now();
+    atomic_store_explicit(&rw->inhibit_until, now + (now - start) * RW_INHIBIT_MULT,
+                          memory_order_relaxed);
+}
+
 #ifdef DEBUG
 // Using GNU extension to allow zero or more args.
 #define DBG_PRINT(fmt, ...) fprintf(stderr, "[%s:%d:%s] " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
 
-// Checks key invariants of the rwlock and prints an error if any invariant is broken.
-static void check_invariants(rwlock_t *rw) {
-    if (rw->active_writers > 0 && rw->active_readers > 0) {
-        fprintf(stderr, "Invariant violation: active_writers (%d) > 0 but active_readers (%d) > 0\n", rw->active_writers, rw->active_readers);
-    }
-    if (rw->batch_active && rw->batch_limit <= 0) {
-        fprintf(stderr, "Invariant violation: batch_active is true but batch_limit is %d\n", rw->batch_limit);
+// Checks key invariants of a lock word snapshot and prints an error if any invariant is broken.
+static void check_invariants(rwlock_t *rw, uint64_t s) {
+    if ((s & ST_WRITER) && (s & ST_READERS)) {
+        fprintf(stderr, "Invariant violation: writer active but active_readers (%d) > 0\n",
+                (int) ST_FIELD(s, ST_READERS, ST_READER));
     }
-    if (rw->current_batch_readers > rw->batch_limit) {
-        fprintf(stderr, "Invariant violation: current_batch_readers (%d) > batch_limit (%d)\n", rw->current_batch_readers, rw->batch_limit);
+    if ((s & ST_BATCH_ON) && rw->priority != N_WAY) {
+        fprintf(stderr, "Invariant violation: batch_active outside N_WAY\n");
     }
-    if (rw->waiting_readers < 0 || rw->waiting_writers < 0 ||
-        rw->active_readers < 0 || rw->active_writers < 0) {
-        fprintf(stderr, "Invariant violation: one of the counters is negative\n");
+    if (!(s & ST_BATCH_ON) && (s & ST_BATCHES)) {
+        fprintf(stderr, "Invariant violation: batch slots (%d) left without an active batch\n",
+                (int) ST_FIELD(s, ST_BATCHES, ST_BATCH));
     }
 }
 #else
 #define DBG_PRINT(fmt, ...) do {} while(0)
-#define check_invariants(rw) do {} while(0)
+#define check_invariants(rw, s) do {} while(0)
 #endif
 
+static bool reader_may_enter(rwlock_t *rw, uint64_t s) {
+    if (s & ST_WRITER)
+        return false;
+    if (rw->priority == WRITERS && (s & ST_WWAITS))
+        return false;
+    if (rw->priority == N_WAY && (s & ST_BATCH_ON) && !(s & ST_BATCHES))
+        return false;
+    return true;
+}
+
+static bool writer_may_enter(uint64_t s) {
+    return !(s & ST_WRITER) && !(s & ST_READERS);
+}
+
+// Spins, then sleeps on word until ((*word & mask) == value) == until_equal.
+// Only pf_wake calls whose bits overlap these wake the sleeper. Returns true
+// if the condition did not hold right away.
+static bool pf_wait(_Atomic uint32_t *word, _Atomic uint32_t *parked, uint32_t mask,
+                    uint32_t value, bool until_equal, uint32_t bits) {
+    for (int spin = 0;; spin++) {
+        uint32_t cur = atomic_load_explicit(word, memory_order_acquire);
+        if (((cur & mask) == value) == until_equal)
+            return spin > 0;
+        if (spin < RW_SPIN) {
+            cpu_relax();
+            continue;
+        }
+        atomic_fetch_add(parked, 1);
+        cur = atomic_load(word);
+        if (((cur & mask) == value) != until_equal)
+            futex_wait_bits(word, cur, NULL, bits);
+        atomic_fetch_sub(parked, 1);
+    }
+}
+
+// Called after changing word with a seq_cst RMW.
+static void pf_wake(_Atomic uint32_t *word, _Atomic uint32_t *parked, int n, uint32_t bits) {
+    if (atomic_load(parked) > 0)
+        futex_wake_bits(word, n, bits);
+}
+
+static bool pf_reader_lock(rwlock_t *rw) {
+    // Readers that arrive while a writer is present wait only until that
+    // writer's phase ends, even if more writers are queued behind it.
+    uint32_t w = atomic_fetch_add(&rw->pf.rin, PF_RINC) & PF_WBITS;
+    if (w == 0)
+        return false;
+    pf_wait(&rw->pf.rin, &rw->pf.rin_parked, PF_WBITS, w, false, FUTEX_BITSET_MATCH_ANY);
+    return true;
+}
+
+static void pf_reader_unlock(rwlock_t *rw) {
+    atomic_fetch_add(&rw->pf.rout, PF_RINC);
+    pf_wake(&rw->pf.rout, &rw->pf.rout_parked, 1, FUTEX_BITSET_MATCH_ANY);
+}
+
+static bool pf_writer_lock(rwlock_t *rw) {
+    uint32_t ticket = atomic_fetch_add(&rw->pf.win, 1);
+    bool waited = pf_wait(&rw->pf.wout, &rw->pf.wout_parked, UINT32_MAX, ticket, true,
+                          PF_TICKET_BIT(ticket));
+    // Block new readers, then wait for the readers already inside to leave.
+    uint32_t w = PF_PRES | (ticket & PF_PHID);
+    uint32_t readers_in = atomic_fetch_add(&rw->pf.rin, w);
+    waited |= pf_wait(&rw->pf.rout, &rw->pf.rout_parked, UINT32_MAX, readers_in, true,
+                      FUTEX_BITSET_MATCH_ANY);
+    return waited;
+}
+
+static void pf_writer_unlock(rwlock_t *rw) {
+    atomic_fetch_and(&rw->pf.rin, ~PF_WBITS);
+    pf_wake(&rw->pf.rin, &rw->pf.rin_parked, INT_MAX, FUTEX_BITSET_MATCH_ANY);
+    // Only the next ticket holder can go; the others stay asleep.
+    uint32_t next = atomic_fetch_add(&rw->pf.wout, 1) + 1;
+    pf_wake(&rw->pf.wout, &rw->pf.wout_parked, INT_MAX, PF_TICKET_BIT(next));
+}
+
+// True if some writer holds or is queued for the lock.
+static bool writers_queued(rwlock_t *rw, uint64_t s) {
+    if (rw->priority == PHASE_FAIR)
+        return atomic_load(&rw->pf.win) != atomic_load(&rw->pf.wout);
+    return (s & ST_WWAITS) != 0;
+}
+
 rwlock_t *rwlock_new(PRIORITY p, int n) {
     rwlock_t *rw = malloc(sizeof(rwlock_t));
     if (!rw)
         return NULL;
     rw->priority = p;
     rw->n_way = (p == N_WAY) ? n : 0;
-    rw->active_readers = 0;
-    rw->active_writers = 0;
-    rw->waiting_readers = 0;
-    rw->waiting_writers = 0;
-    rw->batch_active = false;
-    rw->current_batch_readers = 0;
-    rw->batch_limit = 0;
-    pthread_mutex_init(&rw->mutex, NULL);
-    pthread_cond_init(&rw->readers_cv, NULL);
-    pthread_cond_init(&rw->writers_cv, NULL);
+    atomic_init(&rw->state, 0);
+    atomic_init(&rw->readers_ec.seq, 0);
+    atomic_init(&rw->readers_ec.waiters, 0);
+    atomic_init(&rw->writers_ec.seq, 0);
+    atomic_init(&rw->writers_ec.waiters, 0);
+    atomic_init(&rw->pf.rin, 0);
+    atomic_init(&rw->pf.win, 0);
+    atomic_init(&rw->pf.rin_parked, 0);
+    atomic_init(&rw->pf.rout, 0);
+    atomic_init(&rw->pf.wout, 0);
+    atomic_init(&rw->pf.rout_parked, 0);
+    atomic_init(&rw->pf.wout_parked, 0);
+
+    rw->slots = NULL;
+    atomic_init(&rw->rbias, false);
+    atomic_init(&rw->inhibit_until, 0);
+    atomic_init(&rw->stats, NULL);
+    atomic_init(&rw->stats_on, false);
 
     DBG_PRINT("Initialized rwlock (priority=%d, n_way=%d)", rw->priority, rw->n_way);
-    check_invariants(rw);
+    return rw;
+}
+
+rwlock_t *rwlock_new_distributed(PRIORITY p, int n) {
+    rwlock_t *rw = rwlock_new(p, n);
+    if (!rw)
+        return NULL;
+    rw->slots = aligned_alloc(CACHE_LINE, sizeof(reader_slot_t) * RW_SLOTS);
+    if (!rw->slots) {
+        rwlock_delete(&rw);
+        return NULL;
+    }
+    for (int i = 0; i < RW_SLOTS; i++)
+        atomic_init(&rw->slots[i].readers, 0);
+    atomic_store(&rw->rbias, true);
+    DBG_PRINT("Enabled distributed readers");
     return rw;
 }
 
 void rwlock_delete(rwlock_t **l) {
     if (!l || !*l)
         return;
-    pthread_mutex_destroy(&(*l)->mutex);
-    pthread_cond_destroy(&(*l)->readers_cv);
-    pthread_cond_destroy(&(*l)->writers_cv);
+    free((*l)->slots);
+    free(atomic_load(&(*l)->stats));
     free(*l);
     *l = NULL;
     DBG_PRINT("Deleted rwlock");
@@ -84,122 +362,274 @@ void rwlock_delete(rwlock_t **l) {
 void reader_lock(rwlock_t *rw) {
     if (!rw)
         return;
-    pthread_mutex_lock(&rw->mutex);
-    rw->waiting_readers++;
-    DBG_PRINT("reader_lock start: waiting_readers=%d, active_readers=%d, active_writers=%d, waiting_writers=%d, batch_active=%d, current_batch_readers=%d, batch_limit=%d",
-              rw->waiting_readers, rw->active_readers, rw->active_writers, rw->waiting_writers, rw->batch_active, rw->current_batch_readers, rw->batch_limit);
-    check_invariants(rw);
+    rw_stats_t *st = stats_of(rw);
+    uint64_t t0 = st ? lockstat_now() : 0;
+    if (fast_reader_lock(rw, t0)) {
+        if (st)
+            stats_acquired(&st->reader, 0, false);
+        USDT_PROBE2(rwlock, reader_acquire, rw, 0);
+        return;
+    }
+    USDT_PROBE1(rwlock, reader_wait, rw);
 
-    if (rw->priority == N_WAY) {
-        while (rw->active_writers > 0 ||
-              (rw->batch_active && rw->current_batch_readers >= rw->batch_limit))
-        {
-            DBG_PRINT("reader_lock waiting (N_WAY): active_writers=%d, current_batch_readers=%d, batch_limit=%d",
-                      rw->active_writers, rw->current_batch_readers, rw->batch_limit);
-            pthread_cond_wait(&rw->readers_cv, &rw->mutex);
+    uint64_t s = atomic_load_explicit(&rw->state, memory_order_relaxed);
+    bool parked = false;
+    int spin = 0;
+    bool contended = false;
+    while (rw->priority != PHASE_FAIR) {
+        if (reader_may_enter(rw, s)) {
+            uint64_t next = s + ST_READER;
+            if (parked)
+                next -= ST_RWAIT;
+            if (s & ST_BATCH_ON)
+                next -= ST_BATCH;
+            if (atomic_compare_exchange_weak_explicit(&rw->state, &s, next, memory_order_acquire,
+                                                      memory_order_relaxed)) {
+                s = next;
+                break;
+            }
+            continue;
         }
-    } else if (rw->priority == WRITERS) {
-        while (rw->active_writers > 0 || rw->waiting_writers > 0) {
-            DBG_PRINT("reader_lock waiting (WRITERS): active_writers=%d, waiting_writers=%d",
-                      rw->active_writers, rw->waiting_writers);
-            pthread_cond_wait(&rw->readers_cv, &rw->mutex);
+        contended = true;
+        if (spin < RW_SPIN) {
+            spin++;
+            cpu_relax();
+            s = atomic_load_explicit(&rw->state, memory_order_relaxed);
+            continue;
         }
-    } else { // READERS
-        while (rw->active_writers > 0) {
-            DBG_PRINT("reader_lock waiting (READERS): active_writers=%d", rw->active_writers);
-            pthread_cond_wait(&rw->readers_cv, &rw->mutex);
+        if (!parked) {
+            // Register as waiting so unlockers know to wake us.
+            if (!atomic_compare_exchange_weak(&rw->state, &s, s + ST_RWAIT))
+                continue;
+            parked = true;
         }
+        uint32_t key = ec_prepare(&rw->readers_ec);
+        s = atomic_load(&rw->state);
+        if (reader_may_enter(rw, s)) {
+            ec_cancel(&rw->readers_ec);
+            continue;
+        }
+        DBG_PRINT("reader_lock parking: state=%#llx", (unsigned long long) s);
+        ec_wait(&rw->readers_ec, key, NULL);
+        s = atomic_load_explicit(&rw->state, memory_order_relaxed);
     }
+    if (rw->priority == PHASE_FAIR)
+        contended = pf_reader_lock(rw);
+    check_invariants(rw, s);
 
-    rw->waiting_readers--;
-    rw->active_readers++;
-    if (rw->priority == N_WAY && rw->batch_active)
-        rw->current_batch_readers++;
-    check_invariants(rw);
-    DBG_PRINT("Acquired reader_lock: waiting_readers=%d, active_readers=%d, active_writers=%d, current_batch_readers=%d",
-              rw->waiting_readers, rw->active_readers, rw->active_writers, rw->current_batch_readers);
-    pthread_mutex_unlock(&rw->mutex);
+    if (st) {
+        uint64_t t1 = lockstat_now();
+        stats_acquired(&st->reader, t1 - t0, contended);
+        if (n_held < RW_HELD_MAX)
+            track_hold(rw, -1, t1);
+    }
+    USDT_PROBE2(rwlock, reader_acquire, rw, contended);
+
+    // No writer is active or waiting, so it is safe to hand later readers
+    // back to the fast path once the inhibit window has passed.
+    if (rw->slots && !atomic_load_explicit(&rw->rbias, memory_order_relaxed)
+        && !writers_queued(rw, s)
+        && lockstat_now() >= atomic_load_explicit(&rw->inhibit_until, memory_order_relaxed)) {
+        atomic_store(&rw->rbias, true);
+        DBG_PRINT("Re-enabled distributed readers");
+    }
 }
 
 void reader_unlock(rwlock_t *rw) {
     if (!rw)
         return;
-    pthread_mutex_lock(&rw->mutex);
-    rw->active_readers--;
-    DBG_PRINT("reader_unlock: active_readers now=%d", rw->active_readers);
-    check_invariants(rw);
-    if (rw->active_readers == 0 && rw->waiting_writers > 0) {
-        DBG_PRINT("reader_unlock signaling writer");
-        pthread_cond_signal(&rw->writers_cv);
+    int slot = -1;
+    uint64_t since = 0;
+    if ((rw->slots || atomic_load_explicit(&rw->stats, memory_order_relaxed))
+        && untrack_hold(rw, &slot, &since) && since != 0) {
+        rw_stats_t *st = atomic_load_explicit(&rw->stats, memory_order_relaxed);
+        lockstat_record(st->reader.hold_ns, lockstat_now() - since);
+    }
+    if (slot >= 0) {
+        atomic_fetch_sub_explicit(&rw->slots[slot].readers, 1, memory_order_release);
+        return;
+    }
+    if (rw->priority == PHASE_FAIR) {
+        pf_reader_unlock(rw);
+        return;
+    }
+    uint64_t s = atomic_fetch_sub_explicit(&rw->state, ST_READER, memory_order_release) - ST_READER;
+    check_invariants(rw, s);
+    if (!(s & ST_READERS) && (s & ST_WWAITS)) {
+        DBG_PRINT("reader_unlock waking a writer");
+        ec_notify(&rw->writers_ec, 1);
     }
-    pthread_mutex_unlock(&rw->mutex);
 }
 
 void writer_lock(rwlock_t *rw) {
     if (!rw)
         return;
-    pthread_mutex_lock(&rw->mutex);
-    rw->waiting_writers++;
-    DBG_PRINT("writer_lock start: waiting_writers=%d, active_readers=%d, active_writers=%d",
-              rw->waiting_writers, rw->active_readers, rw->active_writers);
-    check_invariants(rw);
-    while (rw->active_writers > 0 || rw->active_readers > 0) {
-        DBG_PRINT("writer_lock waiting: active_writers=%d, active_readers=%d", rw->active_writers, rw->active_readers);
-        pthread_cond_wait(&rw->writers_cv, &rw->mutex);
-    }
-    rw->waiting_writers--;
-    rw->active_writers = 1;
-    if (rw->priority == N_WAY) {
-        // Reset any previous batch.
-        rw->batch_active = false;
-        rw->current_batch_readers = 0;
-        rw->batch_limit = 0;
+    rw_stats_t *st = stats_of(rw);
+    uint64_t t0 = st ? lockstat_now() : 0;
+    USDT_PROBE1(rwlock, writer_wait, rw);
+
+    uint64_t s = atomic_load_explicit(&rw->state, memory_order_relaxed);
+    bool waiting = false;
+    int spin = 0;
+    bool contended = false;
+    while (rw->priority != PHASE_FAIR) {
+        if (writer_may_enter(s)) {
+            // Taking the lock ends any N_WAY batch.
+            uint64_t next = (s | ST_WRITER) & ~(ST_BATCH_ON | ST_BATCHES);
+            if (waiting)
+                next -= ST_WWAIT;
+            if (atomic_compare_exchange_weak_explicit(&rw->state, &s, next, memory_order_acquire,
+                                                      memory_order_relaxed)) {
+                s = next;
+                break;
+            }
+            continue;
+        }
+        contended = true;
+        if (!waiting) {
+            // Count as waiting before spinning, so WRITERS priority holds new
+            // readers back and none of them re-enables the reader bias.
+            if (!atomic_compare_exchange_weak(&rw->state, &s, s + ST_WWAIT))
+                continue;
+            s += ST_WWAIT;
+            waiting = true;
+        }
+        if (spin < RW_SPIN) {
+            spin++;
+            cpu_relax();
+            s = atomic_load_explicit(&rw->state, memory_order_relaxed);
+            continue;
+        }
+        uint32_t key = ec_prepare(&rw->writers_ec);
+        s = atomic_load(&rw->state);
+        if (writer_may_enter(s)) {
+            ec_cancel(&rw->writers_ec);
+            continue;
+        }
+        DBG_PRINT("writer_lock parking: state=%#llx", (unsigned long long) s);
+        ec_wait(&rw->writers_ec, key, NULL);
+        s = atomic_load_explicit(&rw->state, memory_order_relaxed);
+    }
+    if (rw->priority == PHASE_FAIR)
+        contended = pf_writer_lock(rw);
+    check_invariants(rw, s);
+
+    // Fast-path readers never touch the lock word, so the writer got here
+    // without waiting for them; drain them now that nobody can re-enable it.
+    if (rw->slots)
+        revoke_reader_bias(rw);
+
+    if (st) {
+        uint64_t t1 = lockstat_now();
+        stats_acquired(&st->writer, t1 - t0, contended);
+        st->writer_since = t1;
     }
-    check_invariants(rw);
-    DBG_PRINT("Acquired writer_lock: waiting_writers=%d, active_readers=%d, active_writers=%d",
-              rw->waiting_writers, rw->active_readers, rw->active_writers);
-    pthread_mutex_unlock(&rw->mutex);
+    USDT_PROBE2(rwlock, writer_acquire, rw, contended);
 }
 
 void writer_unlock(rwlock_t *rw) {
     if (!rw)
         return;
-    pthread_mutex_lock(&rw->mutex);
-    rw->active_writers = 0;
-    DBG_PRINT("writer_unlock: released writer_lock. waiting_writers=%d, waiting_readers=%d", rw->waiting_writers, rw->waiting_readers);
-    check_invariants(rw);
+    rw_stats_t *st = atomic_load_explicit(&rw->stats, memory_order_relaxed);
+    if (st && st->writer_since != 0) {
+        lockstat_record(st->writer.hold_ns, lockstat_now() - st->writer_since);
+        st->writer_since = 0;
+    }
+    if (rw->priority == PHASE_FAIR) {
+        pf_writer_unlock(rw);
+        DBG_PRINT("writer_unlock complete");
+        return;
+    }
+    uint64_t s = atomic_load_explicit(&rw->state, memory_order_relaxed);
+    uint64_t next;
+    int batch;
+    do {
+        next = s & ~ST_WRITER;
+        batch = 0;
+        if (rw->priority == N_WAY && (s & ST_WWAITS) && (s & ST_RWAITS)) {
+            // Writers are queued: admit at most n_way of the parked readers
+            // before the next writer.
+            int waiting = (int) ST_FIELD(s, ST_RWAITS, ST_RWAIT);
+            batch = waiting < rw->n_way ? waiting : rw->n_way;
+            if (batch > (int) ST_FIELD(ST_BATCHES, ST_BATCHES, ST_BATCH))
+                batch = (int) ST_FIELD(ST_BATCHES, ST_BATCHES, ST_BATCH);
+            if (batch > 0)
+                next |= ST_BATCH_ON | ((uint64_t) batch * ST_BATCH);
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&rw->state, &s, next, memory_order_release,
+                                                    memory_order_relaxed));
+    check_invariants(rw, next);
 
+    bool readers_waiting = (s & ST_RWAITS) != 0;
+    bool writers_waiting = (s & ST_WWAITS) != 0;
     if (rw->priority == N_WAY) {
-        if (rw->waiting_writers > 0) {
-            if (rw->waiting_readers > 0) {
-                // Start a new batch.
-                rw->batch_active = true;
-                rw->batch_limit = (rw->waiting_readers < rw->n_way) ? rw->waiting_readers : rw->n_way;
-                rw->current_batch_readers = 0;
-                DBG_PRINT("Starting N_WAY batch: batch_limit=%d", rw->batch_limit);
-                pthread_cond_broadcast(&rw->readers_cv);
-            } else {
-                DBG_PRINT("No waiting readers: signaling writer");
-                pthread_cond_signal(&rw->writers_cv);
-            }
-        } else {
-            // No waiting writer; clear batch constraints.
-            rw->batch_active = false;
-            DBG_PRINT("No waiting writer: broadcasting readers");
-            pthread_cond_broadcast(&rw->readers_cv);
+        if (batch > 0) {
+            DBG_PRINT("Starting N_WAY batch: batch_limit=%d", batch);
+            ec_notify(&rw->readers_ec, batch);
+        } else if (writers_waiting) {
+            ec_notify(&rw->writers_ec, 1);
+        } else if (readers_waiting) {
+            ec_notify(&rw->readers_ec, INT_MAX);
         }
     } else if (rw->priority == READERS) {
-        if (rw->waiting_readers > 0)
-            pthread_cond_broadcast(&rw->readers_cv);
-        else if (rw->waiting_writers > 0)
-            pthread_cond_signal(&rw->writers_cv);
+        if (readers_waiting)
+            ec_notify(&rw->readers_ec, INT_MAX);
+        else if (writers_waiting)
+            ec_notify(&rw->writers_ec, 1);
     } else if (rw->priority == WRITERS) {
-        if (rw->waiting_writers > 0)
-            pthread_cond_signal(&rw->writers_cv);
-        else if (rw->waiting_readers > 0)
-            pthread_cond_broadcast(&rw->readers_cv);
+        if (writers_waiting)
+            ec_notify(&rw->writers_ec, 1);
+        else if (readers_waiting)
+            ec_notify(&rw->readers_ec, INT_MAX);
     }
-    check_invariants(rw);
-    pthread_mutex_unlock(&rw->mutex);
     DBG_PRINT("writer_unlock complete");
 }
+
+bool rwlock_stats_enable(rwlock_t *rw, bool on) {
+    if (!rw)
+        return false;
+    if (on && !atomic_load(&rw->stats)) {
+        rw_stats_t *fresh = aligned_alloc(CACHE_LINE, sizeof(rw_stats_t));
+        if (!fresh)
+            return false;
+        memset(fresh, 0, sizeof(*fresh));
+        rw_stats_t *expected = NULL;
+        if (!atomic_compare_exchange_strong(&rw->stats, &expected, fresh))
+            free(fresh);
+    }
+    atomic_store_explicit(&rw->stats_on, on, memory_order_release);
+    return true;
+}
+
+static void copy_side(rwlock_side_stats_t *out, side_stats_t *side) {
+    out->acquisitions = atomic_load_explicit(&side->acquisitions, memory_order_relaxed);
+    out->contended = atomic_load_explicit(&side->contended, memory_order_relaxed);
+    lockstat_copy(&out->wait_ns, side->wait_ns);
+    lockstat_copy(&out->hold_ns, side->hold_ns);
+}
+
+void rwlock_stats_snapshot(rwlock_t *rw, rwlock_stats_t *out) {
+    if (!out)
+        return;
+    memset(out, 0, sizeof(*out));
+    rw_stats_t *st = rw ? atomic_load(&rw->stats) : NULL;
+    if (!st)
+        return;
+    copy_side(&out->reader, &st->reader);
+    copy_side(&out->writer, &st->writer);
+}
+
+void rwlock_stats_reset(rwlock_t *rw) {
+    rw_stats_t *st = rw ? atomic_load(&rw->stats) : NULL;
+    if (!st)
+        return;
+    side_stats_t *sides[] = { &st->reader, &st->writer };
+    for (int i = 0; i < 2; i++) {
+        atomic_store_explicit(&sides[i]->acquisitions, 0, memory_order_relaxed);
+        atomic_store_explicit(&sides[i]->contended, 0, memory_order_relaxed);
+        for (int b = 0; b < LOCKSTAT_BUCKETS; b++) {
+            atomic_store_explicit(&sides[i]->wait_ns[b], 0, memory_order_relaxed);
+            atomic_store_explicit(&sides[i]->hold_ns[b], 0, memory_order_relaxed);
+        }
+    }
+}
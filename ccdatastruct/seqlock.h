@@ -0,0 +1,160 @@
+#pragma once
+
+/**
+ *  A sequence lock for small, read-mostly shared state.
+ *
+ *  Writers bump a sequence counter to an odd value, update the data and bump
+ *  it back to even. Readers never write to shared memory: they note the
+ *  counter, copy the data and retry if a writer was active or the counter
+ *  moved in between. Reads stay cheap no matter how many threads share the
+ *  data, but a reader can starve while writes are continuous, so use this
+ *  for state that changes rarely (configuration, cached metadata).
+ *
+ *  Data protected by a seqlock is read while a writer may be changing it, so
+ *  it must be copied with seqlock_read_copy and seqlock_write_copy (or be
+ *  _Atomic itself) to keep those accesses race-free. SEQLOCK_DEFINE wraps
+ *  both for a fixed-size struct.
+ *
+ *  Example:
+ *
+ *      SEQLOCK_DEFINE(config_seq, config_t)
+ *
+ *      config_seq_t conf;          // zero-initialised or config_seq_init()
+ *      config_seq_store(&conf, &fresh);
+ *      config_t now;
+ *      config_seq_load(&conf, &now);
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "futex.h"
+
+typedef struct {
+    _Atomic uint32_t seq; // odd while a writer is active
+} seqlock_t;
+
+#define SEQLOCK_INITIALIZER { 0 }
+
+/** @brief Initializes l to the unlocked state.
+ */
+static inline void seqlock_init(seqlock_t *l) {
+    atomic_init(&l->seq, 0);
+}
+
+/** @brief Starts a read section.
+ *
+ *  @return A token to pass to seqlock_read_retry. Waits while a writer is
+ *          active, so the token is always even.
+ */
+static inline uint32_t seqlock_read_begin(const seqlock_t *l) {
+    uint32_t s;
+    while ((s = atomic_load_explicit(&((seqlock_t *) l)->seq, memory_order_acquire)) & 1) {
+        cpu_relax();
+    }
+    return s;
+}
+
+/** @brief Ends a read section.
+ *
+ *  @return true if a writer ran since seqlock_read_begin returned token, in
+ *          which case everything read in between must be discarded.
+ */
+static inline bool seqlock_read_retry(const seqlock_t *l, uint32_t token) {
+    // Orders the data loads before the re-check of the counter.
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&((seqlock_t *) l)->seq, memory_order_relaxed) != token;
+}
+
+/** @brief Enters the write side, spinning while another writer is inside.
+ */
+static inline void seqlock_write_lock(seqlock_t *l) {
+    uint32_t s = atomic_load_explicit(&l->seq, memory_order_relaxed);
+    for (;;) {
+        if ((s & 1) == 0
+            && atomic_compare_exchange_weak_explicit(&l->seq, &s, s + 1, memory_order_relaxed,
+                                                     memory_order_relaxed)) {
+            break;
+        }
+        cpu_relax();
+        s = atomic_load_explicit(&l->seq, memory_order_relaxed);
+    }
+    // Keeps the data stores from moving above the odd counter.
+    atomic_thread_fence(memory_order_release);
+}
+
+/** @brief Leaves the write side and publishes the new data.
+ */
+static inline void seqlock_write_unlock(seqlock_t *l) {
+    uint32_t s = atomic_load_explicit(&l->seq, memory_order_relaxed);
+    atomic_store_explicit(&l->seq, s + 1, memory_order_release);
+}
+
+// Copies word by word with relaxed atomic accesses when both pointers are
+// word aligned, and byte by byte otherwise. Plain memcpy would race with the
+// other side.
+#define SEQLOCK_COPY_(dst, src, n, load, store)                                    \
+    do {                                                                           \
+        size_t i_ = 0;                                                             \
+        if ((((uintptr_t) (dst) | (uintptr_t) (src)) & (sizeof(uintptr_t) - 1)) == 0) { \
+            for (; i_ + sizeof(uintptr_t) <= (n); i_ += sizeof(uintptr_t)) {       \
+                uintptr_t w_ = load((const uintptr_t *) ((const char *) (src) + i_)); \
+                store((uintptr_t *) ((char *) (dst) + i_), w_);                    \
+            }                                                                      \
+        }                                                                          \
+        for (; i_ < (n); i_++) {                                                   \
+            unsigned char b_ = load((const unsigned char *) (src) + i_);           \
+            store((unsigned char *) (dst) + i_, b_);                               \
+        }                                                                          \
+    } while (0)
+
+#define SEQLOCK_ATOMIC_LOAD_(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define SEQLOCK_ATOMIC_STORE_(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define SEQLOCK_PLAIN_LOAD_(p) (*(p))
+#define SEQLOCK_PLAIN_STORE_(p, v) (*(p) = (v))
+
+/** @brief Copies n bytes of seqlock-protected data at src into the
+ *         caller's private buffer dst, inside a read section.
+ */
+static inline void seqlock_read_copy(void *dst, const void *src, size_t n) {
+    SEQLOCK_COPY_(dst, src, n, SEQLOCK_ATOMIC_LOAD_, SEQLOCK_PLAIN_STORE_);
+}
+
+/** @brief Copies n bytes from the caller's buffer src into seqlock-protected
+ *         data at dst, between seqlock_write_lock and seqlock_write_unlock.
+ */
+static inline void seqlock_write_copy(void *dst, const void *src, size_t n) {
+    SEQLOCK_COPY_(dst, src, n, SEQLOCK_PLAIN_LOAD_, SEQLOCK_ATOMIC_STORE_);
+}
+
+/** @brief Defines name##_t, a seqlock paired with a value of type, along with
+ *         name##_init, name##_load (a consistent copy out) and name##_store
+ *         (replace the whole value).
+ */
+#define SEQLOCK_DEFINE(name, type)                                                 \
+    typedef struct {                                                               \
+        seqlock_t lock;                                                            \
+        type value;                                                                \
+    } name##_t;                                                                    \
+                                                                                   \
+    static inline void name##_init(name##_t *s, const type *init) {                \
+        seqlock_init(&s->lock);                                                    \
+        memcpy(&s->value, init, sizeof(type));                                     \
+    }                                                                              \
+                                                                                   \
+    static inline void name##_load(const name##_t *s, type *out) {                 \
+        uint32_t token;                                                            \
+        do {                                                                       \
+            token = seqlock_read_begin(&s->lock);                                  \
+            seqlock_read_copy(out, &s->value, sizeof(type));                       \
+        } while (seqlock_read_retry(&s->lock, token));                             \
+    }                                                                              \
+                                                                                   \
+    static inline void name##_store(name##_t *s, const type *in) {                 \
+        seqlock_write_lock(&s->lock);                                              \
+        seqlock_write_copy(&s->value, in, sizeof(type));                           \
+        seqlock_write_unlock(&s->lock);                                            \
+    }
@@ -3,15 +3,7 @@
 #include <pthread.h>
 #include <unistd.h>
 
-// Definitions from your rwlock.c (no header file)
-typedef enum { READERS, WRITERS, N_WAY } PRIORITY;
-typedef struct rwlock rwlock_t;
-rwlock_t *rwlock_new(PRIORITY p, int n);
-void rwlock_delete(rwlock_t **l);
-void reader_lock(rwlock_t *rw);
-void reader_unlock(rwlock_t *rw);
-void writer_lock(rwlock_t *rw);
-void writer_unlock(rwlock_t *rw);
+#include "rwlock.h"
 
 #define NUM_READERS 5
 #define NUM_WRITERS 2
@@ -20,7 +12,7 @@ void *reader_thread(void *arg) {
     rwlock_t *lock = (rwlock_t *)arg;
     reader_lock(lock);
     printf("Reader thread %lu acquired lock\n", pthread_self());
-    sleep(1);  // simulate some read work
+    usleep(100000);  // simulate some read work
     reader_unlock(lock);
     printf("Reader thread %lu released lock\n", pthread_self());
     return NULL;
@@ -30,7 +22,7 @@ void *writer_thread(void *arg) {
     rwlock_t *lock = (rwlock_t *)arg;
     writer_lock(lock);
     printf("Writer thread %lu acquired lock\n", pthread_self());
-    sleep(1);  // simulate some write work
+    usleep(100000);  // simulate some write work
     writer_unlock(lock);
     printf("Writer thread %lu released lock\n", pthread_self());
     return NULL;
@@ -51,12 +43,12 @@ int main(void) {
     // Start writer threads first to ensure there's contention.
     for (int i = 0; i < NUM_WRITERS; i++) {
         pthread_create(&writers[i], NULL, writer_thread, lock);
-        sleep(0.1);  // stagger their start slightly
+        usleep(10000);  // stagger their start slightly
     }
     // Start reader threads.
     for (int i = 0; i < NUM_READERS; i++) {
         pthread_create(&readers[i], NULL, reader_thread, lock);
-        sleep(0.1);  // stagger their start slightly
+        usleep(10000);  // stagger their start slightly
     }
 
     // Join all threads.
@@ -0,0 +1,168 @@
+// Stress test for ebr.c; run it under ThreadSanitizer with `make tsan`.
+//
+// Writers keep replacing nodes in a small shared array and retire the old
+// ones. Readers dereference whatever they find, either inside an epoch
+// critical section or through a hazard pointer held across yields. Freed
+// nodes are poisoned first, so a reader that sees a poisoned node (or a
+// sanitizer report) means something was reclaimed too early. At the end
+// every allocated node must have been freed exactly once.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ebr.h"
+
+#define SLOTS 16
+#define READERS 4
+#define HP_READERS 2
+#define WRITERS 2
+#define WRITES_PER_WRITER 20000
+#define HP_HOLD 64
+
+#define LIVE 0x600dcafeu
+#define DEAD 0xdeadbeefu
+
+typedef struct {
+    _Atomic uint32_t magic;
+    uint64_t value;
+} node_t;
+
+static ebr_t *domain;
+static void *_Atomic slots[SLOTS];
+static atomic_bool done;
+
+static _Atomic uint64_t allocated;
+static _Atomic uint64_t freed;
+static _Atomic uint64_t errors;
+
+static node_t *node_new(uint64_t value) {
+    node_t *n = malloc(sizeof(node_t));
+    if (n == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    atomic_init(&n->magic, LIVE);
+    n->value = value;
+    atomic_fetch_add(&allocated, 1);
+    return n;
+}
+
+static void node_free(void *p) {
+    node_t *n = p;
+    atomic_store(&n->magic, DEAD);
+    atomic_fetch_add(&freed, 1);
+    free(n);
+}
+
+static void check(node_t *n) {
+    if (n != NULL && (atomic_load(&n->magic) != LIVE || n->value == 0)) {
+        atomic_fetch_add(&errors, 1);
+    }
+}
+
+static void *reader(void *arg) {
+    (void) arg;
+    ebr_thread_t *self = ebr_self(domain);
+    unsigned i = 0;
+    while (!atomic_load(&done)) {
+        ebr_enter(self);
+        for (int k = 0; k < 8; k++) {
+            check(atomic_load(&slots[(i + k) % SLOTS]));
+        }
+        ebr_exit(self);
+        i++;
+    }
+    return NULL;
+}
+
+// Holds a reference outside any critical section while yielding, long enough
+// for the node to be replaced, retired and (without the hazard) reclaimed.
+static void *hp_reader(void *arg) {
+    (void) arg;
+    ebr_thread_t *self = ebr_register(domain);
+    unsigned i = 0;
+    while (!atomic_load(&done)) {
+        node_t *n = ebr_protect(self, 0, &slots[i++ % SLOTS]);
+        for (int k = 0; k < HP_HOLD; k++) {
+            sched_yield();
+            check(n);
+        }
+        ebr_clear(self, 0);
+    }
+    ebr_unregister(self);
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    uint64_t id = (uint64_t) (uintptr_t) arg;
+    ebr_thread_t *self = ebr_self(domain);
+    for (uint64_t i = 1; i <= WRITES_PER_WRITER; i++) {
+        node_t *n = node_new(id << 32 | i);
+        node_t *old = atomic_exchange(&slots[(id * 7 + i) % SLOTS], n);
+        if (old != NULL && !ebr_retire(self, old, node_free)) {
+            perror("ebr_retire");
+            exit(1);
+        }
+        if (i % 1024 == 0) {
+            ebr_collect(self);
+        }
+    }
+    return NULL;
+}
+
+static int run(int reclaim_ms) {
+    atomic_store(&allocated, 0);
+    atomic_store(&freed, 0);
+    atomic_store(&errors, 0);
+    atomic_store(&done, false);
+    domain = ebr_new(reclaim_ms);
+    if (domain == NULL) {
+        fprintf(stderr, "ebr_new failed\n");
+        return 1;
+    }
+
+    pthread_t r[READERS + HP_READERS];
+    pthread_t w[WRITERS];
+    for (int i = 0; i < READERS + HP_READERS; i++) {
+        pthread_create(&r[i], NULL, i < READERS ? reader : hp_reader, NULL);
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        pthread_create(&w[i], NULL, writer, (void *) (uintptr_t) (i + 1));
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        pthread_join(w[i], NULL);
+    }
+    atomic_store(&done, true);
+    for (int i = 0; i < READERS + HP_READERS; i++) {
+        pthread_join(r[i], NULL);
+    }
+
+    uint64_t before_delete = atomic_load(&freed);
+    for (int i = 0; i < SLOTS; i++) {
+        node_t *n = atomic_exchange(&slots[i], NULL);
+        if (n != NULL) {
+            node_free(n);
+        }
+    }
+    ebr_delete(&domain);
+
+    uint64_t a = atomic_load(&allocated);
+    uint64_t f = atomic_load(&freed);
+    uint64_t e = atomic_load(&errors);
+    printf("reclaim_ms=%d: allocated %llu, freed %llu (%llu before shutdown), errors %llu\n",
+           reclaim_ms, (unsigned long long) a, (unsigned long long) f,
+           (unsigned long long) before_delete, (unsigned long long) e);
+    return (a != f || e != 0 || before_delete == 0) ? 1 : 0;
+}
+
+int main(void) {
+    int failed = 0;
+    failed |= run(0);
+    failed |= run(5);
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
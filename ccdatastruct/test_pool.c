@@ -0,0 +1,151 @@
+// Stress test for pool.c; run it under ThreadSanitizer with `make tsan`.
+//
+// Producers take objects from a shared pool, stamp them and pass most of
+// them through a queue to consumers, which check the stamp and put them
+// back, so objects keep moving between threads' magazines and the depot.
+// The rest are put back by the producer itself. Every object carries a
+// state word flipped on get and put: a get that returns an object still in
+// use, or a put of one that isn't, means two threads owned it at once. The
+// threads exit after each round, so later rounds run on reused caches.
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "queue.h"
+
+#define ROUNDS 4
+#define PRODUCERS 3
+#define CONSUMERS 3
+#define PER_PRODUCER 20000
+#define KEEP_EVERY 4 // producers put back every 4th object themselves
+#define QUEUE_CAP 64
+
+enum { FREE, LIVE };
+
+typedef struct {
+    _Atomic uint32_t state; // zero in fresh slabs
+    uint32_t owner;
+    uint64_t seq;
+    uint64_t check;
+    char pad[40];
+} obj_t;
+
+static pool_t *pool;
+static queue_t *queue;
+static _Atomic uint64_t n_gets;
+static _Atomic uint64_t n_puts;
+static _Atomic uint64_t errors;
+
+static void fail(const char *what) {
+    printf("%s\n", what);
+    atomic_fetch_add(&errors, 1);
+}
+
+static uint64_t stamp(uint32_t owner, uint64_t seq) {
+    return (seq * 0x9e3779b97f4a7c15ULL) ^ owner;
+}
+
+static void release(obj_t *o) {
+    if (o->check != stamp(o->owner, o->seq)) {
+        fail("object changed while its owner held it");
+    }
+    uint32_t live = LIVE;
+    if (!atomic_compare_exchange_strong(&o->state, &live, FREE)) {
+        fail("put an object that was not in use");
+    }
+    pool_put(pool, o);
+    atomic_fetch_add(&n_puts, 1);
+}
+
+static void *producer(void *arg) {
+    uint32_t owner = (uint32_t) (uintptr_t) arg;
+    for (uint64_t i = 0; i < PER_PRODUCER; i++) {
+        obj_t *o = pool_get(pool);
+        if (o == NULL) {
+            fail("pool_get failed");
+            break;
+        }
+        atomic_fetch_add(&n_gets, 1);
+        if ((uintptr_t) o % alignof(max_align_t) != 0) {
+            fail("object is misaligned");
+        }
+        uint32_t free_state = FREE;
+        if (!atomic_compare_exchange_strong(&o->state, &free_state, LIVE)) {
+            fail("got an object that was still in use");
+            continue;
+        }
+        o->owner = owner;
+        o->seq = i;
+        o->check = stamp(owner, i);
+        if (i % KEEP_EVERY == 0) {
+            release(o);
+        } else if (!queue_push(queue, o)) {
+            fail("push failed");
+            release(o);
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    (void) arg;
+    void *o;
+    while (queue_pop(queue, &o)) {
+        release(o);
+    }
+    return NULL;
+}
+
+static void run_round(void) {
+    queue = queue_new(QUEUE_CAP);
+    if (queue == NULL) {
+        perror("queue_new");
+        exit(1);
+    }
+    pthread_t p[PRODUCERS];
+    pthread_t c[CONSUMERS];
+    for (int i = 0; i < CONSUMERS; i++) {
+        pthread_create(&c[i], NULL, consumer, NULL);
+    }
+    for (int i = 0; i < PRODUCERS; i++) {
+        pthread_create(&p[i], NULL, producer, (void *) (uintptr_t) i);
+    }
+    for (int i = 0; i < PRODUCERS; i++) {
+        pthread_join(p[i], NULL);
+    }
+    queue_close(queue);
+    for (int i = 0; i < CONSUMERS; i++) {
+        pthread_join(c[i], NULL);
+    }
+    queue_delete(&queue);
+}
+
+int main(void) {
+    alarm(120);
+    pool = pool_new(sizeof(obj_t));
+    if (pool == NULL) {
+        perror("pool_new");
+        return 1;
+    }
+    for (int r = 0; r < ROUNDS; r++) {
+        run_round();
+    }
+    uint64_t g = atomic_load(&n_gets);
+    uint64_t p = atomic_load(&n_puts);
+    if (g != (uint64_t) ROUNDS * PRODUCERS * PER_PRODUCER || p != g) {
+        fail("gets and puts don't add up");
+    }
+    pool_delete(&pool);
+    printf("%llu objects through %d producers and %d consumers\n", (unsigned long long) g,
+           PRODUCERS, CONSUMERS);
+    uint64_t e = atomic_load(&errors);
+    printf("%s\n", e != 0 ? "FAIL" : "PASS");
+    return e != 0;
+}
@@ -0,0 +1,149 @@
+// Stress test for queue.c; run it under ThreadSanitizer with `make tsan`.
+//
+// Small capacities are where the ring's slot sequence numbers wrap fastest,
+// and a capacity of 1 used to accept a second element on top of the first
+// and then hang the next pop. Single-threaded checks pin down exact
+// capacity, then producers and consumers pass numbered elements through
+// queues of capacity 1 to 3; every element must come out exactly once and
+// the occupancy must never exceed the capacity. An alarm turns a hang into
+// a failure.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "queue.h"
+
+#define PRODUCERS 3
+#define CONSUMERS 3
+#define PER_PRODUCER 20000
+#define TOTAL (PRODUCERS * PER_PRODUCER)
+
+static queue_t *queue;
+static _Atomic uint8_t seen[TOTAL + 1];
+static _Atomic uint64_t errors;
+static int capacity;
+
+static void fail(const char *what, int cap) {
+    printf("capacity %d: %s\n", cap, what);
+    atomic_fetch_add(&errors, 1);
+}
+
+// Fills a queue, checks that it refuses one more, then empties it in order.
+static void check_exact(int cap) {
+    queue_t *q = queue_new(cap);
+    if (q == NULL) {
+        fail("queue_new failed", cap);
+        return;
+    }
+    for (int round = 0; round < 3 * cap + 3; round++) {
+        for (int i = 0; i < cap; i++) {
+            if (!queue_try_push(q, (void *) (uintptr_t) (i + 1))) {
+                fail("try_push failed below capacity", cap);
+            }
+        }
+        if (queue_try_push(q, (void *) (uintptr_t) 99)) {
+            fail("try_push succeeded on a full queue", cap);
+        }
+        void *batch[4] = {(void *) 1, (void *) 2, (void *) 3, (void *) 4};
+        for (int i = 0; i < cap; i++) {
+            void *e = NULL;
+            if (!queue_try_pop(q, &e) || e != (void *) (uintptr_t) (i + 1)) {
+                fail("try_pop lost or reordered an element", cap);
+            }
+        }
+        void *e = NULL;
+        if (queue_try_pop(q, &e)) {
+            fail("try_pop succeeded on an empty queue", cap);
+        }
+        // A batch never takes more than the free room.
+        if (queue_push_many(q, batch, 4) != (cap < 4 ? cap : 4)) {
+            fail("push_many overfilled the queue", cap);
+        }
+        while (queue_try_pop(q, &e)) {
+        }
+    }
+    queue_stats_t st;
+    queue_stats_snapshot(q, &st);
+    if (st.capacity != (uint64_t) cap) {
+        fail("stats report the wrong capacity", cap);
+    }
+    queue_delete(&q);
+}
+
+static void *producer(void *arg) {
+    uintptr_t base = (uintptr_t) arg * PER_PRODUCER;
+    for (uintptr_t i = 1; i <= PER_PRODUCER; i++) {
+        if (!queue_push(queue, (void *) (base + i))) {
+            fail("push failed", capacity);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    (void) arg;
+    void *e;
+    while (queue_pop(queue, &e)) {
+        uintptr_t v = (uintptr_t) e;
+        if (v == 0 || v > TOTAL || atomic_fetch_add(&seen[v], 1) != 0) {
+            fail("element popped twice or out of range", capacity);
+        }
+        queue_stats_t st;
+        queue_stats_snapshot(queue, &st);
+        if (st.occupancy > (uint64_t) capacity) {
+            fail("occupancy above capacity", capacity);
+        }
+    }
+    return NULL;
+}
+
+static void run(int cap) {
+    capacity = cap;
+    for (int i = 0; i <= TOTAL; i++) {
+        atomic_store(&seen[i], 0);
+    }
+    queue = queue_new(cap);
+    pthread_t p[PRODUCERS];
+    pthread_t c[CONSUMERS];
+    for (int i = 0; i < CONSUMERS; i++) {
+        pthread_create(&c[i], NULL, consumer, NULL);
+    }
+    for (int i = 0; i < PRODUCERS; i++) {
+        pthread_create(&p[i], NULL, producer, (void *) (uintptr_t) i);
+    }
+    for (int i = 0; i < PRODUCERS; i++) {
+        pthread_join(p[i], NULL);
+    }
+    queue_close(queue);
+    for (int i = 0; i < CONSUMERS; i++) {
+        pthread_join(c[i], NULL);
+    }
+    int missing = 0;
+    for (int i = 1; i <= TOTAL; i++) {
+        missing += atomic_load(&seen[i]) == 0;
+    }
+    if (missing != 0) {
+        fail("elements lost", cap);
+    }
+    printf("capacity %d: %d elements through %d producers and %d consumers\n", cap, TOTAL,
+           PRODUCERS, CONSUMERS);
+    queue_delete(&queue);
+}
+
+int main(void) {
+    alarm(120);
+    for (int cap = 1; cap <= 5; cap++) {
+        check_exact(cap);
+    }
+    for (int cap = 1; cap <= 3; cap++) {
+        run(cap);
+    }
+    uint64_t e = atomic_load(&errors);
+    printf("%s\n", e != 0 ? "FAIL" : "PASS");
+    return e != 0;
+}
@@ -0,0 +1,211 @@
+// Stress test for rwlock.c; run it under ThreadSanitizer with `make tsan`.
+//
+// For every priority policy, with both rwlock_new and rwlock_new_distributed,
+// readers and writers hammer one lock. Each side counts itself in and out:
+// a writer must find no other writer and no reader inside, and a reader
+// must find no writer. Writers also update two plain words that readers
+// compare, so a missing happens-before edge shows up as a race under TSan.
+//
+// PHASE_FAIR is then driven through a fixed arrival order: a reader holds
+// the lock, writer W1 arrives, reader R2 arrives, writer W2 arrives. R2 and
+// W2 must stay out while the first reader holds, and once it leaves the lock
+// must go to W1, then R2 (a reader waits for at most one writer), then W2.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rwlock.h"
+
+#define READERS_N 4
+#define WRITERS_N 4
+#define READ_ITERS 20000
+#define WRITE_ITERS 5000
+#define N_WAY_N 3
+#define SETTLE_MS 50 // long enough for a thread to block in the lock
+
+static rwlock_t *lock;
+static _Atomic int readers_in;
+static _Atomic int writers_in;
+static uint64_t a, b; // written only under the write lock
+static _Atomic uint64_t errors;
+
+static const char *const names[] = { "READERS", "WRITERS", "N_WAY", "PHASE_FAIR" };
+
+static void fail(const char *what) {
+    printf("%s\n", what);
+    atomic_fetch_add(&errors, 1);
+}
+
+static void *reader(void *arg) {
+    (void) arg;
+    for (int i = 0; i < READ_ITERS; i++) {
+        reader_lock(lock);
+        atomic_fetch_add(&readers_in, 1);
+        if (atomic_load(&writers_in) != 0) {
+            fail("reader inside with a writer");
+        }
+        if (a != b) {
+            fail("reader saw a half-done write");
+        }
+        atomic_fetch_sub(&readers_in, 1);
+        reader_unlock(lock);
+    }
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    (void) arg;
+    for (int i = 0; i < WRITE_ITERS; i++) {
+        writer_lock(lock);
+        if (atomic_fetch_add(&writers_in, 1) != 0) {
+            fail("two writers inside");
+        }
+        if (atomic_load(&readers_in) != 0) {
+            fail("writer inside with a reader");
+        }
+        a++;
+        b++;
+        atomic_fetch_sub(&writers_in, 1);
+        writer_unlock(lock);
+    }
+    return NULL;
+}
+
+static void run_exclusion(PRIORITY p, int distributed) {
+    lock = distributed ? rwlock_new_distributed(p, N_WAY_N) : rwlock_new(p, N_WAY_N);
+    if (lock == NULL) {
+        perror("rwlock_new");
+        exit(1);
+    }
+    a = b = 0;
+    pthread_t r[READERS_N];
+    pthread_t w[WRITERS_N];
+    for (int i = 0; i < READERS_N; i++) {
+        pthread_create(&r[i], NULL, reader, NULL);
+    }
+    for (int i = 0; i < WRITERS_N; i++) {
+        pthread_create(&w[i], NULL, writer, NULL);
+    }
+    for (int i = 0; i < READERS_N; i++) {
+        pthread_join(r[i], NULL);
+    }
+    for (int i = 0; i < WRITERS_N; i++) {
+        pthread_join(w[i], NULL);
+    }
+    if (a != (uint64_t) WRITERS_N * WRITE_ITERS) {
+        fail("lost writes");
+    }
+    rwlock_delete(&lock);
+    printf("%-10s %-11s %d reads, %d writes\n", names[p], distributed ? "distributed" : "central",
+           READERS_N * READ_ITERS, WRITERS_N * WRITE_ITERS);
+}
+
+// The ordering check: each thread records when it got the lock, then holds
+// it until main lets it go.
+typedef struct {
+    int is_writer;
+    _Atomic int order; // 0 until the lock is held, then its position
+    _Atomic int release;
+} actor_t;
+
+static _Atomic int next_order;
+
+static void settle(void) {
+    struct timespec ts = { 0, SETTLE_MS * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+static void *actor(void *arg) {
+    actor_t *t = arg;
+    if (t->is_writer) {
+        writer_lock(lock);
+    } else {
+        reader_lock(lock);
+    }
+    atomic_store(&t->order, atomic_fetch_add(&next_order, 1) + 1);
+    while (!atomic_load(&t->release)) {
+        settle();
+    }
+    if (t->is_writer) {
+        writer_unlock(lock);
+    } else {
+        reader_unlock(lock);
+    }
+    return NULL;
+}
+
+static void start(pthread_t *th, actor_t *t, int is_writer) {
+    t->is_writer = is_writer;
+    atomic_store(&t->order, 0);
+    atomic_store(&t->release, 0);
+    pthread_create(th, NULL, actor, t);
+    settle();
+}
+
+static void wait_held(actor_t *t) {
+    for (int i = 0; i < 1000 && atomic_load(&t->order) == 0; i++) {
+        settle();
+    }
+}
+
+static void run_phase_fair(int distributed) {
+    lock = distributed ? rwlock_new_distributed(PHASE_FAIR, 0) : rwlock_new(PHASE_FAIR, 0);
+    if (lock == NULL) {
+        perror("rwlock_new");
+        exit(1);
+    }
+    atomic_store(&next_order, 0);
+    enum { R1, W1, R2, W2, ACTORS };
+    static const char *const actor_names[] = { "R1", "W1", "R2", "W2" };
+    actor_t t[ACTORS];
+    pthread_t th[ACTORS];
+    start(&th[R1], &t[R1], 0);
+    start(&th[W1], &t[W1], 1);
+    start(&th[R2], &t[R2], 0);
+    start(&th[W2], &t[W2], 1);
+    if (atomic_load(&t[R1].order) != 1 || atomic_load(&t[W1].order) != 0
+        || atomic_load(&t[R2].order) != 0 || atomic_load(&t[W2].order) != 0) {
+        fail("PHASE_FAIR: a reader got past a waiting writer");
+    }
+    // Let each holder go in turn; the next one in line must be the only
+    // one to get in.
+    int expect[] = { W1, R2, W2 };
+    int holder = R1;
+    for (int i = 0; i < 3; i++) {
+        atomic_store(&t[holder].release, 1);
+        wait_held(&t[expect[i]]);
+        if (atomic_load(&t[expect[i]].order) != i + 2) {
+            printf("PHASE_FAIR: %s got the lock out of order\n", actor_names[expect[i]]);
+            atomic_fetch_add(&errors, 1);
+        }
+        holder = expect[i];
+    }
+    atomic_store(&t[holder].release, 1);
+    for (int i = 0; i < ACTORS; i++) {
+        atomic_store(&t[i].release, 1);
+        pthread_join(th[i], NULL);
+    }
+    rwlock_delete(&lock);
+    printf("%-10s %-11s arrival order R1 W1 R2 W2\n", "PHASE_FAIR",
+           distributed ? "distributed" : "central");
+}
+
+int main(void) {
+    alarm(120);
+    for (int p = READERS; p <= PHASE_FAIR; p++) {
+        for (int d = 0; d <= 1; d++) {
+            run_exclusion((PRIORITY) p, d);
+        }
+    }
+    for (int d = 0; d <= 1; d++) {
+        run_phase_fair(d);
+    }
+    uint64_t e = atomic_load(&errors);
+    printf("%s\n", e != 0 ? "FAIL" : "PASS");
+    return e != 0;
+}
@@ -0,0 +1,124 @@
+// Stress test for wsched.c; run it under ThreadSanitizer with `make tsan`.
+//
+// Each round builds binary trees of tasks with wsched_spawn, some rooted in
+// wsched_submit calls from several outside threads, and checks after
+// wsched_wait that every node ran exactly once. Between rounds the pool is
+// left idle long enough for its workers to park, and then woken by a single
+// submit that grows a chain of spawns, so a lost wakeup hangs the test; an
+// alarm turns that into a failure. Finally wsched_delete must finish tasks
+// still outstanding.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "wsched.h"
+
+#define DEPTH 10 // each tree has 2^(DEPTH+1) - 1 nodes
+#define NODES ((1 << (DEPTH + 1)) - 1)
+#define SUBMITTERS 3
+#define TREES_PER_SUBMITTER 4
+#define CHAIN 64
+#define ROUNDS 5
+#define IDLE_US 20000 // long enough for idle workers to park
+
+static wsched_t *sched;
+static _Atomic uint64_t nodes_run;
+static _Atomic uint64_t errors;
+
+static void fail(const char *what, int nworkers) {
+    printf("%d workers: %s\n", nworkers, what);
+    atomic_fetch_add(&errors, 1);
+}
+
+// A tree node carries its remaining depth in the argument.
+static void tree_node(void *arg) {
+    uintptr_t depth = (uintptr_t) arg;
+    atomic_fetch_add(&nodes_run, 1);
+    if (depth > 0) {
+        if (!wsched_spawn(sched, tree_node, (void *) (depth - 1))
+            || !wsched_spawn(sched, tree_node, (void *) (depth - 1))) {
+            fail("wsched_spawn failed", -1);
+        }
+    }
+}
+
+// Each link spawns the next, so only one task is runnable at a time and the
+// other workers go idle while it runs.
+static void chain_link(void *arg) {
+    uintptr_t left = (uintptr_t) arg;
+    atomic_fetch_add(&nodes_run, 1);
+    if (left > 1 && !wsched_spawn(sched, chain_link, (void *) (left - 1))) {
+        fail("wsched_spawn failed", -1);
+    }
+}
+
+static void *submitter(void *arg) {
+    (void) arg;
+    for (int i = 0; i < TREES_PER_SUBMITTER; i++) {
+        if (!wsched_submit(sched, tree_node, (void *) (uintptr_t) DEPTH)) {
+            fail("wsched_submit failed", -1);
+        }
+    }
+    return NULL;
+}
+
+static void check(uint64_t want, const char *what, int nworkers) {
+    uint64_t got = atomic_exchange(&nodes_run, 0);
+    if (got != want) {
+        printf("%d workers: %s ran %llu tasks, want %llu\n", nworkers, what,
+               (unsigned long long) got, (unsigned long long) want);
+        atomic_fetch_add(&errors, 1);
+    }
+}
+
+static void run(int nworkers) {
+    sched = wsched_new(nworkers);
+    if (sched == NULL) {
+        fail("wsched_new failed", nworkers);
+        return;
+    }
+    for (int round = 0; round < ROUNDS; round++) {
+        // Trees rooted both here and in outside threads.
+        pthread_t t[SUBMITTERS];
+        for (int i = 0; i < SUBMITTERS; i++) {
+            pthread_create(&t[i], NULL, submitter, NULL);
+        }
+        wsched_submit(sched, tree_node, (void *) (uintptr_t) DEPTH);
+        for (int i = 0; i < SUBMITTERS; i++) {
+            pthread_join(t[i], NULL);
+        }
+        wsched_wait(sched);
+        check((uint64_t) (SUBMITTERS * TREES_PER_SUBMITTER + 1) * NODES, "trees", nworkers);
+
+        // Let every worker park, then wake the pool with one task.
+        usleep(IDLE_US);
+        wsched_submit(sched, chain_link, (void *) (uintptr_t) CHAIN);
+        wsched_wait(sched);
+        check(CHAIN, "chain", nworkers);
+
+        // Waiting on an idle pool returns at once.
+        wsched_wait(sched);
+    }
+    // Outside threads' spawns fall back to submit; delete finishes them.
+    wsched_spawn(sched, tree_node, (void *) (uintptr_t) DEPTH);
+    wsched_delete(&sched);
+    check(NODES, "delete", nworkers);
+    if (sched != NULL) {
+        fail("wsched_delete left the pointer set", nworkers);
+    }
+    printf("%d workers: %d rounds\n", nworkers, ROUNDS);
+}
+
+int main(void) {
+    alarm(120);
+    for (int n = 1; n <= 4; n *= 2) {
+        run(n);
+    }
+    uint64_t e = atomic_load(&errors);
+    printf("%s\n", e != 0 ? "FAIL" : "PASS");
+    return e != 0;
+}
@@ -0,0 +1,398 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "futex.h"
+#include "queue.h"
+#include "wsched.h"
+
+// Initial capacity of each worker's deque; it doubles whenever it fills.
+#define DEQUE_INITIAL 256
+
+// Capacity of the shared queue used by wsched_submit from outside the pool.
+#define INJECT_SIZE 4096
+
+// Number of failed search rounds before an idle worker parks.
+#define WSCHED_SPIN 64
+
+typedef struct {
+    wsched_task_fn fn;
+    void *arg;
+} task_t;
+
+// A deque's circular buffer. Arrays replaced by a resize are chained through
+// prev and only freed with the scheduler, since a thief may still be reading
+// from one.
+typedef struct array {
+    int64_t size;
+    struct array *prev;
+    _Atomic(task_t *) buf[];
+} array_t;
+
+// Chase-Lev deque, using the C11 orderings from Le et al., "Correct and
+// Efficient Work-Stealing for Weak Memory Models" (PPoPP '13). Only the
+// owning worker pushes and takes at the bottom; thieves CAS the top.
+typedef struct {
+    alignas(CACHE_LINE) _Atomic int64_t top;
+    alignas(CACHE_LINE) _Atomic int64_t bottom;
+    _Atomic(array_t *) array;
+} deque_t;
+
+typedef struct {
+    deque_t dq;
+    wsched_t *sched;
+    pthread_t thread;
+    uint64_t rng;
+
+    // Written only by the owning worker, read by wsched_wait.
+    alignas(CACHE_LINE) _Atomic uint64_t spawned;
+    _Atomic uint64_t completed;
+} worker_t;
+
+struct wsched {
+    worker_t *workers;
+    int nworkers;
+    queue_t *inject;
+    _Atomic bool stop;
+
+    alignas(CACHE_LINE) _Atomic uint64_t submitted;
+
+    // Idle workers park on work; wsched_wait parks on idle.
+    alignas(CACHE_LINE) eventcount_t work;
+    eventcount_t idle;
+};
+
+// The worker running on this thread, if any.
+static __thread worker_t *self;
+
+static array_t *array_new(int64_t size) {
+    array_t *a = malloc(sizeof(array_t) + sizeof(_Atomic(task_t *)) * (size_t) size);
+    if (a == NULL) {
+        return NULL;
+    }
+    a->size = size;
+    a->prev = NULL;
+    return a;
+}
+
+static bool deque_init(deque_t *dq) {
+    array_t *a = array_new(DEQUE_INITIAL);
+    if (a == NULL) {
+        return false;
+    }
+    atomic_init(&dq->top, 0);
+    atomic_init(&dq->bottom, 0);
+    atomic_init(&dq->array, a);
+    return true;
+}
+
+static void deque_destroy(deque_t *dq) {
+    array_t *a = atomic_load_explicit(&dq->array, memory_order_relaxed);
+    while (a != NULL) {
+        array_t *prev = a->prev;
+        free(a);
+        a = prev;
+    }
+}
+
+static bool deque_push(deque_t *dq, task_t *t) {
+    int64_t b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&dq->top, memory_order_acquire);
+    array_t *a = atomic_load_explicit(&dq->array, memory_order_relaxed);
+    if (b - top > a->size - 1) {
+        array_t *grown = array_new(a->size * 2);
+        if (grown == NULL) {
+            return false;
+        }
+        for (int64_t i = top; i < b; i++) {
+            task_t *x = atomic_load_explicit(&a->buf[i % a->size], memory_order_relaxed);
+            atomic_store_explicit(&grown->buf[i % grown->size], x, memory_order_relaxed);
+        }
+        grown->prev = a;
+        atomic_store_explicit(&dq->array, grown, memory_order_release);
+        a = grown;
+    }
+    atomic_store_explicit(&a->buf[b % a->size], t, memory_order_relaxed);
+    atomic_store_explicit(&dq->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+static task_t *deque_take(deque_t *dq) {
+    int64_t b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+    array_t *a = atomic_load_explicit(&dq->array, memory_order_relaxed);
+    atomic_store_explicit(&dq->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&dq->top, memory_order_relaxed);
+
+    task_t *x = NULL;
+    if (top <= b) {
+        x = atomic_load_explicit(&a->buf[b % a->size], memory_order_relaxed);
+        if (top == b) {
+            // Last element: race the thieves for it.
+            if (!atomic_compare_exchange_strong_explicit(
+                    &dq->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+                x = NULL;
+            }
+            atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+    }
+    return x;
+}
+
+// Returns the stolen task, NULL if the deque looked empty, or sets *lost when
+// another thread won the race for the top element.
+static task_t *deque_steal(deque_t *dq, bool *lost) {
+    int64_t top = atomic_load_explicit(&dq->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+    *lost = false;
+    if (top >= b) {
+        return NULL;
+    }
+    array_t *a = atomic_load_explicit(&dq->array, memory_order_acquire);
+    task_t *x = atomic_load_explicit(&a->buf[top % a->size], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(
+            &dq->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        *lost = true;
+        return NULL;
+    }
+    return x;
+}
+
+static uint64_t next_random(worker_t *w) {
+    // xorshift64
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+// Tries every other worker once, starting from a random victim.
+static task_t *steal_any(worker_t *w) {
+    wsched_t *s = w->sched;
+    int n = s->nworkers;
+    int start = (int) (next_random(w) % (uint64_t) n);
+    for (int i = 0; i < n; i++) {
+        worker_t *victim = &s->workers[(start + i) % n];
+        if (victim == w) {
+            continue;
+        }
+        bool lost;
+        do {
+            task_t *t = deque_steal(&victim->dq, &lost);
+            if (t != NULL) {
+                return t;
+            }
+        } while (lost);
+    }
+    return NULL;
+}
+
+static task_t *find_task(worker_t *w) {
+    task_t *t = deque_take(&w->dq);
+    if (t != NULL) {
+        return t;
+    }
+    void *elem;
+    if (queue_try_pop(w->sched->inject, &elem)) {
+        return elem;
+    }
+    return steal_any(w);
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    wsched_t *s = w->sched;
+    self = w;
+
+    while (1) {
+        task_t *t = find_task(w);
+        for (int spin = 0; t == NULL && spin < WSCHED_SPIN; spin++) {
+            cpu_relax();
+            t = find_task(w);
+        }
+        if (t == NULL) {
+            // Going idle may mean everything is finished.
+            ec_notify(&s->idle, INT_MAX);
+            uint32_t key = ec_prepare(&s->work);
+            if ((t = find_task(w)) == NULL) {
+                if (atomic_load(&s->stop)) {
+                    ec_cancel(&s->work);
+                    break;
+                }
+                ec_wait(&s->work, key, NULL);
+                continue;
+            }
+            ec_cancel(&s->work);
+        }
+
+        t->fn(t->arg);
+        free(t);
+        uint64_t done = atomic_load_explicit(&w->completed, memory_order_relaxed);
+        atomic_store_explicit(&w->completed, done + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+// True when every task counted as started has also completed. Completions are
+// summed before starts, so a task can never be seen finishing without also
+// being seen starting.
+static bool quiescent(wsched_t *s) {
+    uint64_t completed = 0;
+    uint64_t started = 0;
+    for (int i = 0; i < s->nworkers; i++) {
+        completed += atomic_load_explicit(&s->workers[i].completed, memory_order_acquire);
+    }
+    for (int i = 0; i < s->nworkers; i++) {
+        started += atomic_load_explicit(&s->workers[i].spawned, memory_order_acquire);
+    }
+    started += atomic_load(&s->submitted);
+    return completed == started;
+}
+
+wsched_t *wsched_new(int nworkers) {
+    if (nworkers <= 0) {
+        return NULL;
+    }
+
+    size_t bytes = (sizeof(wsched_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    wsched_t *s = aligned_alloc(CACHE_LINE, bytes);
+    if (s == NULL) {
+        return NULL;
+    }
+    memset(s, 0, sizeof(*s));
+    s->nworkers = nworkers;
+    atomic_init(&s->stop, false);
+    atomic_init(&s->submitted, 0);
+    atomic_init(&s->work.seq, 0);
+    atomic_init(&s->work.waiters, 0);
+    atomic_init(&s->idle.seq, 0);
+    atomic_init(&s->idle.waiters, 0);
+
+    s->inject = queue_new(INJECT_SIZE);
+    s->workers = aligned_alloc(CACHE_LINE, sizeof(worker_t) * (size_t) nworkers);
+    if (s->inject == NULL || s->workers == NULL) {
+        queue_delete(&s->inject);
+        free(s->workers);
+        free(s);
+        return NULL;
+    }
+
+    int started = 0;
+    for (; started < nworkers; started++) {
+        worker_t *w = &s->workers[started];
+        memset(w, 0, sizeof(*w));
+        w->sched = s;
+        w->rng = 0x9e3779b97f4a7c15ULL * (uint64_t) (started + 1);
+        atomic_init(&w->spawned, 0);
+        atomic_init(&w->completed, 0);
+        if (!deque_init(&w->dq)) {
+            break;
+        }
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            deque_destroy(&w->dq);
+            break;
+        }
+    }
+    if (started < nworkers) {
+        atomic_store(&s->stop, true);
+        ec_notify(&s->work, INT_MAX);
+        for (int i = 0; i < started; i++) {
+            pthread_join(s->workers[i].thread, NULL);
+            deque_destroy(&s->workers[i].dq);
+        }
+        queue_delete(&s->inject);
+        free(s->workers);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void wsched_delete(wsched_t **s) {
+    if (s == NULL || *s == NULL) {
+        return;
+    }
+    wsched_t *sched = *s;
+    wsched_wait(sched);
+    atomic_store(&sched->stop, true);
+    ec_notify(&sched->work, INT_MAX);
+    for (int i = 0; i < sched->nworkers; i++) {
+        pthread_join(sched->workers[i].thread, NULL);
+        deque_destroy(&sched->workers[i].dq);
+    }
+    queue_delete(&sched->inject);
+    free(sched->workers);
+    free(sched);
+    *s = NULL;
+}
+
+bool wsched_submit(wsched_t *s, wsched_task_fn fn, void *arg) {
+    if (s == NULL || fn == NULL) {
+        return false;
+    }
+    task_t *t = malloc(sizeof(task_t));
+    if (t == NULL) {
+        return false;
+    }
+    t->fn = fn;
+    t->arg = arg;
+
+    // Count the task before it becomes visible so wsched_wait can never see
+    // it complete first.
+    atomic_fetch_add(&s->submitted, 1);
+    if (!queue_push(s->inject, t)) {
+        atomic_fetch_sub(&s->submitted, 1);
+        free(t);
+        return false;
+    }
+    ec_notify(&s->work, 1);
+    return true;
+}
+
+bool wsched_spawn(wsched_t *s, wsched_task_fn fn, void *arg) {
+    if (s == NULL || fn == NULL) {
+        return false;
+    }
+    worker_t *w = self;
+    if (w == NULL || w->sched != s) {
+        return wsched_submit(s, fn, arg);
+    }
+    task_t *t = malloc(sizeof(task_t));
+    if (t == NULL) {
+        return false;
+    }
+    t->fn = fn;
+    t->arg = arg;
+
+    uint64_t spawned = atomic_load_explicit(&w->spawned, memory_order_relaxed);
+    atomic_store_explicit(&w->spawned, spawned + 1, memory_order_release);
+    if (!deque_push(&w->dq, t)) {
+        atomic_store_explicit(&w->spawned, spawned, memory_order_release);
+        free(t);
+        return false;
+    }
+    ec_notify(&s->work, 1);
+    return true;
+}
+
+void wsched_wait(wsched_t *s) {
+    if (s == NULL) {
+        return;
+    }
+    while (1) {
+        uint32_t key = ec_prepare(&s->idle);
+        if (quiescent(s)) {
+            ec_cancel(&s->idle);
+            return;
+        }
+        ec_wait(&s->idle, key, NULL);
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+/**
+ *  A work-stealing task scheduler.
+ *
+ *  Every worker thread owns a Chase-Lev deque. Tasks a worker spawns go on
+ *  the bottom of its own deque, and idle workers steal from the top of a
+ *  randomly chosen victim's deque, so workers only touch shared state when
+ *  they run out of work. Tasks submitted from outside the pool go through a
+ *  shared queue_t that workers poll when their own deque is empty. Workers
+ *  with nothing to do park on a futex.
+ */
+
+#include <stdbool.h>
+
+typedef struct wsched wsched_t;
+
+typedef void (*wsched_task_fn)(void *arg);
+
+/** @brief Creates a scheduler and starts its worker threads.
+ *
+ *  @param nworkers The number of worker threads; must be positive.
+ *
+ *  @return A pointer to the scheduler, or NULL on failure.
+ */
+wsched_t *wsched_new(int nworkers);
+
+/** @brief Waits for all outstanding tasks, stops the workers and frees the
+ *         scheduler. Sets *s to NULL.
+ */
+void wsched_delete(wsched_t **s);
+
+/** @brief Queues fn(arg) to run on some worker. Safe to call from any
+ *         thread; blocks only if the shared submission queue is full.
+ *
+ *  @return true on success, false if s or fn is NULL or allocation fails.
+ */
+bool wsched_submit(wsched_t *s, wsched_task_fn fn, void *arg);
+
+/** @brief Queues fn(arg) on the calling worker's own deque. Meant for tasks
+ *         that fork more work; falls back to wsched_submit when the caller
+ *         is not one of s's workers.
+ *
+ *  @return true on success, false if s or fn is NULL or allocation fails.
+ */
+bool wsched_spawn(wsched_t *s, wsched_task_fn fn, void *arg);
+
+/** @brief Blocks until every task submitted or spawned so far, and every
+ *         task those spawned, has finished.
+ */
+void wsched_wait(wsched_t *s);
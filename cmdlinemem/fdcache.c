@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+
+#define MAX_NAME 255
+
+typedef struct {
+    fdcache_file_t file; /* first, so a handed-out file converts back */
+    char name[MAX_NAME + 1];
+    int refs; /* guarded by the stripe's mutex; the table holds one */
+} cached_t;
+
+typedef struct {
+    pthread_rwlock_t rw; /* held to open and cache a file, or to replace one */
+    pthread_mutex_t mu;  /* ways, next and refs */
+    cached_t *ways[FDCACHE_WAYS];
+    unsigned next; /* round-robin victim */
+} stripe_t;
+
+struct fdcache {
+    stripe_t stripes[FDCACHE_STRIPES];
+};
+
+static stripe_t *stripe_of(fdcache_t *c, const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *name != '\0'; name++) {
+        h ^= (unsigned char) *name;
+        h *= 0x100000001b3ULL;
+    }
+    return &c->stripes[h % FDCACHE_STRIPES];
+}
+
+/* Called with the stripe's mutex held. */
+static int lookup(stripe_t *s, const char *name) {
+    for (int i = 0; i < FDCACHE_WAYS; i++) {
+        if (s->ways[i] != NULL && strcmp(s->ways[i]->name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Called with the stripe's mutex held. */
+static void unref(cached_t *e) {
+    if (--e->refs == 0) {
+        close(e->file.fd);
+        free(e);
+    }
+}
+
+fdcache_t *fdcache_new(void) {
+    fdcache_t *c = calloc(1, sizeof(fdcache_t));
+    if (c == NULL)
+        return NULL;
+    /* A steady stream of cache misses must not starve a set. */
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < FDCACHE_STRIPES; i++) {
+        pthread_rwlock_init(&c->stripes[i].rw, &attr);
+        pthread_mutex_init(&c->stripes[i].mu, NULL);
+    }
+    pthread_rwlockattr_destroy(&attr);
+    return c;
+}
+
+void fdcache_delete(fdcache_t **c) {
+    if (c == NULL || *c == NULL)
+        return;
+    for (int i = 0; i < FDCACHE_STRIPES; i++) {
+        stripe_t *s = &(*c)->stripes[i];
+        for (int w = 0; w < FDCACHE_WAYS; w++) {
+            if (s->ways[w] != NULL)
+                unref(s->ways[w]);
+        }
+        pthread_rwlock_destroy(&s->rw);
+        pthread_mutex_destroy(&s->mu);
+    }
+    free(*c);
+    *c = NULL;
+}
+
+const fdcache_file_t *fdcache_acquire(fdcache_t *c, const char *name) {
+    if (strlen(name) > MAX_NAME) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    stripe_t *s = stripe_of(c, name);
+    pthread_mutex_lock(&s->mu);
+    int i = lookup(s, name);
+    if (i >= 0) {
+        cached_t *e = s->ways[i];
+        e->refs++;
+        pthread_mutex_unlock(&s->mu);
+        return &e->file;
+    }
+    pthread_mutex_unlock(&s->mu);
+
+    /* Whatever this opens must not be cached after a replace has dropped
+     * the entry, or gets would keep serving the old file. */
+    pthread_rwlock_rdlock(&s->rw);
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    int err = 0;
+    if (fd < 0 || fstat(fd, &st) != 0)
+        err = errno;
+    else if (!S_ISREG(st.st_mode))
+        err = EISDIR;
+    cached_t *e = NULL;
+    if (err == 0 && (e = malloc(sizeof(cached_t))) == NULL)
+        err = ENOMEM;
+    if (err != 0) {
+        if (fd >= 0)
+            close(fd);
+        pthread_rwlock_unlock(&s->rw);
+        errno = err;
+        return NULL;
+    }
+    e->file.fd = fd;
+    e->file.size = (size_t) st.st_size;
+    strcpy(e->name, name);
+    e->refs = 1;
+
+    pthread_mutex_lock(&s->mu);
+    if ((i = lookup(s, name)) >= 0) {
+        /* Another reader cached it first. */
+        cached_t *found = s->ways[i];
+        found->refs++;
+        pthread_mutex_unlock(&s->mu);
+        pthread_rwlock_unlock(&s->rw);
+        close(fd);
+        free(e);
+        return &found->file;
+    }
+    for (i = 0; i < FDCACHE_WAYS && s->ways[i] != NULL; i++) {
+    }
+    if (i == FDCACHE_WAYS) {
+        i = (int) (s->next++ % FDCACHE_WAYS);
+        unref(s->ways[i]);
+    }
+    s->ways[i] = e;
+    e->refs++;
+    pthread_mutex_unlock(&s->mu);
+    pthread_rwlock_unlock(&s->rw);
+    return &e->file;
+}
+
+void fdcache_release(fdcache_t *c, const char *name, const fdcache_file_t *f) {
+    stripe_t *s = stripe_of(c, name);
+    pthread_mutex_lock(&s->mu);
+    unref((cached_t *) f);
+    pthread_mutex_unlock(&s->mu);
+}
+
+int fdcache_replace(fdcache_t *c, const char *tmp, const char *name) {
+    stripe_t *s = stripe_of(c, name);
+    pthread_rwlock_wrlock(&s->rw);
+    int rc = rename(tmp, name);
+    int err = errno;
+    pthread_mutex_lock(&s->mu);
+    int i = lookup(s, name);
+    if (i >= 0) {
+        /* Readers still using the old file keep their references. */
+        unref(s->ways[i]);
+        s->ways[i] = NULL;
+    }
+    pthread_mutex_unlock(&s->mu);
+    pthread_rwlock_unlock(&s->rw);
+    errno = err;
+    return rc;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+/**
+ *  A cache of open read-only file descriptors, keyed by file name, for a
+ *  server that is the only writer of the files it serves.
+ *
+ *  Writers never touch a served file in place: they write a temporary file
+ *  and rename it over the old one with fdcache_replace. A reader keeps
+ *  using the descriptor it was handed, which still refers to the complete
+ *  old file, so a get never sees a half-written set and nobody holds a lock
+ *  while data moves to or from a client.
+ *
+ *  Names hash to one of FDCACHE_STRIPES stripes. Each stripe has a small
+ *  table of cached descriptors with the file size seen when each was
+ *  opened, and a rwlock that keeps a reader from caching a descriptor of
+ *  the old file while a writer replaces it.
+ */
+
+#include <stddef.h>
+
+#define FDCACHE_STRIPES 64
+#define FDCACHE_WAYS    8
+
+typedef struct fdcache fdcache_t;
+
+/** @brief An open file handed out by fdcache_acquire. */
+typedef struct {
+    int fd;
+    size_t size;
+} fdcache_file_t;
+
+/** @brief Creates an empty cache.
+ *
+ *  @return A pointer to the cache, or NULL if allocation fails.
+ */
+fdcache_t *fdcache_new(void);
+
+/** @brief Closes every cached descriptor and frees the cache. Sets *c to
+ *         NULL.
+ */
+void fdcache_delete(fdcache_t **c);
+
+/** @brief Returns name's file, opening it if it isn't cached. The caller
+ *         reads it with offset-based calls (pread, sendfile with an offset)
+ *         and then calls fdcache_release; the descriptor stays valid until
+ *         then even if the file is replaced.
+ *
+ *  @return The file, or NULL with errno set. EISDIR means name is not a
+ *          regular file.
+ */
+const fdcache_file_t *fdcache_acquire(fdcache_t *c, const char *name);
+
+/** @brief Releases a file from fdcache_acquire.
+ */
+void fdcache_release(fdcache_t *c, const char *name, const fdcache_file_t *f);
+
+/** @brief Renames the fully written file tmp over name and drops name's
+ *         cached descriptor, so later gets open the new file.
+ *
+ *  @return 0, or -1 with errno set by rename, in which case tmp is left
+ *          for the caller to remove.
+ */
+int fdcache_replace(fdcache_t *c, const char *tmp, const char *name);
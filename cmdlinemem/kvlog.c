@@ -0,0 +1,579 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "kvlog.h"
+#include "sysio.h"
+
+#define REC_MAGIC   0x314c564bu /* "KVL1" */
+#define PATH_LEN    4096
+
+/* Sealed segments smaller than this aren't worth rewriting unless empty. */
+#define COMPACT_MIN (1u << 20)
+
+/*
+ * A record is this header, the key, the value, and then a CRC-32C of the
+ * key, the value and the header, in that order. The header goes last into
+ * the checksum so a set can fix up val_len after a short payload.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t key_len;
+    uint64_t val_len;
+} rec_hdr_t;
+
+typedef struct {
+    char *key; /* NULL for an empty slot */
+    uint32_t seg;
+    uint64_t off; /* of the record's header */
+    uint64_t val_len;
+} entry_t;
+
+typedef struct {
+    uint32_t id;
+    int fd;
+    uint64_t size;
+    uint64_t live; /* bytes of the records the index points at */
+} seg_t;
+
+/* A live record the compactor is moving to a segment's rewritten file. */
+typedef struct {
+    const char *key;
+    uint64_t off;
+    uint64_t size;
+    uint64_t new_off;
+} move_t;
+
+struct kvlog {
+    char *dir;
+    pthread_mutex_t lock;
+    entry_t *slots; /* open addressing, linear probing; keys are never removed */
+    size_t nslots;
+    size_t count;
+    seg_t *segs; /* sorted by id; the last one takes appends */
+    size_t nsegs;
+    size_t cap_segs;
+    int compact;
+    int compactor_running;
+    int stop;
+    pthread_cond_t wake;
+    pthread_t compactor;
+};
+
+static uint64_t rec_size(uint64_t key_len, uint64_t val_len) {
+    return sizeof(rec_hdr_t) + key_len + val_len + sizeof(uint32_t);
+}
+
+static void seg_path(const kvlog_t *kv, uint32_t id, const char *suffix, char *buf) {
+    snprintf(buf, PATH_LEN, "%s/%08u.seg%s", kv->dir, (unsigned) id, suffix);
+}
+
+static seg_t *seg_find(kvlog_t *kv, uint32_t id) {
+    size_t lo = 0;
+    size_t hi = kv->nsegs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (kv->segs[mid].id == id)
+            return &kv->segs[mid];
+        if (kv->segs[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+static seg_t *seg_active(kvlog_t *kv) {
+    return &kv->segs[kv->nsegs - 1];
+}
+
+/* Ids must be added in increasing order. */
+static seg_t *seg_add(kvlog_t *kv, uint32_t id, int fd) {
+    if (kv->nsegs == kv->cap_segs) {
+        size_t cap = kv->cap_segs ? kv->cap_segs * 2 : 16;
+        seg_t *segs = realloc(kv->segs, cap * sizeof(seg_t));
+        if (segs == NULL)
+            return NULL;
+        kv->segs = segs;
+        kv->cap_segs = cap;
+    }
+    seg_t *s = &kv->segs[kv->nsegs++];
+    s->id = id;
+    s->fd = fd;
+    s->size = 0;
+    s->live = 0;
+    return s;
+}
+
+static int seg_create(kvlog_t *kv, uint32_t id) {
+    char path[PATH_LEN];
+    seg_path(kv, id, "", path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+    if (seg_add(kv, id, fd) == NULL) {
+        close(fd);
+        unlink(path);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static void seg_remove(kvlog_t *kv, seg_t *s) {
+    close(s->fd);
+    size_t i = (size_t) (s - kv->segs);
+    memmove(s, s + 1, (kv->nsegs - i - 1) * sizeof(seg_t));
+    kv->nsegs--;
+}
+
+static void fsync_dir(const kvlog_t *kv) {
+    int fd = open(kv->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *key != '\0'; key++) {
+        h ^= (unsigned char) *key;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Returns key's slot, or the empty slot where it would go. */
+static entry_t *index_find(kvlog_t *kv, const char *key) {
+    size_t mask = kv->nslots - 1;
+    size_t i = (size_t) hash_key(key) & mask;
+    while (kv->slots[i].key != NULL && strcmp(kv->slots[i].key, key) != 0)
+        i = (i + 1) & mask;
+    return &kv->slots[i];
+}
+
+static int index_grow(kvlog_t *kv) {
+    entry_t *old = kv->slots;
+    size_t old_n = kv->nslots;
+    entry_t *slots = calloc(old_n * 2, sizeof(entry_t));
+    if (slots == NULL)
+        return -1;
+    kv->slots = slots;
+    kv->nslots = old_n * 2;
+    for (size_t i = 0; i < old_n; i++) {
+        if (old[i].key != NULL)
+            *index_find(kv, old[i].key) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* Points key at a record in segment seg, moving the old record's bytes
+ * from live to dead. */
+static int index_put(kvlog_t *kv, const char *key, uint32_t seg, uint64_t off,
+                     uint64_t val_len) {
+    if ((kv->count + 1) * 10 > kv->nslots * 7 && index_grow(kv) != 0)
+        return -1;
+    uint64_t key_len = strlen(key);
+    entry_t *e = index_find(kv, key);
+    if (e->key == NULL) {
+        if ((e->key = strdup(key)) == NULL)
+            return -1;
+        kv->count++;
+    } else {
+        seg_t *old = seg_find(kv, e->seg);
+        if (old != NULL)
+            old->live -= rec_size(key_len, e->val_len);
+    }
+    e->seg = seg;
+    e->off = off;
+    e->val_len = val_len;
+    seg_find(kv, seg)->live += rec_size(key_len, val_len);
+    return 0;
+}
+
+/* Indexes every intact record in s, and truncates s after the last one. */
+static int seg_load(kvlog_t *kv, seg_t *s) {
+    struct stat st;
+    if (fstat(s->fd, &st) != 0)
+        return -1;
+    uint64_t end = (uint64_t) st.st_size;
+    uint64_t off = 0;
+    char key[KVLOG_MAX_KEY + 1];
+    char buf[SIO_BUF_SIZE];
+    while (end - off >= rec_size(0, 0)) {
+        rec_hdr_t h;
+        if (sio_pread_full(s->fd, &h, sizeof(h), off) != 0)
+            break;
+        if (h.magic != REC_MAGIC || h.key_len == 0 || h.key_len > KVLOG_MAX_KEY
+            || rec_size(h.key_len, 0) > end - off || h.val_len > end - off - rec_size(h.key_len, 0))
+            break;
+        uint64_t p = off + sizeof(h);
+        if (sio_pread_full(s->fd, key, h.key_len, p) != 0)
+            break;
+        key[h.key_len] = '\0';
+        uint32_t crc = crc32c(0, key, h.key_len);
+        p += h.key_len;
+        uint64_t left = h.val_len;
+        while (left > 0) {
+            size_t n = (left < sizeof(buf)) ? (size_t) left : sizeof(buf);
+            if (sio_pread_full(s->fd, buf, n, p) != 0)
+                break;
+            crc = crc32c(crc, buf, n);
+            p += n;
+            left -= n;
+        }
+        crc = crc32c(crc, &h, sizeof(h));
+        uint32_t stored;
+        if (left > 0 || sio_pread_full(s->fd, &stored, sizeof(stored), p) != 0 || stored != crc
+            || strlen(key) != h.key_len)
+            break;
+        if (index_put(kv, key, s->id, off, h.val_len) != 0)
+            return -1;
+        off = p + sizeof(stored);
+    }
+    if (off < end && ftruncate(s->fd, (off_t) off) != 0)
+        return -1;
+    s->size = off;
+    return 0;
+}
+
+static int needs_compaction(kvlog_t *kv, const seg_t *s) {
+    if (s == seg_active(kv))
+        return 0;
+    return s->live == 0 || (s->size >= COMPACT_MIN && s->live * 2 <= s->size);
+}
+
+/* Rewrites sealed segment id with only its live records, or deletes it if
+ * it has none. Appends never go to a sealed segment, so its file can be
+ * read without the lock; the index is only repointed if the key wasn't set
+ * again meanwhile. */
+static int compact_segment(kvlog_t *kv, uint32_t id) {
+    pthread_mutex_lock(&kv->lock);
+    seg_t *s = seg_find(kv, id);
+    int src = s->fd;
+    size_t nmoves = 0;
+    move_t *moves = malloc(kv->count * sizeof(move_t) + 1);
+    if (moves == NULL) {
+        pthread_mutex_unlock(&kv->lock);
+        return -1;
+    }
+    for (size_t i = 0; i < kv->nslots; i++) {
+        entry_t *e = &kv->slots[i];
+        if (e->key != NULL && e->seg == id) {
+            moves[nmoves].key = e->key;
+            moves[nmoves].off = e->off;
+            moves[nmoves].size = rec_size(strlen(e->key), e->val_len);
+            nmoves++;
+        }
+    }
+    char path[PATH_LEN];
+    seg_path(kv, id, "", path);
+    if (nmoves == 0) {
+        unlink(path);
+        seg_remove(kv, s);
+        pthread_mutex_unlock(&kv->lock);
+        free(moves);
+        fsync_dir(kv);
+        return 0;
+    }
+    pthread_mutex_unlock(&kv->lock);
+
+    char tmp[PATH_LEN];
+    seg_path(kv, id, ".tmp", tmp);
+    int dst = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (dst < 0) {
+        free(moves);
+        return -1;
+    }
+    uint64_t size = 0;
+    int rc = 0;
+    for (size_t i = 0; i < nmoves && rc == 0; i++) {
+        moves[i].new_off = size;
+        rc = sio_copy_range(dst, (off_t) size, src, (off_t) moves[i].off, moves[i].size);
+        size += moves[i].size;
+    }
+    if (rc == 0)
+        rc = fsync(dst);
+
+    pthread_mutex_lock(&kv->lock);
+    if (rc == 0)
+        rc = rename(tmp, path);
+    if (rc == 0) {
+        s = seg_find(kv, id);
+        uint64_t live = 0;
+        for (size_t i = 0; i < nmoves; i++) {
+            entry_t *e = index_find(kv, moves[i].key);
+            if (e->seg == id && e->off == moves[i].off) {
+                e->off = moves[i].new_off;
+                live += moves[i].size;
+            }
+        }
+        close(s->fd);
+        s->fd = dst;
+        s->size = size;
+        s->live = live;
+    }
+    pthread_mutex_unlock(&kv->lock);
+    free(moves);
+    if (rc != 0) {
+        close(dst);
+        unlink(tmp);
+        return -1;
+    }
+    fsync_dir(kv);
+    return 0;
+}
+
+static void *compactor_main(void *arg) {
+    kvlog_t *kv = arg;
+    pthread_mutex_lock(&kv->lock);
+    while (!kv->stop && kv->compact) {
+        seg_t *victim = NULL;
+        for (size_t i = 0; i < kv->nsegs && victim == NULL; i++) {
+            if (needs_compaction(kv, &kv->segs[i]))
+                victim = &kv->segs[i];
+        }
+        if (victim == NULL) {
+            pthread_cond_wait(&kv->wake, &kv->lock);
+            continue;
+        }
+        uint32_t id = victim->id;
+        pthread_mutex_unlock(&kv->lock);
+        int rc = compact_segment(kv, id);
+        pthread_mutex_lock(&kv->lock);
+        if (rc != 0)
+            kv->compact = 0; /* don't spin on a failing disk */
+    }
+    pthread_mutex_unlock(&kv->lock);
+    return NULL;
+}
+
+/* Called with the lock held. The thread is only started once some segment
+ * needs it, so short-lived stores never pay for it. */
+static void wake_compactor(kvlog_t *kv) {
+    if (!kv->compact)
+        return;
+    int needed = 0;
+    for (size_t i = 0; i < kv->nsegs && !needed; i++)
+        needed = needs_compaction(kv, &kv->segs[i]);
+    if (!needed)
+        return;
+    if (kv->compactor_running)
+        pthread_cond_signal(&kv->wake);
+    else if (pthread_create(&kv->compactor, NULL, compactor_main, kv) == 0)
+        kv->compactor_running = 1;
+}
+
+static int cmp_id(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Collects the ids of dir's segments, sorted, and removes any rewrite a
+ * crash left behind. */
+static int list_segments(kvlog_t *kv, uint32_t **ids, size_t *n) {
+    DIR *d = opendir(kv->dir);
+    if (d == NULL)
+        return -1;
+    size_t cap = 0;
+    *ids = NULL;
+    *n = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+        if (strspn(name, "0123456789") != 8)
+            continue;
+        if (strcmp(name + 8, ".seg.tmp") == 0) {
+            unlinkat(dirfd(d), name, 0);
+            continue;
+        }
+        if (strcmp(name + 8, ".seg") != 0)
+            continue;
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint32_t *grown = realloc(*ids, cap * sizeof(uint32_t));
+            if (grown == NULL) {
+                closedir(d);
+                return -1;
+            }
+            *ids = grown;
+        }
+        (*ids)[(*n)++] = (uint32_t) strtoul(name, NULL, 10);
+    }
+    closedir(d);
+    qsort(*ids, *n, sizeof(uint32_t), cmp_id);
+    return 0;
+}
+
+kvlog_t *kvlog_open(const char *dir, int compact) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        return NULL;
+    kvlog_t *kv = calloc(1, sizeof(kvlog_t));
+    if (kv == NULL)
+        return NULL;
+    kv->nslots = 1024;
+    kv->dir = strdup(dir);
+    kv->slots = calloc(kv->nslots, sizeof(entry_t));
+    pthread_mutex_init(&kv->lock, NULL);
+    pthread_cond_init(&kv->wake, NULL);
+    if (kv->dir == NULL || kv->slots == NULL) {
+        kvlog_close(&kv);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uint32_t *ids = NULL;
+    size_t n = 0;
+    int rc = list_segments(kv, &ids, &n);
+    for (size_t i = 0; i < n && rc == 0; i++) {
+        char path[PATH_LEN];
+        seg_path(kv, ids[i], "", path);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        seg_t *s = (fd < 0) ? NULL : seg_add(kv, ids[i], fd);
+        if (s == NULL) {
+            if (fd >= 0)
+                close(fd);
+            rc = -1;
+        } else {
+            rc = seg_load(kv, s);
+        }
+    }
+    free(ids);
+    if (rc == 0 && (kv->nsegs == 0 || seg_active(kv)->size >= KVLOG_SEGMENT_MAX))
+        rc = seg_create(kv, kv->nsegs ? seg_active(kv)->id + 1 : 1);
+    if (rc != 0) {
+        int saved = errno;
+        kvlog_close(&kv);
+        errno = saved;
+        return NULL;
+    }
+    kv->compact = compact;
+    pthread_mutex_lock(&kv->lock);
+    wake_compactor(kv);
+    pthread_mutex_unlock(&kv->lock);
+    return kv;
+}
+
+void kvlog_close(kvlog_t **kv) {
+    if (kv == NULL || *kv == NULL)
+        return;
+    kvlog_t *k = *kv;
+    pthread_mutex_lock(&k->lock);
+    k->stop = 1;
+    pthread_cond_signal(&k->wake);
+    pthread_mutex_unlock(&k->lock);
+    if (k->compactor_running)
+        pthread_join(k->compactor, NULL);
+    for (size_t i = 0; k->slots != NULL && i < k->nslots; i++)
+        free(k->slots[i].key);
+    for (size_t i = 0; i < k->nsegs; i++)
+        close(k->segs[i].fd);
+    free(k->slots);
+    free(k->segs);
+    free(k->dir);
+    pthread_cond_destroy(&k->wake);
+    pthread_mutex_destroy(&k->lock);
+    free(k);
+    *kv = NULL;
+}
+
+int kvlog_get(kvlog_t *kv, const char *key, int out_fd, kvlog_len_fn on_len, void *arg) {
+    pthread_mutex_lock(&kv->lock);
+    entry_t *e = index_find(kv, key);
+    if (e->key == NULL) {
+        pthread_mutex_unlock(&kv->lock);
+        errno = ENOENT;
+        return -1;
+    }
+    /* Copy through a dup so a slow reader doesn't hold the lock. The record
+     * stays readable at this offset even if compaction replaces the file. */
+    int fd = dup(seg_find(kv, e->seg)->fd);
+    uint64_t off = e->off + sizeof(rec_hdr_t) + strlen(key);
+    uint64_t len = e->val_len;
+    pthread_mutex_unlock(&kv->lock);
+    if (fd < 0)
+        return -1;
+    int rc = -1;
+    if (on_len != NULL && on_len(arg, (size_t) len) != 0)
+        errno = ECANCELED;
+    else
+        rc = sio_transfer_at(out_fd, fd, (off_t) off, (size_t) len);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return rc;
+}
+
+int kvlog_set(kvlog_t *kv, const char *key, size_t len, kvlog_read_fn fill, void *arg,
+              size_t *consumed) {
+    *consumed = 0;
+    size_t key_len = strlen(key);
+    if (key_len == 0 || key_len > KVLOG_MAX_KEY) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&kv->lock);
+    seg_t *s = seg_active(kv);
+    uint64_t start = s->size;
+    rec_hdr_t h = { REC_MAGIC, (uint32_t) key_len, len };
+    uint64_t p = start + sizeof(h);
+    int rc = -1;
+    if (sio_pwrite_full(s->fd, &h, sizeof(h), start) != 0
+        || sio_pwrite_full(s->fd, key, key_len, p) != 0)
+        goto out;
+    p += key_len;
+    uint32_t crc = crc32c(0, key, key_len);
+    char buf[SIO_BUF_SIZE];
+    while (*consumed < len) {
+        size_t n = (len - *consumed < sizeof(buf)) ? len - *consumed : sizeof(buf);
+        ssize_t rd = fill(arg, buf, n);
+        if (rd < 0)
+            goto out;
+        *consumed += (size_t) rd;
+        if (sio_pwrite_full(s->fd, buf, (size_t) rd, p) != 0)
+            goto out;
+        crc = crc32c(crc, buf, (size_t) rd);
+        p += (uint64_t) rd;
+        if ((size_t) rd < n)
+            break;
+    }
+    if (*consumed < len) {
+        h.val_len = *consumed;
+        if (sio_pwrite_full(s->fd, &h, sizeof(h), start) != 0)
+            goto out;
+    }
+    crc = crc32c(crc, &h, sizeof(h));
+    if (sio_pwrite_full(s->fd, &crc, sizeof(crc), p) != 0)
+        goto out;
+    s->size = p + sizeof(crc);
+    if (index_put(kv, key, s->id, start, h.val_len) != 0) {
+        s->size = start;
+        goto out;
+    }
+    rc = 0;
+    if (s->size >= KVLOG_SEGMENT_MAX)
+        seg_create(kv, s->id + 1); /* on failure, keep appending to this one */
+    wake_compactor(kv);
+out:
+    if (rc != 0) {
+        int saved = errno;
+        if (ftruncate(s->fd, (off_t) start) != 0) {
+            /* the torn record fails its checksum on the next open */
+        }
+        errno = saved;
+    }
+    pthread_mutex_unlock(&kv->lock);
+    return rc;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+/**
+ *  A log-structured key-value store kept in one directory.
+ *
+ *  Values are appended as checksummed records to numbered segment files
+ *  (00000001.seg, ...); a new segment is started once the active one passes
+ *  KVLOG_SEGMENT_MAX. An in-memory hash index, rebuilt by scanning every
+ *  segment on open, maps each key to its latest record. A torn or corrupt
+ *  record ends its segment, which is truncated there.
+ *
+ *  Sealed segments that are at least half dead records can be rewritten
+ *  with only their live records by a background thread.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define KVLOG_MAX_KEY     255
+#define KVLOG_SEGMENT_MAX (64u << 20)
+
+typedef struct kvlog kvlog_t;
+
+/** @brief Supplies up to n bytes of a value into buf.
+ *
+ *  @return The number of bytes supplied, fewer than n only at EOF, or -1.
+ */
+typedef ssize_t (*kvlog_read_fn)(void *arg, char *buf, size_t n);
+
+/** @brief Called with a value's length before the value is written out.
+ *
+ *  @return 0 to go on, or nonzero to abort the get.
+ */
+typedef int (*kvlog_len_fn)(void *arg, size_t len);
+
+/** @brief Opens the store in dir, creating the directory if needed, and
+ *         rebuilds the index from its segments.
+ *
+ *  @param compact If nonzero, dead records are reclaimed in the background.
+ *
+ *  @return A pointer to the store, or NULL with errno set.
+ */
+kvlog_t *kvlog_open(const char *dir, int compact);
+
+/** @brief Stops compaction and frees the store. Sets *kv to NULL.
+ */
+void kvlog_close(kvlog_t **kv);
+
+/** @brief Writes key's value to out_fd, calling on_len (if not NULL) first.
+ *
+ *  @return 0, or -1 with errno set; ENOENT means the key has no value.
+ */
+int kvlog_get(kvlog_t *kv, const char *key, int out_fd, kvlog_len_fn on_len, void *arg);
+
+/** @brief Appends len bytes pulled from fill as key's new value. If fill
+ *         hits EOF early, the bytes it did supply are stored. The store
+ *         stays locked while fill runs, so fill should not wait on a peer.
+ *
+ *  @param consumed Set to the number of bytes taken from fill, also when
+ *         the set fails, so the caller can skip the rest of the value.
+ *
+ *  @return 0, or -1 with errno set.
+ */
+int kvlog_set(kvlog_t *kv, const char *key, size_t len, kvlog_read_fn fill, void *arg,
+              size_t *consumed);
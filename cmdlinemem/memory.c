@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,34 +8,31 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <limits.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "fdcache.h"
+#include "kvlog.h"
+#include "sysio.h"
 
 #define MAX_LINE_LEN 4096
 #define MAX_FILENAME 255
-#define IO_BUF_SIZE  65536
+#define DAEMON_WORKERS 16
+/* A daemon connection idle this long between commands is closed. */
+#define DAEMON_IDLE_MS 5000
+/* Largest value a daemon stores in the log; each set buffers its value. */
+#define DAEMON_MAX_VALUE (64u << 20)
 
-static ssize_t read_line(int fd, char *buf, size_t buf_size) {
-    if (buf_size == 0)
-        return -1;
-    size_t idx = 0;
-    while (1) {
-        char c;
-        ssize_t rd = read(fd, &c, 1);
-        if (rd < 0)
-            return -1;
-        else if (rd == 0)
-            return (idx == 0) ? 0 : -1;
-        else {
-            if (c == '\n') {
-                buf[idx] = '\0';
-                return (ssize_t) idx;
-            }
-            if (idx < buf_size - 1)
-                buf[idx++] = c;
-            else
-                return -1;
-        }
-    }
-}
+/* Buffered stdin and stdout: command lines are parsed out of large reads,
+ * and any payload bytes that arrived with them go out first. */
+static sio_reader_t in = { .fd = STDIN_FILENO };
+static sio_writer_t out = { .fd = STDOUT_FILENO };
 
 static int is_valid_filename(const char *filename) {
     size_t len = strlen(filename);
@@ -52,6 +50,22 @@ static int is_valid_filename(const char *filename) {
     return 1;
 }
 
+/* Set by -l: keys live in this log-structured store instead of as files. */
+static kvlog_t *store;
+
+/* Set by -d; a daemon serving files also caches their descriptors. */
+static int daemon_mode;
+static fdcache_t *cache;
+static int listen_fd = -1;
+static _Atomic int idle_workers; /* daemon workers blocked in accept */
+
+static int is_valid_key(const char *key) {
+    if (store == NULL)
+        return is_valid_filename(key);
+    size_t len = strlen(key);
+    return len > 0 && len <= KVLOG_MAX_KEY && strchr(key, '/') == NULL;
+}
+
 static int parse_content_length(const char *str, size_t *out_len) {
     if (str[0] == '\0')
         return 0;
@@ -66,35 +80,15 @@ static int parse_content_length(const char *str, size_t *out_len) {
     return 1;
 }
 
-static int safe_write(int fd, const char *buf, size_t count) {
-    size_t total_written = 0;
-    while (total_written < count) {
-        ssize_t wr = write(fd, buf + total_written, count - total_written);
-        if (wr < 0)
-            return -1;
-        if (wr == 0)
-            return -1;
-        total_written += (size_t) wr;
-    }
-    return 0;
-}
-
-static ssize_t read_exact(int fd, char *buf, size_t count) {
-    size_t total_read = 0;
-    while (total_read < count) {
-        ssize_t rd = read(fd, buf + total_read, count - total_read);
-        if (rd < 0)
-            return -1;
-        if (rd == 0)
-            break;
-        total_read += (size_t) rd;
-    }
-    return (ssize_t) total_read;
+static ssize_t reader_read(void *arg, char *buf, size_t n) {
+    return sio_read_exact(arg, buf, n);
 }
 
 static int check_for_extra_input_after_get(void) {
+    if (sio_reader_buffered(&in) > 0)
+        return -1;
     char c;
-    ssize_t rd = read(STDIN_FILENO, &c, 1);
+    ssize_t rd = read(in.fd, &c, 1);
     if (rd < 0)
         return -1;
     if (rd > 0)
@@ -103,30 +97,787 @@ static int check_for_extra_input_after_get(void) {
 }
 
 static void print_to_stderr(const char *msg) {
-    safe_write(STDERR_FILENO, msg, strlen(msg));
+    sio_write_full(STDERR_FILENO, msg, strlen(msg));
 }
 
 static void print_to_stdout(const char *msg) {
-    safe_write(STDOUT_FILENO, msg, strlen(msg));
+    sio_write_full(STDOUT_FILENO, msg, strlen(msg));
+}
+
+/*
+ * Batch mode (-b): commands are read from stdin until EOF and executed in
+ * order, each answered on stdout with a framed response:
+ *
+ *   get\n<file>\n             ->  "OK <len>\n" followed by <len> bytes
+ *   set\n<file>\n<len>\n<data> ->  "OK 0\n"
+ *   anything that fails       ->  "ERR <reason>\n"
+ *
+ * A bad command is reported and the next line is read as a new command.
+ * Errors that leave the input out of step (a bad length, or EOF inside a
+ * set payload) are reported and end the batch with status 1.
+ */
+
+static int write_status(sio_writer_t *w, const char *status, size_t len) {
+    return sio_writer_printf(w, "%s %zu\n", status, len);
+}
+
+static int write_error(sio_writer_t *w, const char *reason) {
+    return sio_writer_printf(w, "ERR %s\n", reason);
+}
+
+/* The reason a get failed with err. A missing key is a bad command, as in
+ * single mode. */
+static const char *get_error(int err) {
+    return (err == ENOENT || err == EISDIR) ? "Invalid Command" : "Operation Failed";
+}
+
+/* Moves len bytes of payload from r to fd, or drops them if fd < 0.
+ * Returns 0, -1 on a read error or EOF, or -2 if only the write failed
+ * (the rest of the payload is then dropped, so the input stays in step). */
+static int copy_payload(sio_reader_t *r, int fd, size_t len) {
+    if (fd < 0)
+        return sio_reader_discard(r, len);
+    size_t moved = 0;
+    if (sio_reader_transfer(r, fd, len, &moved) == 0)
+        return (moved == len) ? 0 : -1;
+    return (sio_reader_discard(r, len - moved) == 0) ? -2 : -1;
+}
+
+typedef struct {
+    sio_writer_t *w;
+    int framed;
+} frame_t;
+
+/* kvlog_get writes the value to the descriptor itself, so the header must
+ * be out of the buffer first. */
+static int frame_len(void *arg, size_t len) {
+    frame_t *f = arg;
+    f->framed = 1;
+    return (write_status(f->w, "OK", len) == 0) ? sio_writer_flush(f->w) : -1;
+}
+
+/* Serves a get from a descriptor the daemon's cache keeps open. No lock is
+ * held while it streams: a set meanwhile renames a new file over the name,
+ * and this descriptor still reads the old one to the end. */
+static int cached_get(sio_writer_t *w, const char *filename) {
+    const fdcache_file_t *f = fdcache_acquire(cache, filename);
+    if (f == NULL)
+        return write_error(w, get_error(errno));
+    int rc = write_status(w, "OK", f->size);
+    if (rc == 0)
+        rc = sio_writer_put_file(w, f->fd, 0, f->size);
+    fdcache_release(cache, filename, f);
+    return rc;
+}
+
+/* Returns 0 to continue the batch, -1 if out is gone. */
+static int batch_get(sio_writer_t *w, const char *filename) {
+    if (!is_valid_key(filename))
+        return write_error(w, "Invalid Command");
+    if (store != NULL) {
+        frame_t f = { w, 0 };
+        if (kvlog_get(store, filename, w->fd, frame_len, &f) == 0)
+            return 0;
+        return f.framed ? -1 : write_error(w, get_error(errno));
+    }
+    if (cache != NULL)
+        return cached_get(w, filename);
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return write_error(w, get_error(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return write_error(w, "Operation Failed");
+    }
+    size_t len = (size_t) st.st_size;
+    /* The length is already framed, so a file that shrinks under us is
+     * fatal: the reader could not tell where the next frame starts. */
+    int rc = write_status(w, "OK", len);
+    if (rc == 0)
+        rc = sio_writer_put_file(w, fd, 0, len);
+    close(fd);
+    return rc;
+}
+
+typedef struct {
+    const char *buf;
+    size_t len;
+    size_t pos;
+} membuf_t;
+
+static ssize_t membuf_read(void *arg, char *buf, size_t n) {
+    membuf_t *m = arg;
+    if (n > m->len - m->pos)
+        n = m->len - m->pos;
+    memcpy(buf, m->buf + m->pos, n);
+    m->pos += n;
+    return (ssize_t) n;
+}
+
+/* Stores a value in the log. A daemon reads the whole value off the socket
+ * first, so a slow client can't hold the store's lock, and refuses values
+ * over DAEMON_MAX_VALUE so clients can't make it buffer more. Returns like
+ * copy_payload. */
+static int log_set(sio_reader_t *r, const char *key, size_t len) {
+    size_t moved = 0;
+    int rc;
+    if (!daemon_mode) {
+        rc = kvlog_set(store, key, len, reader_read, r, &moved);
+    } else {
+        if (len > DAEMON_MAX_VALUE)
+            return (sio_reader_discard(r, len) == 0) ? -2 : -1;
+        char *buf = malloc(len ? len : 1);
+        if (buf == NULL)
+            return (sio_reader_discard(r, len) == 0) ? -2 : -1;
+        ssize_t rd = sio_read_exact(r, buf, len);
+        if (rd < 0 || (size_t) rd < len) {
+            free(buf);
+            return -1;
+        }
+        membuf_t m = { buf, len, 0 };
+        rc = kvlog_set(store, key, len, membuf_read, &m, &moved);
+        free(buf);
+        return (rc == 0) ? 0 : -2;
+    }
+    if (rc == 0)
+        return (moved == len) ? 0 : -1;
+    return (sio_reader_discard(r, len - moved) == 0) ? -2 : -1;
+}
+
+/* Creates a file for cached_set under a name no other set is using; O_EXCL
+ * keeps it off anything already there. */
+static int open_temp(char *path, size_t size) {
+    static _Atomic unsigned seq;
+    for (int tries = 0; tries < 100; tries++) {
+        snprintf(path, size, ".memory.%ld.%u", (long) getpid(), atomic_fetch_add(&seq, 1));
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd >= 0 || errno != EEXIST)
+            return fd;
+    }
+    return -1;
+}
+
+/* Stores a file for the daemon. The payload goes to a temporary file with
+ * no lock held, so a slow client only delays itself, and then replaces the
+ * file in one rename. Returns like copy_payload. */
+static int cached_set(sio_reader_t *r, const char *filename, size_t len) {
+    char tmp[64];
+    int fd = open_temp(tmp, sizeof(tmp));
+    int rc = copy_payload(r, fd, len);
+    if (fd < 0)
+        return (rc == 0) ? -2 : rc;
+    if (close(fd) != 0 && rc == 0)
+        rc = -2;
+    if (rc == 0 && fdcache_replace(cache, tmp, filename) != 0)
+        rc = -2;
+    if (rc != 0)
+        unlink(tmp);
+    return rc;
 }
 
-int main(void) {
+/* Returns 0 to continue the batch, -1 if the input is out of step. */
+static int batch_set(sio_reader_t *r, sio_writer_t *w, const char *filename) {
     char line_buf[MAX_LINE_LEN];
-    ssize_t nread = read_line(STDIN_FILENO, line_buf, sizeof(line_buf));
+    size_t content_length = 0;
+    if (sio_read_line(r, line_buf, sizeof(line_buf)) <= 0
+        || !parse_content_length(line_buf, &content_length)) {
+        write_error(w, "Invalid Command");
+        return -1;
+    }
+    int valid = is_valid_key(filename);
+    int fd = -1;
+    int rc;
+    if (valid && store != NULL) {
+        rc = log_set(r, filename, content_length);
+        fd = 0;
+    } else if (valid && cache != NULL) {
+        rc = cached_set(r, filename, content_length);
+        fd = 0;
+    } else {
+        if (valid)
+            fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        rc = copy_payload(r, fd, content_length);
+        if (fd >= 0)
+            close(fd);
+    }
+    if (rc == -1) {
+        write_error(w, "Operation Failed");
+        return -1;
+    }
+    if (!valid)
+        return write_error(w, "Invalid Command");
+    if (fd < 0 || rc < 0)
+        return write_error(w, "Operation Failed");
+    return write_status(w, "OK", 0);
+}
+
+/* Waits for a daemon client's next command. Returns 0 if the connection
+ * should be closed instead: it stayed idle for DAEMON_IDLE_MS, or another
+ * client is waiting and every worker is busy, so holding on to an idle
+ * connection would keep that client out. */
+static int await_command(int fd) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long deadline = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + DAEMON_IDLE_MS;
+    struct pollfd p[2] = { { .fd = fd, .events = POLLIN }, { .fd = listen_fd, .events = POLLIN } };
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long left = deadline - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+        if (left <= 0)
+            return 0;
+        int rc = poll(p, 2, (int) left);
+        if (rc < 0 && errno != EINTR)
+            return 0;
+        if (rc <= 0)
+            continue;
+        if (p[0].revents != 0)
+            return 1;
+        if (atomic_load(&idle_workers) == 0)
+            return 0;
+        /* A free worker is about to accept the new client. */
+        poll(p, 1, 1);
+        if (p[0].revents != 0)
+            return 1;
+    }
+}
+
+static int batch_commands(sio_reader_t *r, sio_writer_t *w) {
+    char cmd[MAX_LINE_LEN];
+    char filename[MAX_LINE_LEN];
+    while (1) {
+        /* EOF is only clean between commands; an empty line is just a bad
+         * command, which sio_read_line alone can't tell apart. */
+        if (sio_reader_buffered(r) == 0) {
+            /* Answer everything so far before waiting for more commands. */
+            if (sio_writer_flush(w) < 0)
+                return 1;
+            if (daemon_mode && !await_command(r->fd))
+                return 0;
+            if (sio_reader_fill(r) == 0)
+                return 0;
+        }
+        ssize_t nread = sio_read_line(r, cmd, sizeof(cmd));
+        if (nread < 0) {
+            write_error(w, "Invalid Command");
+            return 1;
+        }
+        int is_get = strcmp(cmd, "get") == 0;
+        if (!is_get && strcmp(cmd, "set") != 0) {
+            if (write_error(w, "Invalid Command") < 0)
+                return 1;
+            continue;
+        }
+        if (sio_read_line(r, filename, sizeof(filename)) <= 0) {
+            write_error(w, "Invalid Command");
+            return 1;
+        }
+        if ((is_get ? batch_get(w, filename) : batch_set(r, w, filename)) < 0)
+            return 1;
+    }
+}
+
+/* Runs commands from r until EOF, answering each on w. */
+static int run_batch(sio_reader_t *r, sio_writer_t *w) {
+    int rc = batch_commands(r, w);
+    return (sio_writer_flush(w) < 0) ? 1 : rc;
+}
+
+/*
+ * Parallel batches (-b -j N): the main thread parses commands and reads each
+ * set's payload in full, then queues the command on one of N lanes picked
+ * by hashing its key, so commands on the same key still run in order. Each
+ * lane has one worker thread. A writer thread sends responses in submission
+ * order. Workers buffer small responses. A large get, or a get from the
+ * log, is written to out by its worker once the writer gives it the turn;
+ * until then only that worker's lane waits.
+ */
+
+#define PAR_WINDOW     4096         /* commands in flight */
+#define PAR_MAX_BYTES  (64u << 20)  /* set payload bytes in flight */
+#define PAR_INLINE_MAX SIO_BUF_SIZE /* largest get response a worker buffers */
+
+enum { CMD_QUEUED, CMD_DONE, CMD_STREAM, CMD_TURN, CMD_EMITTED };
+
+typedef struct cmd {
+    struct cmd *next;      /* submission order */
+    struct cmd *lane_next;
+    int is_get;
+    int fatal;             /* the last command; the batch then fails */
+    int state;
+    int fd;                /* a large get's file, for its worker to stream */
+    char *key;
+    char *data;            /* a set's payload, or a buffered get's contents */
+    size_t len;
+    size_t cost;           /* payload bytes counted against PAR_MAX_BYTES */
+    char hdr[64];          /* the response line */
+} cmd_t;
+
+typedef struct {
+    cmd_t *head;
+    cmd_t *tail;
+    pthread_cond_t ready;
+} lane_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t progress; /* a command changed state or was emitted */
+    cmd_t *head;             /* every command not yet emitted */
+    cmd_t *tail;
+    size_t inflight;
+    size_t inflight_bytes;
+    lane_t *lanes;
+    int nlanes;
+    int eof;
+    int stopping;
+    int failed;
+    sio_writer_t out; /* the writer thread's, except during a stream's turn */
+} par = { .lock = PTHREAD_MUTEX_INITIALIZER, .progress = PTHREAD_COND_INITIALIZER };
+
+static void cmd_respond(cmd_t *c, const char *line) {
+    snprintf(c->hdr, sizeof(c->hdr), "%s\n", line);
+}
+
+/* Runs c on its worker. Returns 1 if c must be streamed when its turn
+ * comes, or 0 if its response is ready. */
+static int par_exec(cmd_t *c) {
+    if (!is_valid_key(c->key)) {
+        free(c->data);
+        c->data = NULL;
+        cmd_respond(c, "ERR Invalid Command");
+        return 0;
+    }
+    if (!c->is_get) {
+        int ok;
+        if (store != NULL) {
+            membuf_t m = { c->data, c->len, 0 };
+            size_t moved = 0;
+            ok = kvlog_set(store, c->key, c->len, membuf_read, &m, &moved) == 0;
+        } else {
+            int fd = open(c->key, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            ok = fd >= 0 && sio_write_full(fd, c->data, c->len) == 0;
+            if (fd >= 0)
+                ok = (close(fd) == 0) && ok;
+        }
+        free(c->data);
+        c->data = NULL;
+        cmd_respond(c, ok ? "OK 0" : "ERR Operation Failed");
+        return 0;
+    }
+    if (store != NULL)
+        return 1;
+    int fd = open(c->key, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        int err = (fd < 0) ? errno : EIO;
+        if (fd >= 0)
+            close(fd);
+        snprintf(c->hdr, sizeof(c->hdr), "ERR %s\n", get_error(err));
+        return 0;
+    }
+    c->len = (size_t) st.st_size;
+    if (c->len > PAR_INLINE_MAX) {
+        c->fd = fd;
+        return 1;
+    }
+    /* Nothing is framed yet, so a file that changes size is just an error. */
+    size_t got = 0;
+    ssize_t rd = -1;
+    if ((c->data = malloc(c->len + 1)) != NULL) {
+        while ((rd = read(fd, c->data + got, c->len + 1 - got)) > 0 && got + (size_t) rd <= c->len)
+            got += (size_t) rd;
+    }
+    close(fd);
+    if (rd != 0 || got != c->len) {
+        free(c->data);
+        c->data = NULL;
+        c->len = 0;
+        cmd_respond(c, "ERR Operation Failed");
+        return 0;
+    }
+    snprintf(c->hdr, sizeof(c->hdr), "OK %zu\n", c->len);
+    return 0;
+}
+
+/* Writes c's whole response to out, on its worker, during its turn. */
+static int par_stream(cmd_t *c) {
+    if (c->fd < 0) {
+        frame_t f = { &par.out, 0 };
+        if (kvlog_get(store, c->key, par.out.fd, frame_len, &f) == 0)
+            return 0;
+        return f.framed ? -1 : write_error(&par.out, get_error(errno));
+    }
+    int rc = write_status(&par.out, "OK", c->len);
+    if (rc == 0)
+        rc = sio_writer_put_file(&par.out, c->fd, 0, c->len);
+    close(c->fd);
+    return rc;
+}
+
+static void *lane_main(void *arg) {
+    lane_t *lane = arg;
+    pthread_mutex_lock(&par.lock);
+    while (1) {
+        while (lane->head == NULL && !par.stopping)
+            pthread_cond_wait(&lane->ready, &par.lock);
+        cmd_t *c = lane->head;
+        if (c == NULL)
+            break;
+        if ((lane->head = c->lane_next) == NULL)
+            lane->tail = NULL;
+        pthread_mutex_unlock(&par.lock);
+        int stream = par_exec(c);
+        pthread_mutex_lock(&par.lock);
+        if (!stream) {
+            c->state = CMD_DONE;
+            pthread_cond_broadcast(&par.progress);
+            continue;
+        }
+        c->state = CMD_STREAM;
+        pthread_cond_broadcast(&par.progress);
+        while (c->state != CMD_TURN)
+            pthread_cond_wait(&par.progress, &par.lock);
+        int skip = par.failed;
+        pthread_mutex_unlock(&par.lock);
+        int rc = skip ? -1 : par_stream(c);
+        pthread_mutex_lock(&par.lock);
+        if (rc < 0)
+            par.failed = 1;
+        c->state = CMD_EMITTED;
+        pthread_cond_broadcast(&par.progress);
+    }
+    pthread_mutex_unlock(&par.lock);
+    return NULL;
+}
+
+static void *writer_main(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&par.lock);
+    while (1) {
+        cmd_t *c = par.head;
+        /* Flush before waiting, and before handing out the turn. While a
+         * worker has the turn, par.out is its to touch. */
+        if ((c == NULL || c->state == CMD_QUEUED || c->state == CMD_STREAM) && par.out.len > 0) {
+            pthread_mutex_unlock(&par.lock);
+            int rc = sio_writer_flush(&par.out);
+            pthread_mutex_lock(&par.lock);
+            if (rc < 0)
+                par.failed = 1;
+            continue;
+        }
+        if (c == NULL && par.eof)
+            break;
+        if (c == NULL || c->state == CMD_QUEUED || c->state == CMD_TURN) {
+            pthread_cond_wait(&par.progress, &par.lock);
+            continue;
+        }
+        if (c->state == CMD_STREAM) {
+            c->state = CMD_TURN;
+            pthread_cond_broadcast(&par.progress);
+            continue;
+        }
+        if (c->state == CMD_DONE && !par.failed) {
+            pthread_mutex_unlock(&par.lock);
+            int rc = sio_writer_put(&par.out, c->hdr, strlen(c->hdr));
+            if (rc == 0 && c->data != NULL)
+                rc = sio_writer_put(&par.out, c->data, c->len);
+            pthread_mutex_lock(&par.lock);
+            if (rc < 0)
+                par.failed = 1;
+        }
+        if (c->fatal)
+            par.failed = 1;
+        if ((par.head = c->next) == NULL)
+            par.tail = NULL;
+        par.inflight--;
+        par.inflight_bytes -= c->cost;
+        pthread_cond_broadcast(&par.progress);
+        free(c->key);
+        free(c->data);
+        free(c);
+    }
+    pthread_mutex_unlock(&par.lock);
+    return NULL;
+}
+
+/* Waits for room for a command carrying cost payload bytes. A payload
+ * bigger than PAR_MAX_BYTES goes alone. */
+static void par_reserve(size_t cost) {
+    pthread_mutex_lock(&par.lock);
+    while (par.inflight >= PAR_WINDOW
+           || (par.inflight > 0 && par.inflight_bytes + cost > PAR_MAX_BYTES))
+        pthread_cond_wait(&par.progress, &par.lock);
+    par.inflight++;
+    par.inflight_bytes += cost;
+    pthread_mutex_unlock(&par.lock);
+}
+
+/* Queues a reserved command for output and, unless it's already done, on
+ * its key's lane. */
+static void par_submit(cmd_t *c) {
+    pthread_mutex_lock(&par.lock);
+    if (par.tail != NULL)
+        par.tail->next = c;
+    else
+        par.head = c;
+    par.tail = c;
+    if (c->state == CMD_QUEUED) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (const char *k = c->key; *k != '\0'; k++) {
+            h ^= (unsigned char) *k;
+            h *= 0x100000001b3ULL;
+        }
+        lane_t *lane = &par.lanes[h % (uint64_t) par.nlanes];
+        if (lane->tail != NULL)
+            lane->tail->lane_next = c;
+        else
+            lane->head = c;
+        lane->tail = c;
+        pthread_cond_signal(&lane->ready);
+    }
+    pthread_cond_broadcast(&par.progress);
+    pthread_mutex_unlock(&par.lock);
+}
+
+/* Queues an error response that needs no worker. */
+static void par_submit_error(const char *line, int fatal) {
+    cmd_t *c = calloc(1, sizeof(cmd_t));
+    if (c == NULL) {
+        pthread_mutex_lock(&par.lock);
+        par.failed = 1;
+        pthread_mutex_unlock(&par.lock);
+        return;
+    }
+    cmd_respond(c, line);
+    c->state = CMD_DONE;
+    c->fatal = fatal;
+    par_reserve(0);
+    par_submit(c);
+}
+
+/* Reads the commands for run_parallel. Returns when the batch ends. */
+static void par_read(sio_reader_t *r) {
+    char cmd[MAX_LINE_LEN];
+    char filename[MAX_LINE_LEN];
+    char line_buf[MAX_LINE_LEN];
+    while (1) {
+        if (sio_reader_buffered(r) == 0 && sio_reader_fill(r) == 0)
+            return;
+        if (sio_read_line(r, cmd, sizeof(cmd)) < 0) {
+            par_submit_error("ERR Invalid Command", 1);
+            return;
+        }
+        int is_get = strcmp(cmd, "get") == 0;
+        if (!is_get && strcmp(cmd, "set") != 0) {
+            par_submit_error("ERR Invalid Command", 0);
+            continue;
+        }
+        if (sio_read_line(r, filename, sizeof(filename)) <= 0) {
+            par_submit_error("ERR Invalid Command", 1);
+            return;
+        }
+        size_t len = 0;
+        if (!is_get
+            && (sio_read_line(r, line_buf, sizeof(line_buf)) <= 0
+                || !parse_content_length(line_buf, &len))) {
+            par_submit_error("ERR Invalid Command", 1);
+            return;
+        }
+        par_reserve(len);
+        cmd_t *c = calloc(1, sizeof(cmd_t));
+        char *data = is_get ? NULL : malloc(len ? len : 1);
+        ssize_t rd = (is_get || data == NULL) ? 0 : sio_read_exact(r, data, len);
+        if (c == NULL || (c->key = strdup(filename)) == NULL || (!is_get && data == NULL)
+            || rd < 0 || (size_t) rd < len) {
+            if (c != NULL)
+                free(c->key);
+            free(c);
+            free(data);
+            pthread_mutex_lock(&par.lock);
+            par.inflight--;
+            par.inflight_bytes -= len;
+            pthread_mutex_unlock(&par.lock);
+            par_submit_error("ERR Operation Failed", 1);
+            return;
+        }
+        c->is_get = is_get;
+        c->fd = -1;
+        c->data = data;
+        c->len = len;
+        c->cost = len;
+        par_submit(c);
+    }
+}
+
+static int run_parallel(sio_reader_t *r, int out, int nlanes) {
+    sio_writer_init(&par.out, out);
+    par.nlanes = nlanes;
+    par.lanes = calloc((size_t) nlanes, sizeof(lane_t));
+    pthread_t *threads = calloc((size_t) nlanes + 1, sizeof(pthread_t));
+    if (par.lanes == NULL || threads == NULL) {
+        free(par.lanes);
+        free(threads);
+        return run_batch(r, &par.out);
+    }
+    int started = 0;
+    for (; started < nlanes; started++) {
+        pthread_cond_init(&par.lanes[started].ready, NULL);
+        if (pthread_create(&threads[started], NULL, lane_main, &par.lanes[started]) != 0)
+            break;
+    }
+    /* Lanes are picked by key hash over every lane, so all must be running. */
+    int ok = started == nlanes
+             && pthread_create(&threads[nlanes], NULL, writer_main, NULL) == 0;
+    if (ok)
+        par_read(r);
+
+    pthread_mutex_lock(&par.lock);
+    par.eof = 1;
+    pthread_cond_broadcast(&par.progress);
+    pthread_mutex_unlock(&par.lock);
+    if (ok)
+        pthread_join(threads[nlanes], NULL);
+    pthread_mutex_lock(&par.lock);
+    par.stopping = 1;
+    for (int i = 0; i < started; i++)
+        pthread_cond_signal(&par.lanes[i].ready);
+    pthread_mutex_unlock(&par.lock);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(par.lanes);
+    if (!ok) {
+        print_to_stderr("Operation Failed\n");
+        return 1;
+    }
+    return par.failed ? 1 : 0;
+}
+
+/*
+ * Daemon mode (-d PATH): listens on a Unix socket at PATH and runs every
+ * connection as a batch, in the format above, on one of a fixed pool of
+ * worker threads that all block in accept(). Gets of plain files go through
+ * an fdcache, so the daemon assumes nothing else writes the files it serves.
+ */
+
+static void *worker_main(void *arg) {
+    (void) arg;
+    sio_reader_t *r = malloc(sizeof(sio_reader_t));
+    sio_writer_t *w = malloc(sizeof(sio_writer_t));
+    if (r == NULL || w == NULL) {
+        free(r);
+        free(w);
+        return NULL;
+    }
+    while (1) {
+        atomic_fetch_add(&idle_workers, 1);
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        atomic_fetch_sub(&idle_workers, 1);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                usleep(10000);
+                continue;
+            }
+            break;
+        }
+        sio_reader_init(r, fd);
+        sio_writer_init(w, fd);
+        run_batch(r, w);
+        close(fd);
+    }
+    free(r);
+    free(w);
+    return NULL;
+}
+
+static int run_daemon(const char *path, int workers) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        print_to_stderr("Invalid Command\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    /* Take over a socket left by a daemon that died, but not a live one. */
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        close(probe);
+        print_to_stderr("Operation Failed\n");
+        return 1;
+    }
+    if (probe >= 0)
+        close(probe);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+        || listen(listen_fd, SOMAXCONN) != 0) {
+        print_to_stderr("Operation Failed\n");
+        return 1;
+    }
+
+    /* Workers inherit the mask, so only this thread takes the signals. */
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    int started = 0;
+    for (int i = 0; i < workers; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, worker_main, NULL) == 0) {
+            pthread_detach(t);
+            started++;
+        }
+    }
+    if (started == 0) {
+        unlink(path);
+        print_to_stderr("Operation Failed\n");
+        return 1;
+    }
+    int sig;
+    sigwait(&stop, &sig);
+    unlink(path);
+    /* Workers may be mid-request, so leave without tearing down what they
+     * use. Every set is already written; an unfinished one leaves at most a
+     * .memory.* temporary file, and a torn log record is dropped on the
+     * next open. */
+    exit(0);
+}
+
+static int run_single(void) {
+    char line_buf[MAX_LINE_LEN];
+    ssize_t nread = sio_read_line(&in, line_buf, sizeof(line_buf));
     if (nread <= 0) {
         print_to_stderr("Invalid Command\n");
         return 1;
     }
     if (strcmp(line_buf, "get") == 0) {
-        nread = read_line(STDIN_FILENO, line_buf, sizeof(line_buf));
+        nread = sio_read_line(&in, line_buf, sizeof(line_buf));
         if (nread <= 0) {
             print_to_stderr("Invalid Command\n");
             return 1;
         }
-        if (!is_valid_filename(line_buf)) {
+        if (!is_valid_key(line_buf)) {
             print_to_stderr("Invalid Command\n");
             return 1;
         }
+        if (store != NULL) {
+            if (check_for_extra_input_after_get() != 0) {
+                print_to_stderr("Invalid Command\n");
+                return 1;
+            }
+            if (kvlog_get(store, line_buf, STDOUT_FILENO, NULL, NULL) != 0) {
+                print_to_stderr(errno == ENOENT ? "Invalid Command\n" : "Operation Failed\n");
+                return 1;
+            }
+            return 0;
+        }
         struct stat st;
         if (stat(line_buf, &st) != 0) {
             print_to_stderr("Invalid Command\n");
@@ -145,16 +896,8 @@ int main(void) {
             print_to_stderr("Operation Failed\n");
             return 1;
         }
-        char io_buf[IO_BUF_SIZE];
-        ssize_t bytes_read;
-        while ((bytes_read = read(fd, io_buf, IO_BUF_SIZE)) > 0) {
-            if (safe_write(STDOUT_FILENO, io_buf, (size_t) bytes_read) < 0) {
-                print_to_stderr("Operation Failed\n");
-                close(fd);
-                return 1;
-            }
-        }
-        if (bytes_read < 0) {
+        size_t moved = 0;
+        if (sio_transfer(STDOUT_FILENO, fd, SIZE_MAX, &moved) < 0) {
             print_to_stderr("Operation Failed\n");
             close(fd);
             return 1;
@@ -162,7 +905,7 @@ int main(void) {
         close(fd);
         return 0;
     } else if (strcmp(line_buf, "set") == 0) {
-        nread = read_line(STDIN_FILENO, line_buf, sizeof(line_buf));
+        nread = sio_read_line(&in, line_buf, sizeof(line_buf));
         if (nread <= 0) {
             print_to_stderr("Invalid Command\n");
             return 1;
@@ -170,11 +913,11 @@ int main(void) {
         char filename[MAX_LINE_LEN];
         strncpy(filename, line_buf, sizeof(filename));
         filename[sizeof(filename) - 1] = '\0';
-        if (!is_valid_filename(filename)) {
+        if (!is_valid_key(filename)) {
             print_to_stderr("Invalid Command\n");
             return 1;
         }
-        nread = read_line(STDIN_FILENO, line_buf, sizeof(line_buf));
+        nread = sio_read_line(&in, line_buf, sizeof(line_buf));
         if (nread <= 0) {
             print_to_stderr("Invalid Command\n");
             return 1;
@@ -184,47 +927,37 @@ int main(void) {
             print_to_stderr("Invalid Command\n");
             return 1;
         }
-        int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        if (fd < 0) {
-            print_to_stderr("Operation Failed\n");
-            return 1;
-        }
-        size_t remaining = content_length;
-        char io_buf[IO_BUF_SIZE];
-        while (remaining > 0) {
-            size_t chunk_size = (remaining < IO_BUF_SIZE) ? remaining : IO_BUF_SIZE;
-            ssize_t rd = read_exact(STDIN_FILENO, io_buf, chunk_size);
-            if (rd < 0) {
+        int fd = -1;
+        size_t moved = 0;
+        if (store != NULL) {
+            if (kvlog_set(store, filename, content_length, reader_read, &in, &moved) != 0) {
+                print_to_stderr("Operation Failed\n");
+                return 1;
+            }
+        } else {
+            fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0) {
                 print_to_stderr("Operation Failed\n");
-                close(fd);
                 return 1;
             }
-            if (rd == 0)
-                break;
-            if (safe_write(fd, io_buf, (size_t) rd) < 0) {
+            if (sio_reader_transfer(&in, fd, content_length, &moved) < 0) {
                 print_to_stderr("Operation Failed\n");
                 close(fd);
                 return 1;
             }
-            remaining -= (size_t) rd;
-            if ((size_t) rd < chunk_size)
-                break;
         }
+        size_t remaining = content_length - moved;
         if (remaining > 0) {
         } else {
-            char discard[IO_BUF_SIZE];
-            while (1) {
-                ssize_t rd = read(STDIN_FILENO, discard, IO_BUF_SIZE);
-                if (rd < 0) {
-                    print_to_stderr("Operation Failed\n");
+            if (sio_drain(in.fd, SIZE_MAX) < 0) {
+                print_to_stderr("Operation Failed\n");
+                if (fd >= 0)
                     close(fd);
-                    return 1;
-                }
-                if (rd == 0)
-                    break;
+                return 1;
             }
         }
-        close(fd);
+        if (fd >= 0)
+            close(fd);
         print_to_stdout("OK\n");
         return 0;
     } else {
@@ -232,3 +965,56 @@ int main(void) {
         return 1;
     }
 }
+
+static int usage(void) {
+    print_to_stderr("usage: memory [-b|--batch [-j|--jobs N]] [-l|--log DIR] "
+                    "[-d|--daemon SOCKET [-t|--threads N]]\n");
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int batch = 0;
+    int lanes = 1;
+    int workers = DAEMON_WORKERS;
+    const char *log_dir = NULL;
+    const char *sock_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        int has_arg = i + 1 < argc;
+        if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--batch") == 0)
+            batch = 1;
+        else if ((strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--log") == 0) && has_arg)
+            log_dir = argv[++i];
+        else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--daemon") == 0) && has_arg)
+            sock_path = argv[++i];
+        else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) && has_arg)
+            workers = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && has_arg)
+            lanes = atoi(argv[++i]);
+        else
+            return usage();
+    }
+    if (workers <= 0 || lanes <= 0 || (lanes > 1 && !batch))
+        return usage();
+    daemon_mode = sock_path != NULL;
+    /* Only a batch or a daemon lives long enough to be worth compacting in. */
+    if (log_dir != NULL && (store = kvlog_open(log_dir, batch || daemon_mode)) == NULL) {
+        print_to_stderr("Operation Failed\n");
+        return 1;
+    }
+    if (daemon_mode && store == NULL && (cache = fdcache_new()) == NULL) {
+        print_to_stderr("Operation Failed\n");
+        return 1;
+    }
+    int rc;
+    if (daemon_mode)
+        rc = run_daemon(sock_path, workers);
+    else if (batch && lanes > 1)
+        rc = run_parallel(&in, STDOUT_FILENO, lanes);
+    else if (batch)
+        rc = run_batch(&in, &out);
+    else
+        rc = run_single();
+    fdcache_delete(&cache);
+    kvlog_close(&store);
+    return rc;
+}
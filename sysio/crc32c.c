@@ -0,0 +1,84 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#define POLY 0x82f63b78 // reversed Castagnoli polynomial
+
+// table[k][b] is the CRC of byte b followed by k zero bytes.
+static uint32_t table[8][256];
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t n) {
+    while (n >= 8) {
+        // Byte-wise loads keep this endian-neutral; compilers merge them
+        // into one load on little-endian targets.
+        uint32_t lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+                             | (uint32_t) p[3] << 24);
+        uint32_t hi = (uint32_t) p[4] | (uint32_t) p[5] << 8 | (uint32_t) p[6] << 16
+                      | (uint32_t) p[7] << 24;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff]
+              ^ table[4][lo >> 24] ^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff]
+              ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n-- > 0) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+// Built for SSE4.2 on its own, so the rest of the binary still runs on
+// CPUs without it; crc32c() only calls this after checking.
+__attribute__((target("sse4.2"))) static uint32_t crc_hw(uint32_t crc, const unsigned char *p,
+                                                          size_t n) {
+    uint64_t c = crc;
+    while (n >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        n -= 8;
+    }
+    crc = (uint32_t) c;
+    while (n-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#define HAVE_CRC_HW
+static int use_hw;
+#endif
+
+static void init(void) {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t c = b;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+        }
+        table[0][b] = c;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int b = 0; b < 256; b++) {
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    }
+#ifdef HAVE_CRC_HW
+    use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n) {
+    pthread_once(&once, init);
+    crc = ~crc;
+#ifdef HAVE_CRC_HW
+    if (use_hw) {
+        return ~crc_hw(crc, buf, n);
+    }
+#endif
+    return ~crc_sw(crc, buf, n);
+}
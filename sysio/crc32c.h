@@ -0,0 +1,16 @@
+#pragma once
+
+/**
+ *  CRC-32C (Castagnoli), the checksum of iSCSI, ext4 and S3, computed with
+ *  the SSE4.2 crc32 instruction when the CPU has it and with slicing-by-8
+ *  tables otherwise. Either way it runs far faster than the network or
+ *  disk, so hashing a body as it streams past costs nothing noticeable.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief Extends crc over n bytes of buf. Start with 0; the CRC of a
+ *         buffer equals that of its pieces chained in order.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n);
@@ -0,0 +1,515 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sysio.h"
+
+// Largest chunk handed to one sendfile/splice/copy_file_range call.
+#define SIO_MAX_CHUNK (1u << 30)
+
+// Ways to move bytes between two descriptors. The first four are tried in
+// this order; splicing through a pipe is only ever picked up front.
+enum { M_COPY_RANGE, M_SPLICE, M_SENDFILE, M_BUFFERED, M_SPLICE_PIPE };
+
+// Called after EINTR or EAGAIN. Returns 0 to retry the call, or -1 if
+// errno was something else or waiting failed.
+static int retry(int fd, short events) {
+    if (errno == EINTR) {
+        return 0;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        return -1;
+    }
+    struct pollfd p = { .fd = fd, .events = events };
+    while (poll(&p, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EBADF;
+}
+
+static size_t chunk_of(size_t n) {
+    return n < SIO_MAX_CHUNK ? n : SIO_MAX_CHUNK;
+}
+
+ssize_t sio_read_full(int fd, void *buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t rd = read(fd, (char *) buf + done, n - done);
+        if (rd > 0) {
+            done += (size_t) rd;
+        } else if (rd == 0) {
+            break;
+        } else if (retry(fd, POLLIN) != 0) {
+            return -1;
+        }
+    }
+    return (ssize_t) done;
+}
+
+int sio_write_full(int fd, const void *buf, size_t n) {
+    struct iovec iov = { (void *) buf, n };
+    return sio_writev_full(fd, &iov, 1);
+}
+
+int sio_writev_full(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        ssize_t wr = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+        if (wr < 0) {
+            if (retry(fd, POLLOUT) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (wr == 0) {
+            errno = EIO;
+            return -1;
+        }
+        size_t left = (size_t) wr;
+        while (left > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (left > 0) {
+            iov->iov_base = (char *) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+int sio_pread_full(int fd, void *buf, size_t n, off_t off) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t rd = pread(fd, (char *) buf + done, n - done, off + (off_t) done);
+        if (rd > 0) {
+            done += (size_t) rd;
+        } else if (rd == 0) {
+            errno = EIO;
+            return -1;
+        } else if (retry(fd, POLLIN) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int sio_pwrite_full(int fd, const void *buf, size_t n, off_t off) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t wr = pwrite(fd, (const char *) buf + done, n - done, off + (off_t) done);
+        if (wr > 0) {
+            done += (size_t) wr;
+        } else if (wr == 0) {
+            errno = EIO;
+            return -1;
+        } else if (retry(fd, POLLOUT) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int first_method(int out, int in, size_t count) {
+    struct stat in_st;
+    struct stat out_st;
+    if (fstat(in, &in_st) != 0 || fstat(out, &out_st) != 0) {
+        return M_BUFFERED;
+    }
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        return M_COPY_RANGE;
+    }
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        return M_SPLICE;
+    }
+    if (S_ISREG(in_st.st_mode)) {
+        return M_SENDFILE;
+    }
+    // Setting up a pipe costs three system calls; only worth it for bulk.
+    if (S_ISSOCK(in_st.st_mode) && count >= SIO_BUF_SIZE) {
+        return M_SPLICE_PIPE;
+    }
+    return M_BUFFERED;
+}
+
+// Moves bytes from in through the pipe p to out. Bytes that reach the pipe
+// have left in, so they must all reach out: if out turns out not to take a
+// splice (an O_APPEND file, say), they are copied by hand and the rest of
+// the transfer goes buffered. Returns -2 if bytes were lost.
+static ssize_t splice_via(int *method, int out, int in, int p[2], size_t n) {
+    ssize_t got = splice(in, NULL, p[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (got <= 0) {
+        return got;
+    }
+    size_t left = (size_t) got;
+    while (left > 0) {
+        ssize_t wr = splice(p[0], NULL, out, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (wr > 0) {
+            left -= (size_t) wr;
+        } else if (wr < 0 && unsupported(errno)) {
+            *method = M_BUFFERED;
+            char buf[SIO_BUF_SIZE];
+            while (left > 0) {
+                ssize_t rd = read(p[0], buf, left < sizeof(buf) ? left : sizeof(buf));
+                if (rd <= 0 || sio_write_full(out, buf, (size_t) rd) != 0) {
+                    errno = rd == 0 ? EIO : errno;
+                    return -2;
+                }
+                left -= (size_t) rd;
+            }
+        } else if (wr == 0 || retry(out, POLLOUT) != 0) {
+            errno = wr == 0 ? EIO : errno;
+            return -2;
+        }
+    }
+    return got;
+}
+
+static ssize_t move_once(int *method, int out, int in, int p[2], size_t n) {
+    switch (*method) {
+    case M_COPY_RANGE:
+        return copy_file_range(in, NULL, out, NULL, n, 0);
+    case M_SPLICE:
+        return splice(in, NULL, out, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+    case M_SENDFILE:
+        return sendfile(out, in, NULL, n);
+    case M_SPLICE_PIPE:
+        if (p[0] < 0 && pipe2(p, O_CLOEXEC) != 0) {
+            return -1;
+        }
+        return splice_via(method, out, in, p, n);
+    default: {
+        char buf[SIO_BUF_SIZE];
+        ssize_t rd = read(in, buf, n < sizeof(buf) ? n : sizeof(buf));
+        if (rd > 0 && sio_write_full(out, buf, (size_t) rd) != 0) {
+            return -2; // the bytes are gone from in, so there is no retrying
+        }
+        return rd;
+    }
+    }
+}
+
+int sio_transfer(int out, int in, size_t count, size_t *moved) {
+    int method = first_method(out, in, count);
+    int p[2] = { -1, -1 };
+    int started = 0;
+    int rc = 0;
+    *moved = 0;
+    while (*moved < count) {
+        ssize_t wr = move_once(&method, out, in, p, chunk_of(count - *moved));
+        if (wr > 0) {
+            *moved += (size_t) wr;
+            started = 1;
+        } else if (wr == 0) {
+            break;
+        } else if (wr == -1 && !started && method != M_BUFFERED && unsupported(errno)) {
+            method = (method == M_SPLICE_PIPE) ? M_BUFFERED : method + 1;
+        } else if (wr == -2 || retry(in, POLLIN) != 0 || retry(out, POLLOUT) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (p[0] >= 0) {
+        close(p[0]);
+        close(p[1]);
+    }
+    return rc;
+}
+
+int sio_transfer_at(int out, int in, off_t off, size_t count) {
+    while (count > 0) {
+        ssize_t wr = sendfile(out, in, &off, chunk_of(count));
+        if (wr > 0) {
+            count -= (size_t) wr;
+            continue;
+        }
+        if (wr == 0) {
+            errno = EIO;
+            return -1;
+        }
+        if (unsupported(errno)) {
+            break;
+        }
+        if (retry(out, POLLOUT) != 0) {
+            return -1;
+        }
+    }
+    char buf[SIO_BUF_SIZE];
+    while (count > 0) {
+        size_t n = count < sizeof(buf) ? count : sizeof(buf);
+        if (sio_pread_full(in, buf, n, off) != 0 || sio_write_full(out, buf, n) != 0) {
+            return -1;
+        }
+        off += (off_t) n;
+        count -= n;
+    }
+    return 0;
+}
+
+int sio_copy_range(int out, off_t out_off, int in, off_t in_off, size_t count) {
+    loff_t in_pos = in_off;
+    loff_t out_pos = out_off;
+    while (count > 0) {
+        ssize_t wr = copy_file_range(in, &in_pos, out, &out_pos, chunk_of(count), 0);
+        if (wr > 0) {
+            count -= (size_t) wr;
+            continue;
+        }
+        if (wr == 0) {
+            errno = EIO;
+            return -1;
+        }
+        if (unsupported(errno)) {
+            break;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    char buf[SIO_BUF_SIZE];
+    while (count > 0) {
+        size_t n = count < sizeof(buf) ? count : sizeof(buf);
+        if (sio_pread_full(in, buf, n, in_pos) != 0 || sio_pwrite_full(out, buf, n, out_pos) != 0) {
+            return -1;
+        }
+        in_pos += (loff_t) n;
+        out_pos += (loff_t) n;
+        count -= n;
+    }
+    return 0;
+}
+
+ssize_t sio_drain(int fd, size_t count) {
+    char buf[SIO_BUF_SIZE];
+    size_t done = 0;
+    while (done < count) {
+        size_t n = count - done < sizeof(buf) ? count - done : sizeof(buf);
+        ssize_t rd = read(fd, buf, n);
+        if (rd > 0) {
+            done += (size_t) rd;
+        } else if (rd == 0) {
+            break;
+        } else if (retry(fd, POLLIN) != 0) {
+            return -1;
+        }
+    }
+    return (ssize_t) done;
+}
+
+void sio_reader_init(sio_reader_t *r, int fd) {
+    r->fd = fd;
+    r->pos = 0;
+    r->len = 0;
+}
+
+ssize_t sio_reader_fill(sio_reader_t *r) {
+    r->pos = 0;
+    r->len = 0;
+    while (1) {
+        ssize_t rd = read(r->fd, r->buf, sizeof(r->buf));
+        if (rd >= 0) {
+            r->len = (size_t) rd;
+            return rd;
+        }
+        if (retry(r->fd, POLLIN) != 0) {
+            return -1;
+        }
+    }
+}
+
+size_t sio_reader_buffered(const sio_reader_t *r) {
+    return r->len - r->pos;
+}
+
+ssize_t sio_read_line(sio_reader_t *r, char *buf, size_t size) {
+    if (size == 0) {
+        return -1;
+    }
+    size_t idx = 0;
+    while (1) {
+        if (r->pos == r->len) {
+            ssize_t rd = sio_reader_fill(r);
+            if (rd <= 0) {
+                return (rd == 0 && idx == 0) ? 0 : -1;
+            }
+        }
+        char *start = r->buf + r->pos;
+        size_t avail = r->len - r->pos;
+        char *nl = memchr(start, '\n', avail);
+        size_t n = nl != NULL ? (size_t) (nl - start) : avail;
+        if (n > size - 1 - idx) {
+            return -1;
+        }
+        memcpy(buf + idx, start, n);
+        idx += n;
+        if (nl != NULL) {
+            r->pos += n + 1;
+            buf[idx] = '\0';
+            return (ssize_t) idx;
+        }
+        r->pos = r->len;
+    }
+}
+
+ssize_t sio_read_until(sio_reader_t *r, char *buf, size_t size, const char *delim) {
+    size_t dlen = strlen(delim);
+    if (size == 0 || dlen == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t len = 0;
+    while (1) {
+        if (r->pos == r->len) {
+            ssize_t rd = sio_reader_fill(r);
+            if (rd <= 0) {
+                return (rd == 0 && len == 0) ? 0 : -1;
+            }
+        }
+        size_t take = r->len - r->pos;
+        if (take > size - 1 - len) {
+            take = size - 1 - len;
+        }
+        if (take == 0) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        // delim may straddle what was copied before and what is copied now.
+        size_t from = len >= dlen - 1 ? len - (dlen - 1) : 0;
+        memcpy(buf + len, r->buf + r->pos, take);
+        len += take;
+        char *hit = memmem(buf + from, len - from, delim, dlen);
+        if (hit != NULL) {
+            size_t end = (size_t) (hit - buf) + dlen;
+            r->pos += take - (len - end);
+            buf[end] = '\0';
+            return (ssize_t) end;
+        }
+        r->pos += take;
+    }
+}
+
+ssize_t sio_read_exact(sio_reader_t *r, void *buf, size_t n) {
+    size_t have = sio_reader_buffered(r);
+    if (have > n) {
+        have = n;
+    }
+    memcpy(buf, r->buf + r->pos, have);
+    r->pos += have;
+    if (have == n) {
+        return (ssize_t) n;
+    }
+    // Whatever is left is payload, so skip the buffer and read it in place.
+    ssize_t rd = sio_read_full(r->fd, (char *) buf + have, n - have);
+    return rd < 0 ? -1 : (ssize_t) have + rd;
+}
+
+int sio_reader_transfer(sio_reader_t *r, int out, size_t count, size_t *moved) {
+    size_t have = sio_reader_buffered(r);
+    if (have > count) {
+        have = count;
+    }
+    *moved = 0;
+    if (have > 0 && sio_write_full(out, r->buf + r->pos, have) != 0) {
+        return -1;
+    }
+    r->pos += have;
+    size_t rest = 0;
+    int rc = sio_transfer(out, r->fd, count - have, &rest);
+    *moved = have + rest;
+    return rc;
+}
+
+int sio_reader_discard(sio_reader_t *r, size_t count) {
+    size_t have = sio_reader_buffered(r);
+    if (have > count) {
+        have = count;
+    }
+    r->pos += have;
+    ssize_t rd = sio_drain(r->fd, count - have);
+    if (rd < 0) {
+        return -1;
+    }
+    if ((size_t) rd < count - have) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+void sio_writer_init(sio_writer_t *w, int fd) {
+    w->fd = fd;
+    w->len = 0;
+}
+
+int sio_writer_put(sio_writer_t *w, const void *buf, size_t n) {
+    if (n <= sizeof(w->buf) - w->len) {
+        memcpy(w->buf + w->len, buf, n);
+        w->len += n;
+        return 0;
+    }
+    struct iovec iov[2] = { { w->buf, w->len }, { (void *) buf, n } };
+    w->len = 0;
+    return sio_writev_full(w->fd, iov, 2);
+}
+
+int sio_writer_printf(sio_writer_t *w, const char *fmt, ...) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t space = sizeof(w->buf) - w->len;
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(w->buf + w->len, space, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t) n < space) {
+            w->len += (size_t) n;
+            return 0;
+        }
+        if (sio_writer_flush(w) != 0) {
+            return -1;
+        }
+    }
+    errno = EOVERFLOW;
+    return -1;
+}
+
+int sio_writer_put_file(sio_writer_t *w, int in, off_t off, size_t count) {
+    if (count > sizeof(w->buf)) {
+        return sio_writer_flush(w) == 0 ? sio_transfer_at(w->fd, in, off, count) : -1;
+    }
+    if (count > sizeof(w->buf) - w->len && sio_writer_flush(w) != 0) {
+        return -1;
+    }
+    if (sio_pread_full(in, w->buf + w->len, count, off) != 0) {
+        return -1;
+    }
+    w->len += count;
+    return 0;
+}
+
+int sio_writer_flush(sio_writer_t *w) {
+    size_t n = w->len;
+    w->len = 0;
+    return n > 0 ? sio_write_full(w->fd, w->buf, n) : 0;
+}
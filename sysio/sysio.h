@@ -0,0 +1,192 @@
+#pragma once
+
+/**
+ *  Complete-transfer I/O shared by HTTPserver and cmdlinemem.
+ *
+ *  Every call here retries after EINTR, and after EAGAIN on a non-blocking
+ *  descriptor it waits in poll() and carries on, so the caller only ever
+ *  sees a finished transfer, EOF, or a real error (-1 with errno set).
+ *
+ *  sio_transfer picks the cheapest way to move bytes between two
+ *  descriptors from their types: copy_file_range between regular files,
+ *  splice when either end is a pipe, sendfile from a regular file, splice
+ *  through a private pipe from a socket, and a read/write loop otherwise.
+ *  A kernel path the descriptors turn out not to support is dropped for the
+ *  next one before any bytes have moved.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SIO_BUF_SIZE 65536
+
+/** @brief Reads n bytes into buf, stopping early only at EOF.
+ *
+ *  @return The number of bytes read, or -1.
+ */
+ssize_t sio_read_full(int fd, void *buf, size_t n);
+
+/** @brief Writes all n bytes of buf.
+ *
+ *  @return 0, or -1.
+ */
+int sio_write_full(int fd, const void *buf, size_t n);
+
+/** @brief Writes every byte described by iov, in one writev() when the
+ *         kernel takes it all. The iovec array is updated in place.
+ *
+ *  @return 0, or -1.
+ */
+int sio_writev_full(int fd, struct iovec *iov, int iovcnt);
+
+/** @brief Reads n bytes at offset off without moving the file position.
+ *
+ *  @return 0, or -1; EOF before n bytes is reported as EIO.
+ */
+int sio_pread_full(int fd, void *buf, size_t n, off_t off);
+
+/** @brief Writes n bytes at offset off without moving the file position.
+ *
+ *  @return 0, or -1.
+ */
+int sio_pwrite_full(int fd, const void *buf, size_t n, off_t off);
+
+/** @brief Moves count bytes from in to out, or fewer if in hits EOF first,
+ *         using each descriptor's current position. Pass SIZE_MAX to copy
+ *         until EOF.
+ *
+ *  @param moved Set to the number of bytes moved, also on failure.
+ *
+ *  @return 0, or -1.
+ */
+int sio_transfer(int out, int in, size_t count, size_t *moved);
+
+/** @brief Writes count bytes of the file in, starting at offset off, to
+ *         out. in's file position is left alone, so several threads may
+ *         share it.
+ *
+ *  @return 0, or -1; a file shorter than off + count is reported as EIO.
+ */
+int sio_transfer_at(int out, int in, off_t off, size_t count);
+
+/** @brief Copies count bytes between offsets of two regular files, leaving
+ *         both file positions alone.
+ *
+ *  @return 0, or -1; a source shorter than in_off + count is reported as
+ *          EIO.
+ */
+int sio_copy_range(int out, off_t out_off, int in, off_t in_off, size_t count);
+
+/** @brief Reads and throws away up to count bytes; SIZE_MAX means until
+ *         EOF.
+ *
+ *  @return The number of bytes discarded, or -1.
+ */
+ssize_t sio_drain(int fd, size_t count);
+
+/** @brief A read buffer in front of a descriptor, for protocols that mix
+ *         text lines with raw payloads.
+ */
+typedef struct {
+    int fd;
+    size_t pos;
+    size_t len;
+    char buf[SIO_BUF_SIZE];
+} sio_reader_t;
+
+/** @brief Points r at fd with an empty buffer.
+ */
+void sio_reader_init(sio_reader_t *r, int fd);
+
+/** @brief Refills r's empty buffer with a single read().
+ *
+ *  @return The number of bytes now buffered, 0 at EOF, or -1.
+ */
+ssize_t sio_reader_fill(sio_reader_t *r);
+
+/** @brief The number of bytes read from the descriptor but not yet
+ *         consumed.
+ */
+size_t sio_reader_buffered(const sio_reader_t *r);
+
+/** @brief Reads a '\n'-terminated line into buf without the '\n'.
+ *
+ *  @return The line's length; 0 at EOF before any byte; -1 on error, on
+ *          EOF inside a line, or if the line doesn't fit in size bytes.
+ */
+ssize_t sio_read_line(sio_reader_t *r, char *buf, size_t size);
+
+/** @brief Reads through the first occurrence of delim into buf, delim
+ *         included, and NUL-terminates it. Bytes after delim stay in r.
+ *
+ *  @return The length read; 0 at EOF before any byte; -1 on error, on EOF
+ *          before delim, or (EMSGSIZE) if delim isn't within size - 1 bytes.
+ */
+ssize_t sio_read_until(sio_reader_t *r, char *buf, size_t size, const char *delim);
+
+/** @brief Reads n bytes, taking buffered ones first and reading the rest
+ *         straight into buf.
+ *
+ *  @return The number of bytes read, fewer than n only at EOF, or -1.
+ */
+ssize_t sio_read_exact(sio_reader_t *r, void *buf, size_t n);
+
+/** @brief Moves count bytes from r to out: buffered bytes first, then the
+ *         rest with sio_transfer.
+ *
+ *  @param moved Set to the number of bytes moved, also on failure.
+ *
+ *  @return 0 (possibly short at EOF), or -1.
+ */
+int sio_reader_transfer(sio_reader_t *r, int out, size_t count, size_t *moved);
+
+/** @brief Throws away count bytes of r.
+ *
+ *  @return 0, or -1 on error or EOF.
+ */
+int sio_reader_discard(sio_reader_t *r, size_t count);
+
+/** @brief A write buffer in front of a descriptor, so many small responses
+ *         leave in one system call.
+ */
+typedef struct {
+    int fd;
+    size_t len;
+    char buf[SIO_BUF_SIZE];
+} sio_writer_t;
+
+/** @brief Points w at fd with an empty buffer.
+ */
+void sio_writer_init(sio_writer_t *w, int fd);
+
+/** @brief Appends n bytes. What doesn't fit goes out together with the
+ *         buffer in one writev().
+ *
+ *  @return 0, or -1.
+ */
+int sio_writer_put(sio_writer_t *w, const void *buf, size_t n);
+
+/** @brief Appends printf-formatted text of less than SIO_BUF_SIZE bytes.
+ *
+ *  @return 0, or -1.
+ */
+int sio_writer_printf(sio_writer_t *w, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/** @brief Appends count bytes of the file in, starting at offset off,
+ *         leaving in's file position alone. Contents that fit the buffer
+ *         are read into it, to leave with whatever else is buffered; larger
+ *         ones are sent with sio_transfer_at after a flush.
+ *
+ *  @return 0, or -1; a file shorter than off + count is reported as EIO.
+ */
+int sio_writer_put_file(sio_writer_t *w, int in, off_t off, size_t count);
+
+/** @brief Writes out everything buffered. Call it before writing to the
+ *         descriptor directly, and before waiting on the peer.
+ *
+ *  @return 0, or -1.
+ */
+int sio_writer_flush(sio_writer_t *w);
@@ -0,0 +1,93 @@
+#pragma once
+
+/**
+ *  Static user-space tracepoints (USDT) for HTTPserver and ccdatastruct.
+ *
+ *  USDT_PROBEn(provider, name, args...) marks a tracepoint with n integer or
+ *  pointer arguments. It compiles to a single nop plus an ELF note in
+ *  .note.stapsdt, the format bpftrace, perf and SystemTap read, so a probe
+ *  costs nothing until a tracer attaches, and attaching needs no rebuild:
+ *
+ *      bpftrace -e 'usdt:./httpserver:httpserver:request_start { ... }'
+ *
+ *  <sys/sdt.h> is used when the system has it. Otherwise the note is
+ *  emitted here for x86-64 (every argument is passed as a signed 64-bit
+ *  value). On other targets, or with -DUSDT_DISABLE, probes compile to
+ *  nothing. Arguments should be cheap expressions: they are evaluated even
+ *  when nothing is attached.
+ */
+
+#if defined(USDT_DISABLE)
+#define USDT_IMPL_NONE
+#elif defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define USDT_IMPL_SDT
+#endif
+#endif
+#if !defined(USDT_IMPL_NONE) && !defined(USDT_IMPL_SDT)
+#if defined(__x86_64__) && defined(__GNUC__)
+#define USDT_IMPL_X86_64
+#else
+#define USDT_IMPL_NONE
+#endif
+#endif
+
+#if defined(USDT_IMPL_SDT)
+
+#include <sys/sdt.h>
+
+#define USDT_PROBE0(provider, name)          DTRACE_PROBE(provider, name)
+#define USDT_PROBE1(provider, name, a)       DTRACE_PROBE1(provider, name, a)
+#define USDT_PROBE2(provider, name, a, b)    DTRACE_PROBE2(provider, name, a, b)
+#define USDT_PROBE3(provider, name, a, b, c) DTRACE_PROBE3(provider, name, a, b, c)
+
+#elif defined(USDT_IMPL_X86_64)
+
+// The same note layout <sys/sdt.h> emits: the probe's address, the address
+// of the .stapsdt.base anchor (so tools can correct for prelinking), a zero
+// semaphore address, then provider, name and argument strings such as
+// "-8@%rdi -8@$3".
+#define USDT_ARG_(x) "nor"((long long) (x))
+#define USDT_OPS_(...) __VA_ARGS__
+#define USDT_NOTE_(provider, name, argfmt, ops)                                        \
+    __asm__ __volatile__("990: nop\n"                                                  \
+                         ".pushsection .note.stapsdt,\"\",\"note\"\n"                  \
+                         ".balign 4\n"                                                 \
+                         ".4byte 992f-991f, 994f-993f, 3\n"                            \
+                         "991: .asciz \"stapsdt\"\n"                                   \
+                         "992: .balign 4\n"                                            \
+                         "993: .8byte 990b\n"                                          \
+                         ".8byte _.stapsdt.base\n"                                     \
+                         ".8byte 0\n"                                                  \
+                         ".asciz \"" #provider "\"\n"                                  \
+                         ".asciz \"" #name "\"\n"                                      \
+                         ".asciz \"" argfmt "\"\n"                                     \
+                         "994: .balign 4\n"                                            \
+                         ".popsection\n"                                               \
+                         ".ifndef _.stapsdt.base\n"                                    \
+                         ".pushsection .stapsdt.base,\"aG\",\"progbits\","             \
+                         ".stapsdt.base,comdat\n"                                      \
+                         ".weak _.stapsdt.base\n"                                      \
+                         ".hidden _.stapsdt.base\n"                                    \
+                         "_.stapsdt.base: .space 1\n"                                  \
+                         ".size _.stapsdt.base, 1\n"                                   \
+                         ".popsection\n"                                               \
+                         ".endif\n"                                                    \
+                         :                                                             \
+                         : USDT_OPS_ ops)
+
+#define USDT_PROBE0(provider, name) USDT_NOTE_(provider, name, "", ())
+#define USDT_PROBE1(provider, name, a) USDT_NOTE_(provider, name, "-8@%0", (USDT_ARG_(a)))
+#define USDT_PROBE2(provider, name, a, b)                                              \
+    USDT_NOTE_(provider, name, "-8@%0 -8@%1", (USDT_ARG_(a), USDT_ARG_(b)))
+#define USDT_PROBE3(provider, name, a, b, c)                                           \
+    USDT_NOTE_(provider, name, "-8@%0 -8@%1 -8@%2", (USDT_ARG_(a), USDT_ARG_(b), USDT_ARG_(c)))
+
+#else
+
+#define USDT_PROBE0(provider, name)          ((void) 0)
+#define USDT_PROBE1(provider, name, a)       ((void) sizeof(a))
+#define USDT_PROBE2(provider, name, a, b)    ((void) sizeof(a), (void) sizeof(b))
+#define USDT_PROBE3(provider, name, a, b, c) ((void) sizeof(a), (void) sizeof(b), (void) sizeof(c))
+
+#endif